@@ -4,501 +4,10389 @@ players can interact with each other in a virtual world.
  synchronization between players, and game logic for collaborative gameplay experiences?*/
 
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <stdexcept>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <shared_mutex>
+#include <random>
+#include <array>
+#include <filesystem>
+#include <cctype>
+#include <cmath>
+#include <ctime>
+#include <csignal>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <deque>
+#include <condition_variable>
+#include <exception>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define HAVE_COROUTINES 1 // Chat sessions run as coroutines on an event loop (C++20)
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-// Base class for all message types
-class Message
-{
-protected:
-    string content;
+// Heap allocation counter for --bench; build with -DCOUNT_ALLOCATIONS to enable it
+atomic<uint64_t> heapAllocations{0};
 
-public:
-    Message(const string &content) : content(content) {}
-    virtual string getType() const = 0;
-    virtual string getContent() const
+#ifdef COUNT_ALLOCATIONS
+// GCC flags free() on memory it saw come from new, even though this operator new uses malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(size_t size)
+{
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    void *block = malloc(size == 0 ? 1 : size);
+    if (block == nullptr)
     {
-        return content;
+        throw bad_alloc();
     }
-    virtual ~Message() {}
+    return block;
+}
+
+void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+    free(block);
+}
+#endif
+
+// Kind of content a message carries
+enum class MessageKind : uint8_t
+{
+    Text,
+    Image,
+    VoiceNote
 };
 
-// Derived class for text messages
-class TextMessage : public Message
+// Whether the message was sent by us or received from the other user
+enum class MessageDirection : uint8_t
 {
-public:
-    TextMessage(const string &content) : Message(content) {}
-    string getType() const override
-    {
-        return "\t\tSent Text";
-    }
+    Sent,
+    Received
 };
 
-// Derived class for image messages
-class ImageMessage : public Message
+// Compact record for one message: a view of the payload bytes plus kind and direction tags
+struct MessageRecord
 {
-public:
-    ImageMessage(const string &content) : Message(content) {}
-    string getType() const override
-    {
-        return "\t\tSent Image";
-    }
+    const char *payload;
+    uint32_t length;
+    MessageKind kind;
+    MessageDirection direction;
 };
 
-// Derived class for voice note messages
-class VoiceNoteMessage : public Message
+// Type labels shown in the chat history, indexed by [direction][kind]
+constexpr string_view MESSAGE_TYPE_NAMES[2][3] = {
+    {"\t\tSent Text", "\t\tSent Image", "\t\tSent Voice Note"},
+    {"Received Text", "Received Image", "Received Voice Note"}};
+
+inline string_view messageTypeName(MessageDirection direction, MessageKind kind)
+{
+    return MESSAGE_TYPE_NAMES[static_cast<int>(direction)][static_cast<int>(kind)];
+}
+
+// Read-only view of a stored message, kept for callers of the old Message API
+class Message
 {
+private:
+    const MessageRecord *record;
+
 public:
-    VoiceNoteMessage(const string &content) : Message(content) {}
-    string getType() const override
+    explicit Message(const MessageRecord *record) : record(record) {}
+
+    // The label as a string, built once per label instead of on every call
+    const string &getType() const
     {
-        return "\t\tSent Voice Note";
+        static const string LABELS[2][3] = {
+            {string(MESSAGE_TYPE_NAMES[0][0]), string(MESSAGE_TYPE_NAMES[0][1]), string(MESSAGE_TYPE_NAMES[0][2])},
+            {string(MESSAGE_TYPE_NAMES[1][0]), string(MESSAGE_TYPE_NAMES[1][1]), string(MESSAGE_TYPE_NAMES[1][2])}};
+        return LABELS[static_cast<int>(record->direction)][static_cast<int>(record->kind)];
     }
-};
 
-// Derived class for received text messages
-class ReceivedTextMessage : public Message
-{
-public:
-    ReceivedTextMessage(const string &content) : Message(content) {}
-    string getType() const override
+    // Label from the static table, no allocation
+    string_view getTypeName() const
     {
-        return "Received Text";
+        return messageTypeName(record->direction, record->kind);
     }
-};
 
-// Derived class for received image messages
-class ReceivedImageMessage : public Message
-{
-public:
-    ReceivedImageMessage(const string &content) : Message(content) {}
-    string getType() const override
+    string getContent() const
+    {
+        return string(getContentView());
+    }
+
+    // View of the stored payload, valid as long as the conversation is
+    string_view getContentView() const
+    {
+        return string_view(record->payload, record->length);
+    }
+
+    MessageKind getKind() const
+    {
+        return record->kind;
+    }
+
+    MessageDirection getDirection() const
+    {
+        return record->direction;
+    }
+
+    const MessageRecord &getRecord() const
     {
-        return "Received Image";
+        return *record;
     }
 };
 
-// Derived class for received voice note messages
-class ReceivedVoiceNoteMessage : public Message
+// Append-only slab allocator backing a segment of messages
+// Nothing is freed individually: the slabs are released together when the arena goes away.
+// Slabs start small and double, so short conversations do not pin a full slab each.
+class MessageArena
 {
+private:
+    static const size_t FIRST_SLAB_SIZE = 1024;
+    static const size_t MAX_SLAB_SIZE = 64 * 1024;
+
+    vector<char *> slabs;
+    char *cursor = nullptr;
+    size_t remaining = 0;
+    size_t reserved = 0;
+    size_t nextSlabSize = FIRST_SLAB_SIZE;
+
 public:
-    ReceivedVoiceNoteMessage(const string &content) : Message(content) {}
-    string getType() const override
+    MessageArena() {}
+    MessageArena(const MessageArena &) = delete;
+    MessageArena &operator=(const MessageArena &) = delete;
+
+    void *allocate(size_t size, size_t align)
+    {
+        size_t padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+        if (cursor == nullptr || padding + size > remaining)
+        {
+            // Oversized requests get a slab of their own so the current slab keeps filling up
+            if (size + align > MAX_SLAB_SIZE)
+            {
+                char *slab = new char[size + align];
+                slabs.push_back(slab);
+                reserved += size + align;
+                return slab + (align - reinterpret_cast<uintptr_t>(slab) % align) % align;
+            }
+            while (nextSlabSize < size + align)
+            {
+                nextSlabSize *= 2;
+            }
+            char *slab = new char[nextSlabSize];
+            slabs.push_back(slab);
+            reserved += nextSlabSize;
+            padding = (align - reinterpret_cast<uintptr_t>(slab) % align) % align;
+            cursor = slab;
+            remaining = nextSlabSize;
+            nextSlabSize = nextSlabSize * 2 > MAX_SLAB_SIZE ? MAX_SLAB_SIZE : nextSlabSize * 2;
+        }
+        char *result = cursor + padding;
+        cursor += padding + size;
+        remaining -= padding + size;
+        return result;
+    }
+
+    size_t getReservedBytes() const
+    {
+        return reserved;
+    }
+
+    ~MessageArena()
     {
-        return "Received Voice Note";
+        for (auto slab : slabs)
+        {
+            delete[] slab;
+        }
     }
 };
 
-class Logindetails
+// Immutable, reference-counted message payload shared by every conversation holding the message
+// The bytes are stored inline right after the header, so a body is a single allocation.
+class SharedBody
 {
 private:
-    string pass;
+    atomic<uint32_t> references;
+    uint32_t length;
+
+    explicit SharedBody(uint32_t length) : references(1), length(length) {}
 
 public:
-    string username;
-    int friends;
-    float co;
-    Logindetails(string a, string f, int c, float g)
+    // Returns a body holding one reference for the caller
+    static SharedBody *create(string_view content)
     {
-        pass = a;
-        username = f;
-        friends = c;
-        co = g;
+        if (content.size() > UINT32_MAX)
+        {
+            throw length_error("Message is too large");
+        }
+        void *memory = ::operator new(sizeof(SharedBody) + content.size());
+        SharedBody *body = new (memory) SharedBody(static_cast<uint32_t>(content.size()));
+        content.copy(const_cast<char *>(body->data()), content.size());
+        return body;
+    }
+
+    SharedBody(const SharedBody &) = delete;
+    SharedBody &operator=(const SharedBody &) = delete;
+
+    void retain()
+    {
+        references.fetch_add(1, memory_order_relaxed);
+    }
+
+    void release()
+    {
+        if (references.fetch_sub(1, memory_order_acq_rel) == 1)
+        {
+            this->~SharedBody();
+            ::operator delete(this);
+        }
+    }
+
+    const char *data() const
+    {
+        return reinterpret_cast<const char *>(this + 1);
+    }
+
+    uint32_t size() const
+    {
+        return length;
     }
 };
 
-// Base class for all conversation types
-class Conversation
+// Fast byte-oriented LZ77 compressor in the spirit of LZ4, used for spilled history
+// A block is a run of sequences: a token (literal count in the high nibble, match length
+// minus 4 in the low nibble, 15 meaning more length bytes follow), the literals, then a
+// 2-byte little-endian match offset, except in the last sequence which ends after its literals.
+// With a dictionary, the block behaves as if it followed the dictionary bytes, so matches
+// may reach back into them; every block still decodes on its own given the same dictionary.
+class BlockCodec
 {
-protected:
-    string username;
-    vector<Message *> messages; // Store multiple messages for each user
+private:
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_OFFSET = 65535;
+    static const int HASH_BITS = 13;
 
-public:
-    virtual void startConversation() = 0;
-    virtual void startreceivedConversation() = 0;
+    static void putLength(string &out, size_t length)
+    {
+        while (length >= 255)
+        {
+            out.push_back(static_cast<char>(255));
+            length -= 255;
+        }
+        out.push_back(static_cast<char>(length));
+    }
 
-    string getUsername() const
+    static bool getLength(const uint8_t *&pos, const uint8_t *end, size_t &length)
     {
-        return username;
+        uint8_t byte;
+        do
+        {
+            if (pos >= end)
+            {
+                return false;
+            }
+            byte = *pos++;
+            length += byte;
+        } while (byte == 255);
+        return true;
     }
 
-    const vector<Message *> &getMessages() const
+    static void putSequence(string &out, const char *literals, size_t literalCount, size_t offset, size_t matchLength)
     {
-        return messages;
+        size_t matchCode = matchLength == 0 ? 0 : matchLength - MIN_MATCH;
+        out.push_back(static_cast<char>(min<size_t>(literalCount, 15) << 4 | min<size_t>(matchCode, 15)));
+        if (literalCount >= 15)
+        {
+            putLength(out, literalCount - 15);
+        }
+        out.append(literals, literalCount);
+        if (matchLength == 0)
+        {
+            return;
+        }
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15)
+        {
+            putLength(out, matchCode - 15);
+        }
     }
 
-    vector<Message *> &getMutableMessages()
+public:
+    // Appends the compressed form of data to out
+    static void compress(const char *data, size_t size, string &out, string_view dictionary = string_view())
     {
-        return messages;
+        vector<uint32_t> table(size_t(1) << HASH_BITS, UINT32_MAX); // Last position of each 4-byte hash
+        size_t anchor = 0;
+        size_t pos = 0;
+        string window;
+        if (!dictionary.empty())
+        {
+            // Positions count from the start of the dictionary, which seeds the hash table
+            window.reserve(dictionary.size() + size);
+            window.append(dictionary);
+            window.append(data, size);
+            for (pos = 0; pos + MIN_MATCH <= dictionary.size(); pos++)
+            {
+                uint32_t sequence;
+                memcpy(&sequence, window.data() + pos, sizeof(sequence));
+                table[(sequence * 2654435761u) >> (32 - HASH_BITS)] = static_cast<uint32_t>(pos);
+            }
+            data = window.data();
+            size = window.size();
+            pos = anchor = dictionary.size();
+        }
+        while (pos + MIN_MATCH <= size)
+        {
+            uint32_t sequence;
+            memcpy(&sequence, data + pos, sizeof(sequence));
+            uint32_t slot = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            uint32_t candidate = table[slot];
+            table[slot] = static_cast<uint32_t>(pos);
+            if (candidate != UINT32_MAX && pos - candidate <= MAX_OFFSET && memcmp(data + candidate, data + pos, MIN_MATCH) == 0)
+            {
+                size_t length = MIN_MATCH;
+                while (pos + length < size && data[candidate + length] == data[pos + length])
+                {
+                    length++;
+                }
+                putSequence(out, data + anchor, pos - anchor, pos - candidate, length);
+                pos += length;
+                anchor = pos;
+            }
+            else
+            {
+                pos++;
+            }
+        }
+        putSequence(out, data + anchor, size - anchor, 0, 0);
     }
 
-    virtual ~Conversation()
+    // Decompresses exactly outSize bytes into out, using the dictionary the block was
+    // compressed with; throws on corrupt input
+    static void decompress(const char *data, size_t size, char *out, size_t outSize, string_view dictionary = string_view())
     {
-        for (auto msg : messages)
+        const uint8_t *pos = reinterpret_cast<const uint8_t *>(data);
+        const uint8_t *end = pos + size;
+        size_t written = 0;
+        while (pos < end)
+        {
+            uint8_t token = *pos++;
+            size_t literals = token >> 4;
+            if ((literals == 15 && !getLength(pos, end, literals)) || literals > static_cast<size_t>(end - pos) || literals > outSize - written)
+            {
+                throw runtime_error("Corrupt compressed block");
+            }
+            memcpy(out + written, pos, literals);
+            pos += literals;
+            written += literals;
+            if (pos == end)
+            {
+                break;
+            }
+            size_t length = token & 15;
+            if (end - pos < 2)
+            {
+                throw runtime_error("Corrupt compressed block");
+            }
+            size_t offset = pos[0] | static_cast<size_t>(pos[1]) << 8;
+            pos += 2;
+            if ((length == 15 && !getLength(pos, end, length)) || offset == 0 || offset > written + dictionary.size() ||
+                length + MIN_MATCH > outSize - written)
+            {
+                throw runtime_error("Corrupt compressed block");
+            }
+            length += MIN_MATCH;
+            size_t i = 0;
+            // The part of the match that lies in the dictionary
+            for (; offset > written + i && i < length; i++)
+            {
+                out[written + i] = dictionary[dictionary.size() - (offset - written - i)];
+            }
+            if (offset >= length - i)
+            {
+                memcpy(out + written + i, out + written + i - offset, length - i);
+            }
+            else
+            {
+                // Byte by byte, since the match overlaps the bytes it produces
+                for (; i < length; i++)
+                {
+                    out[written + i] = out[written + i - offset];
+                }
+            }
+            written += length;
+        }
+        if (written != outSize)
         {
-            delete msg;
+            throw runtime_error("Corrupt compressed block");
         }
     }
 };
 
-// Derived class for a conversation with multimedia support
-class MultimediaConversation : public Conversation
+// Builds a shared compression dictionary from sample messages, in the style of zstd's COVER
+// trainer: the samples are cut into candidate segments, each scored by how often its 6-byte
+// substrings occur across all samples, and the best segments are picked greedily, with
+// substrings already covered no longer counting. The most valuable segments go last, where
+// matches against them are shortest.
+class DictionaryTrainer
 {
-public:
-    void startConversation() override
+private:
+    static const size_t GRAM = 6;
+    static const size_t SEGMENT = 48;
+    static const size_t STEP = 16;
+
+    static uint64_t gramAt(const char *p)
     {
-        try
+        uint64_t gram = 0;
+        memcpy(&gram, p, GRAM);
+        return gram;
+    }
+
+    static uint64_t score(string_view segment, const unordered_map<uint64_t, uint32_t> &frequency)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i + GRAM <= segment.size(); i++)
         {
-            cout << "Enter the username you want to send a message to: ";
-            getline(cin, username);
+            auto it = frequency.find(gramAt(segment.data() + i));
+            total += it == frequency.end() ? 0 : it->second;
+        }
+        return total;
+    }
 
-            int ch;
-            do
+public:
+    static string train(const vector<string_view> &samples, size_t capacity)
+    {
+        unordered_map<uint64_t, uint32_t> frequency;
+        for (string_view sample : samples)
+        {
+            for (size_t i = 0; i + GRAM <= sample.size(); i++)
             {
-                // Clear the screen
-                cout << "\n\t\t-----------------------------\n";
-                cout << "\t\tSelect type of message:\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "\t\t1. Send Text Messages\n";
-                cout << "\t\t2. Send Image or GIF\n";
-                cout << "\t\t3. Send Voice Note\n";
-                cout << "\t\t4. Back\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "Enter your choice: ";
-                cin >> ch;
-                cin.ignore(); // Clear newline character from buffer
+                frequency[gramAt(sample.data() + i)]++;
+            }
+        }
 
-                switch (ch)
-                {
-                case 1:
-                    sendTextMessage();
-                    break;
-                case 2:
-                    sendImageMessage();
-                    break;
-                case 3:
-                    sendVoiceNoteMessage();
-                    break;
-                case 4:
-                    break;
-                default:
-                    cout << "Error  :  Invalid choice!\n";
-                }
-            } while (ch != 4);
+        // Lazy greedy selection: a popped score is only stale-high, so re-score and retry
+        priority_queue<pair<uint64_t, string_view>> candidates;
+        for (string_view sample : samples)
+        {
+            for (size_t start = 0; start + GRAM <= sample.size(); start += STEP)
+            {
+                string_view segment = sample.substr(start, SEGMENT);
+                candidates.push(make_pair(score(segment, frequency), segment));
+            }
         }
-        catch (const exception &e)
+        vector<string_view> chosen;
+        size_t used = 0;
+        while (!candidates.empty() && used < capacity)
         {
-            cout << "An error occurred: " << e.what() << endl;
+            pair<uint64_t, string_view> top = candidates.top();
+            candidates.pop();
+            uint64_t current = score(top.second, frequency);
+            if (current == 0)
+            {
+                continue;
+            }
+            if (!candidates.empty() && current < candidates.top().first)
+            {
+                candidates.push(make_pair(current, top.second));
+                continue;
+            }
+            string_view segment = top.second.substr(0, capacity - used);
+            chosen.push_back(segment);
+            used += segment.size();
+            for (size_t i = 0; i + GRAM <= segment.size(); i++)
+            {
+                frequency[gramAt(segment.data() + i)] = 0;
+            }
+        }
+
+        string dictionary;
+        dictionary.reserve(used);
+        for (auto it = chosen.rbegin(); it != chosen.rend(); ++it)
+        {
+            dictionary.append(*it);
         }
+        return dictionary;
     }
+};
+
+// Scratch file holding compressed history segments evicted from memory
+// It is a cache rather than durable state (the message log is), so it starts empty on every
+// open, and space of segments that are dropped or paged back in is not reused.
+class SpillFile
+{
+private:
+#ifdef _WIN32
+    FILE *file = nullptr;
+#else
+    int fd = -1;
+#endif
+    uint64_t length = 0;
 
-    void startreceivedConversation() override
+public:
+    explicit SpillFile(const string &path)
     {
-        try
+#ifdef _WIN32
+        file = fopen(path.c_str(), "w+b");
+        if (file == nullptr)
         {
-            cout << "Enter the username from whom message received: ";
-            getline(cin, username);
+            throw runtime_error("Cannot open spill file " + path);
+        }
+#else
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            throw runtime_error("Cannot open spill file " + path + ": " + strerror(errno));
+        }
+#endif
+    }
 
-            int ch;
-            do
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    // Appends a blob and returns its offset
+    uint64_t write(const string &blob)
+    {
+        uint64_t offset = length;
+#ifdef _WIN32
+        if (_fseeki64(file, static_cast<long long>(offset), SEEK_SET) != 0 || fwrite(blob.data(), 1, blob.size(), file) != blob.size())
+        {
+            throw runtime_error("Cannot write spill file");
+        }
+#else
+        size_t written = 0;
+        while (written < blob.size())
+        {
+            ssize_t n = pwrite(fd, blob.data() + written, blob.size() - written, static_cast<off_t>(offset + written));
+            if (n < 0)
             {
-                // Clear the screen
-                cout << "\n\t\t-----------------------------\n";
-                cout << "\t\tSelect type of message to received:\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "\t\t1. Received Text Message\n";
-                cout << "\t\t2. Received Image Message\n";
-                cout << "\t\t3. Received Voice Note Message\n";
-                cout << "\t\t4. Back\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "Enter your choice: ";
-                cin >> ch;
-                cin.ignore(); // Clear newline character from buffer
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw runtime_error(string("Cannot write spill file: ") + strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+#endif
+        length += blob.size();
+        return offset;
+    }
 
-                switch (ch)
+    void read(uint64_t offset, size_t size, string &blob)
+    {
+        blob.resize(size);
+#ifdef _WIN32
+        if (_fseeki64(file, static_cast<long long>(offset), SEEK_SET) != 0 || fread(&blob[0], 1, size, file) != size)
+        {
+            throw runtime_error("Cannot read spill file");
+        }
+#else
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = pread(fd, &blob[done], size - done, static_cast<off_t>(offset + done));
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
                 {
-                case 1:
-                    receiveTextMessage();
-                    break;
-                case 2:
-                    receiveImageMessage();
-                    break;
+                    continue;
+                }
+                throw runtime_error("Cannot read spill file: " + string(n == 0 ? "unexpected end" : strerror(errno)));
+            }
+            done += static_cast<size_t>(n);
+        }
+#endif
+    }
+
+    uint64_t size() const
+    {
+        return length;
+    }
+
+    ~SpillFile()
+    {
+#ifdef _WIN32
+        if (file != nullptr)
+        {
+            fclose(file);
+        }
+#else
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+};
+
+class HistorySegment;
+
+// Read-only view of one column of a history segment
+template <class T>
+class ColumnView
+{
+private:
+    const T *first;
+    size_t length;
+
+public:
+    ColumnView(const T *first, size_t length) : first(first), length(length) {}
+
+    const T *data() const
+    {
+        return first;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    const T &operator[](size_t i) const
+    {
+        return first[i];
+    }
+
+    const T *begin() const
+    {
+        return first;
+    }
+
+    const T *end() const
+    {
+        return first + length;
+    }
+};
+
+// Budget and second-chance (clock) LRU over the sealed history segments of every conversation
+// Only payload bytes count against the budget; message records stay in memory so sizes,
+// kinds and directions never need disk access. Eviction runs only in trim(), which callers
+// invoke at points where no rendered output still references payload memory.
+// Spilled segments are compressed against one dictionary, trained from the resident
+// segments right before the first eviction and kept for the life of the spill file.
+class HistoryTier
+{
+private:
+    static const size_t DICTIONARY_SIZE = 16 * 1024;
+    static const size_t TRAINING_BYTES = 1 << 20;
+
+    SpillFile spill;
+    string dictionary;
+    bool dictionaryTrained = false;
+    size_t budget;
+    size_t residentBytes = 0;
+    list<HistorySegment *> segments; // Sealed, spillable segments, resident or not
+    list<HistorySegment *>::iterator hand;
+    mutex lock;
+    atomic<uint64_t> evictions{0};
+    atomic<uint64_t> loads{0};
+    atomic<uint64_t> rawBytesSpilled{0};
+    atomic<uint64_t> compressedBytesSpilled{0};
+
+public:
+    HistoryTier(const string &spillPath, size_t budget) : spill(spillPath), budget(budget), hand(segments.end()) {}
+
+    HistoryTier(const HistoryTier &) = delete;
+    HistoryTier &operator=(const HistoryTier &) = delete;
+
+    // Called by a store when a segment fills up; returns the segment's place for forget()
+    list<HistorySegment *>::iterator track(HistorySegment *segment, size_t bytes)
+    {
+        lock_guard<mutex> guard(lock);
+        residentBytes += bytes;
+        return segments.insert(hand, segment);
+    }
+
+    // Called by a store that is going away
+    void forget(list<HistorySegment *>::iterator position, bool resident, size_t bytes)
+    {
+        lock_guard<mutex> guard(lock);
+        if (hand == position)
+        {
+            ++hand;
+        }
+        segments.erase(position);
+        if (resident)
+        {
+            residentBytes -= bytes;
+        }
+    }
+
+    // Loads a spilled segment back into memory
+    void load(HistorySegment &segment);
+
+    // Decompresses a spilled segment's payloads into payloads without loading the segment
+    void readSpilled(uint64_t offset, uint32_t length, size_t payloadBytes, string &payloads);
+
+    // Spills least recently used segments until the resident payloads fit the budget
+    void trim();
+
+    const string &getDictionary() const
+    {
+        return dictionary;
+    }
+
+    bool overBudget() const
+    {
+        return residentBytes > budget;
+    }
+
+    size_t getBudget() const
+    {
+        return budget;
+    }
+
+    size_t getResidentBytes() const
+    {
+        return residentBytes;
+    }
+
+    uint64_t getEvictions() const
+    {
+        return evictions.load();
+    }
+
+    uint64_t getLoads() const
+    {
+        return loads.load();
+    }
+
+    uint64_t getRawBytesSpilled() const
+    {
+        return rawBytesSpilled.load();
+    }
+
+    uint64_t getCompressedBytesSpilled() const
+    {
+        return compressedBytesSpilled.load();
+    }
+
+    // Size of the spill file, which holds one blob per segment ever spilled
+    uint64_t getSpillFileBytes()
+    {
+        lock_guard<mutex> guard(lock);
+        return spill.size();
+    }
+};
+
+// A run of consecutive messages in a conversation; the unit that is spilled to disk
+// Appended payloads are packed into the segment's own arena, so dropping the arena frees
+// exactly this segment's bytes. The record and timestamp columns share one block, which a
+// full-size segment gets up front; only a conversation's first segment grows it. Segments
+// holding payloads the store does not own (mapped log records, shared group bodies) stay in
+// memory: the kernel already pages the mapped log, and shared bodies are owned by every member.
+class HistorySegment
+{
+private:
+    MessageRecord *records = nullptr;
+    int64_t *timestamps = nullptr; // Milliseconds since the epoch per record, never spilled
+    size_t count = 0;
+    size_t capacity = 0;
+    unique_ptr<char[]> columns; // capacity records, then capacity timestamps
+    unique_ptr<MessageArena> arena;
+    size_t payloadBytes = 0;
+    bool external = false;
+    bool resident = true;
+    bool referenced = false; // Second-chance bit, set on access and cleared by the clock hand
+    bool onDisk = false; // A sealed segment never changes, so its first spilled copy stays valid
+    uint64_t spillOffset = 0;
+    uint32_t spillLength = 0;
+    list<HistorySegment *>::iterator position;
+    HistoryTier *tier = nullptr; // Set once the segment is sealed and tracked
+
+    friend class HistoryTier;
+
+    // Moves the columns to a block with room for size messages
+    void resizeColumns(size_t size)
+    {
+        unique_ptr<char[]> block(new char[size * (sizeof(MessageRecord) + sizeof(int64_t))]);
+        MessageRecord *movedRecords = reinterpret_cast<MessageRecord *>(block.get());
+        int64_t *movedTimestamps = reinterpret_cast<int64_t *>(movedRecords + size);
+        if (count != 0)
+        {
+            memcpy(movedRecords, records, count * sizeof(MessageRecord));
+            memcpy(movedTimestamps, timestamps, count * sizeof(int64_t));
+        }
+        columns = move(block);
+        records = movedRecords;
+        timestamps = movedTimestamps;
+        capacity = size;
+    }
+
+    // Frees the payloads, first compressing them to the spill file unless they were already
+    // written there by an earlier eviction. Returns whether a new blob was written.
+    bool spillTo(SpillFile &spill, string_view dictionary, string &blob, string &compressed)
+    {
+        bool written = !onDisk;
+        if (written)
+        {
+            blob.clear();
+            for (size_t i = 0; i < count; i++)
+            {
+                blob.append(records[i].payload, records[i].length);
+            }
+            compressed.clear();
+            BlockCodec::compress(blob.data(), blob.size(), compressed, dictionary);
+            spillOffset = spill.write(compressed);
+            spillLength = static_cast<uint32_t>(compressed.size());
+            onDisk = true;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            records[i].payload = nullptr;
+        }
+        arena.reset();
+        resident = false;
+        return written;
+    }
+
+    void loadFrom(SpillFile &spill, string_view dictionary)
+    {
+        string compressed;
+        spill.read(spillOffset, spillLength, compressed);
+        unique_ptr<MessageArena> loaded(new MessageArena());
+        char *bytes = static_cast<char *>(loaded->allocate(payloadBytes, 1));
+        BlockCodec::decompress(compressed.data(), compressed.size(), bytes, payloadBytes, dictionary);
+        for (size_t i = 0; i < count; i++)
+        {
+            records[i].payload = bytes;
+            bytes += records[i].length;
+        }
+        arena = move(loaded);
+        resident = true;
+    }
+
+public:
+    // Room for initialCapacity messages up front; the columns double when they fill
+    explicit HistorySegment(size_t initialCapacity) : arena(new MessageArena())
+    {
+        resizeColumns(initialCapacity);
+    }
+
+    HistorySegment(const HistorySegment &) = delete;
+    HistorySegment &operator=(const HistorySegment &) = delete;
+
+    void append(MessageKind kind, MessageDirection direction, int64_t timestamp, string_view content)
+    {
+        if (count == capacity)
+        {
+            resizeColumns(capacity * 2);
+        }
+        char *payload = static_cast<char *>(arena->allocate(content.size(), 1));
+        content.copy(payload, content.size());
+        records[count] = MessageRecord{payload, static_cast<uint32_t>(content.size()), kind, direction};
+        timestamps[count++] = timestamp;
+        payloadBytes += content.size();
+    }
+
+    void attach(MessageKind kind, MessageDirection direction, int64_t timestamp, const char *payload, uint32_t length)
+    {
+        if (count == capacity)
+        {
+            resizeColumns(capacity * 2);
+        }
+        records[count] = MessageRecord{payload, length, kind, direction};
+        timestamps[count++] = timestamp;
+        external = true;
+    }
+
+    // Hands a full segment over to the tier, which may spill it from now on
+    void seal(HistoryTier *owner)
+    {
+        if (owner != nullptr && !external)
+        {
+            tier = owner;
+            position = tier->track(this, payloadBytes);
+        }
+    }
+
+    // Returns the records with their payloads in memory, paging them in if needed
+    ColumnView<MessageRecord> access()
+    {
+        if (!resident)
+        {
+            tier->load(*this);
+        }
+        referenced = true;
+        return ColumnView<MessageRecord>(records, count);
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    ColumnView<int64_t> getTimestamps() const
+    {
+        return ColumnView<int64_t>(timestamps, count);
+    }
+
+    // The records without paging anything in: payloads of a spilled segment are null
+    ColumnView<MessageRecord> getRecords() const
+    {
+        return ColumnView<MessageRecord>(records, count);
+    }
+
+    // The records for a one-off read. A spilled segment stays spilled: its payloads are
+    // decompressed into scratch and copies pointing there are returned.
+    ColumnView<MessageRecord> peek(vector<MessageRecord> &copies, string &scratch) const
+    {
+        if (resident)
+        {
+            return ColumnView<MessageRecord>(records, count);
+        }
+        tier->readSpilled(spillOffset, spillLength, payloadBytes, scratch);
+        copies.assign(records, records + count);
+        const char *bytes = scratch.data();
+        for (MessageRecord &record : copies)
+        {
+            record.payload = bytes;
+            bytes += record.length;
+        }
+        return ColumnView<MessageRecord>(copies.data(), copies.size());
+    }
+
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + capacity * (sizeof(MessageRecord) + sizeof(int64_t)) + (arena ? arena->getReservedBytes() : 0);
+    }
+
+    ~HistorySegment()
+    {
+        if (tier != nullptr)
+        {
+            tier->forget(position, resident, payloadBytes);
+        }
+    }
+};
+
+void HistoryTier::load(HistorySegment &segment)
+{
+    segment.loadFrom(spill, dictionary);
+    lock_guard<mutex> guard(lock);
+    residentBytes += segment.payloadBytes;
+    loads++;
+}
+
+void HistoryTier::readSpilled(uint64_t offset, uint32_t length, size_t payloadBytes, string &payloads)
+{
+    string compressed;
+    spill.read(offset, length, compressed);
+    payloads.resize(payloadBytes);
+    BlockCodec::decompress(compressed.data(), compressed.size(), &payloads[0], payloadBytes, dictionary);
+}
+
+void HistoryTier::trim()
+{
+    lock_guard<mutex> guard(lock);
+    if (residentBytes > budget && !dictionaryTrained)
+    {
+        vector<string_view> samples;
+        size_t sampled = 0;
+        for (auto it = segments.begin(); it != segments.end() && sampled < TRAINING_BYTES; ++it)
+        {
+            for (const MessageRecord &record : (*it)->getRecords())
+            {
+                samples.push_back(string_view(record.payload, record.length));
+                sampled += record.length;
+            }
+        }
+        dictionary = DictionaryTrainer::train(samples, DICTIONARY_SIZE);
+        dictionaryTrained = true;
+    }
+    string blob, compressed;
+    // Two sweeps are enough: the first clears every second-chance bit
+    size_t steps = segments.size() * 2;
+    while (residentBytes > budget && steps-- > 0)
+    {
+        if (hand == segments.end())
+        {
+            hand = segments.begin();
+        }
+        HistorySegment *segment = *hand;
+        ++hand;
+        if (!segment->resident)
+        {
+            continue;
+        }
+        if (segment->referenced)
+        {
+            segment->referenced = false;
+            continue;
+        }
+        bool written = segment->spillTo(spill, dictionary, blob, compressed);
+        residentBytes -= segment->payloadBytes;
+        evictions++;
+        if (written)
+        {
+            rawBytesSpilled += blob.size();
+            compressedBytesSpilled += compressed.size();
+        }
+    }
+}
+
+// Segmented message storage for one conversation
+// Messages are grouped into fixed-size segments; once a segment fills up it is sealed and,
+// if the store has a history tier, may be spilled to disk and paged back in on access.
+// Every message carries a timestamp, kept non-decreasing so that time queries can binary
+// search: first over the sparse index of segment start times, then inside one segment.
+class MessageStore
+{
+private:
+    static const size_t SEGMENT_SHIFT = 9;
+    static const size_t SEGMENT_MESSAGES = size_t(1) << SEGMENT_SHIFT;
+    static const size_t FIRST_SEGMENT_CAPACITY = 8; // Most conversations are short; later segments start full size
+
+    vector<unique_ptr<HistorySegment>> segments; // Oldest first; only the last one is open
+    vector<int64_t> segmentStarts;               // Sparse time index: first timestamp of each segment
+    vector<SharedBody *> sharedBodies;           // Bodies referenced by records, released with the store
+    HistoryTier *tier = nullptr;
+    size_t count = 0;
+    int64_t lastTimestamp = 0;
+
+    // Columns of messages restored from a snapshot that have not been attached yet
+    struct PendingColumns
+    {
+        const uint8_t *tags = nullptr;
+        const uint32_t *lengths = nullptr;
+        const int64_t *timestamps = nullptr;
+        const char *payloads = nullptr;
+        size_t count = 0;
+    };
+    PendingColumns pending;
+
+    // Attaches restored messages on first use; reads count as use, hence const
+    void materialize() const
+    {
+        if (pending.count != 0)
+        {
+            const_cast<MessageStore *>(this)->attachPending();
+        }
+    }
+
+    void attachPending()
+    {
+        PendingColumns columns = pending;
+        pending = PendingColumns();
+        count = 0;
+        const char *payload = columns.payloads;
+        for (size_t i = 0; i < columns.count; i++)
+        {
+            attach(static_cast<MessageKind>(columns.tags[i] & 3), static_cast<MessageDirection>(columns.tags[i] >> 2),
+                   columns.timestamps[i], payload, columns.lengths[i]);
+            payload += columns.lengths[i];
+        }
+    }
+
+    // Returns the open segment, sealing the previous one when it is full
+    HistorySegment &openSegment(int64_t &timestamp)
+    {
+        // A clock that steps back must not break the ordering
+        timestamp = max(timestamp, lastTimestamp);
+        lastTimestamp = timestamp;
+        if (segments.empty() || segments.back()->size() == SEGMENT_MESSAGES)
+        {
+            if (!segments.empty())
+            {
+                segments.back()->seal(tier);
+            }
+            segments.emplace_back(new HistorySegment(segments.empty() ? FIRST_SEGMENT_CAPACITY : SEGMENT_MESSAGES));
+            segmentStarts.push_back(timestamp);
+        }
+        return *segments.back();
+    }
+
+public:
+    class const_iterator
+    {
+    private:
+        const MessageStore *store;
+        size_t index;
+
+    public:
+        const_iterator(const MessageStore *store, size_t index) : store(store), index(index) {}
+
+        Message operator*() const
+        {
+            return (*store)[index];
+        }
+
+        const_iterator &operator++()
+        {
+            ++index;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator &other) const
+        {
+            return index != other.index;
+        }
+    };
+
+    // Lets sealed segments be spilled under tier's budget; set before the first message
+    void setTier(HistoryTier *historyTier)
+    {
+        tier = historyTier;
+    }
+
+    const MessageRecord &append(MessageKind kind, MessageDirection direction, int64_t timestamp, string_view content)
+    {
+        materialize();
+        if (content.size() > UINT32_MAX)
+        {
+            throw length_error("Message is too large");
+        }
+        openSegment(timestamp).append(kind, direction, timestamp, content);
+        return record(count++);
+    }
+
+    // Adds a record whose payload lives outside the store (e.g. in a mapped log), without copying it
+    const MessageRecord &attach(MessageKind kind, MessageDirection direction, int64_t timestamp, const char *payload, uint32_t length)
+    {
+        materialize();
+        openSegment(timestamp).attach(kind, direction, timestamp, payload, length);
+        return record(count++);
+    }
+
+    // Adds a record pointing at a shared body and keeps a reference to it
+    const MessageRecord &attachShared(MessageKind kind, MessageDirection direction, int64_t timestamp, SharedBody *body)
+    {
+        sharedBodies.push_back(body);
+        body->retain();
+        return attach(kind, direction, timestamp, body->data(), body->size());
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    // The record at index i with its payload in memory
+    // Payloads stay valid until the history tier is next trimmed.
+    const MessageRecord &record(size_t i) const
+    {
+        materialize();
+        return segments[i >> SEGMENT_SHIFT]->access()[i & (SEGMENT_MESSAGES - 1)];
+    }
+
+    Message operator[](size_t i) const
+    {
+        return Message(&record(i));
+    }
+
+    // Milliseconds since the epoch when message i was stored, 0 if unknown; never pages anything in
+    int64_t timestamp(size_t i) const
+    {
+        materialize();
+        return segments[i >> SEGMENT_SHIFT]->getTimestamps()[i & (SEGMENT_MESSAGES - 1)];
+    }
+
+    // Sequence numbers start at 1 and grow by one per message in the conversation
+    static uint64_t sequenceOf(size_t index)
+    {
+        return index + 1;
+    }
+
+    // Index of the first message with a sequence number above sequence
+    size_t afterSequence(uint64_t sequence) const
+    {
+        return sequence >= count ? count : static_cast<size_t>(sequence);
+    }
+
+    // Index of the first message stamped at or after time, or size() if there is none
+    size_t lowerBound(int64_t time) const
+    {
+        materialize();
+        // Segments starting before time end just before the first one starting at or after it
+        size_t next = static_cast<size_t>(lower_bound(segmentStarts.begin(), segmentStarts.end(), time) - segmentStarts.begin());
+        if (next == 0)
+        {
+            return 0;
+        }
+        ColumnView<int64_t> stamps = segments[next - 1]->getTimestamps();
+        size_t inside = static_cast<size_t>(lower_bound(stamps.begin(), stamps.end(), time) - stamps.begin());
+        return ((next - 1) << SEGMENT_SHIFT) + inside;
+    }
+
+    // Rebuilds the store as the timestamp-ordered merge of itself and others; equal times keep this
+    // store's messages first, then those of others in order. Payloads are copied into the new
+    // segments, except group bodies, which are shared again. positions[0] receives the new index
+    // of each of this store's messages and positions[k] that of each of others[k - 1]'s.
+    // The other stores are left as they were.
+    void merge(const vector<MessageStore *> &others, vector<vector<uint32_t>> &positions)
+    {
+        vector<MessageStore *> sources(1, this);
+        sources.insert(sources.end(), others.begin(), others.end());
+        for (auto source : sources)
+        {
+            source->materialize();
+        }
+        unordered_map<const char *, SharedBody *> shared;
+        for (auto source : sources)
+        {
+            for (auto body : source->sharedBodies)
+            {
+                shared.emplace(body->data(), body);
+            }
+        }
+
+        MessageStore merged;
+        merged.setTier(tier);
+        positions.assign(sources.size(), vector<uint32_t>());
+        vector<size_t> next(sources.size(), 0);
+        // Each source is already in time order, so a heap of their next messages is enough
+        using Head = pair<int64_t, size_t>;
+        priority_queue<Head, vector<Head>, greater<Head>> heads;
+        for (size_t s = 0; s < sources.size(); s++)
+        {
+            positions[s].resize(sources[s]->count);
+            if (sources[s]->count != 0)
+            {
+                heads.push(Head(sources[s]->timestamp(0), s));
+            }
+        }
+        while (!heads.empty())
+        {
+            size_t s = heads.top().second;
+            heads.pop();
+            const MessageStore &source = *sources[s];
+            size_t i = next[s]++;
+            const MessageRecord &record = source.record(i);
+            int64_t timestamp = source.timestamp(i);
+            positions[s][i] = static_cast<uint32_t>(merged.count);
+            auto body = shared.find(record.payload);
+            if (body != shared.end())
+            {
+                merged.attachShared(record.kind, record.direction, timestamp, body->second);
+            }
+            else
+            {
+                merged.append(record.kind, record.direction, timestamp, string_view(record.payload, record.length));
+            }
+            if (next[s] < source.count)
+            {
+                heads.push(Head(source.timestamp(next[s]), s));
+            }
+        }
+        swap(merged);
+    }
+
+    void swap(MessageStore &other)
+    {
+        segments.swap(other.segments);
+        segmentStarts.swap(other.segmentStarts);
+        sharedBodies.swap(other.sharedBodies);
+        std::swap(tier, other.tier);
+        std::swap(count, other.count);
+        std::swap(lastTimestamp, other.lastTimestamp);
+        std::swap(pending, other.pending);
+    }
+
+    // Takes count messages from snapshot columns, which must outlive the store, without reading
+    // them; they are attached the first time the store is read or written. The store must be empty.
+    void restoreLazily(const uint8_t *tags, const uint32_t *lengths, const int64_t *timestamps, const char *payloads, size_t restored)
+    {
+        pending = PendingColumns{tags, lengths, timestamps, payloads, restored};
+        count = restored;
+    }
+
+    size_t segmentCount() const
+    {
+        materialize();
+        return segments.size();
+    }
+
+    // All records of segment s, for bulk work such as encoding a frame per segment
+    ColumnView<MessageRecord> segment(size_t s) const
+    {
+        materialize();
+        return segments[s]->access();
+    }
+
+    // Kinds, directions and lengths of segment s without paging it in; payloads may be null
+    ColumnView<MessageRecord> segmentHeaders(size_t s) const
+    {
+        materialize();
+        return segments[s]->getRecords();
+    }
+
+    // Segment s for reading once, e.g. by an export: a spilled segment is decompressed into the
+    // caller's scratch instead of being paged in, so reading every history keeps memory flat
+    ColumnView<MessageRecord> peekSegment(size_t s, vector<MessageRecord> &copies, string &scratch) const
+    {
+        materialize();
+        return segments[s]->peek(copies, scratch);
+    }
+
+    ColumnView<int64_t> segmentTimestamps(size_t s) const
+    {
+        materialize();
+        return segments[s]->getTimestamps();
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, count);
+    }
+
+    // Bytes held in memory by the store, not counting payloads it only references
+    size_t memoryUsage() const
+    {
+        size_t bytes = segments.capacity() * sizeof(segments[0]) + segmentStarts.capacity() * sizeof(int64_t) +
+                       sharedBodies.capacity() * sizeof(SharedBody *);
+        for (const auto &segment : segments)
+        {
+            bytes += segment->memoryUsage();
+        }
+        return bytes;
+    }
+
+    MessageStore() {}
+    MessageStore(const MessageStore &) = delete;
+    MessageStore &operator=(const MessageStore &) = delete;
+
+    ~MessageStore()
+    {
+        for (auto body : sharedBodies)
+        {
+            body->release();
+        }
+    }
+};
+
+// Compact binary wire format for shipping messages between processes
+// A frame batches messages exchanged with one peer:
+//   'M' 'W' <version> <varint body length> | <varint peer length> <peer> <varint count> <messages>
+// and each message is
+//   <tag: kind | direction << 2> <varint payload length> <payload>
+// Version 2 frames also carry timestamps: each tag is followed by the message's timestamp as a
+// zigzag varint difference from the previous message's (the first one's from 0).
+// Decoding works in place: peers and payloads are views into the received bytes.
+class WireFormat
+{
+public:
+    static const uint8_t VERSION = 1;
+    static const uint8_t TIMED_VERSION = 2;
+    static const size_t PREAMBLE_SIZE = 3;
+
+    static uint64_t zigzag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    static size_t varintSize(uint64_t value)
+    {
+        size_t size = 1;
+        while (value >= 0x80)
+        {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    static void putVarint(string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    // Returns false if the varint runs past end; throws if it is longer than 64 bits
+    static bool getVarint(const char *&pos, const char *end, uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; pos < end; shift += 7)
+        {
+            if (shift > 63)
+            {
+                throw runtime_error("Malformed varint in message frame");
+            }
+            uint8_t byte = static_cast<uint8_t>(*pos++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Appends one frame holding count records exchanged with peer; with timestamps (one per
+    // record) it is a version 2 frame
+    static void encodeFrame(string &out, string_view peer, const MessageRecord *records, size_t count, const int64_t *timestamps = nullptr)
+    {
+        size_t body = varintSize(peer.size()) + peer.size() + varintSize(count);
+        int64_t previous = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            body += 1 + varintSize(records[i].length) + records[i].length;
+            if (timestamps != nullptr)
+            {
+                body += varintSize(zigzag(static_cast<int64_t>(static_cast<uint64_t>(timestamps[i]) - static_cast<uint64_t>(previous))));
+                previous = timestamps[i];
+            }
+        }
+        out.reserve(out.size() + PREAMBLE_SIZE + varintSize(body) + body);
+        out.push_back('M');
+        out.push_back('W');
+        out.push_back(static_cast<char>(timestamps != nullptr ? TIMED_VERSION : VERSION));
+        putVarint(out, body);
+        putVarint(out, peer.size());
+        out.append(peer);
+        putVarint(out, count);
+        previous = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const MessageRecord &record = records[i];
+            out.push_back(static_cast<char>(static_cast<uint8_t>(record.kind) | static_cast<uint8_t>(record.direction) << 2));
+            if (timestamps != nullptr)
+            {
+                putVarint(out, zigzag(static_cast<int64_t>(static_cast<uint64_t>(timestamps[i]) - static_cast<uint64_t>(previous))));
+                previous = timestamps[i];
+            }
+            putVarint(out, record.length);
+            out.append(record.payload, record.length);
+        }
+    }
+
+    // One decoded frame; peer and message payloads point into the decoded buffer
+    class FrameView
+    {
+    private:
+        string_view peer;
+        uint64_t count = 0;
+        uint8_t version = VERSION;
+        const char *messages = nullptr;
+        const char *end = nullptr;
+
+    public:
+        // Parses the frame at the start of data. Returns the frame's size, or 0 if data
+        // holds only part of it; throws on malformed frames and unknown versions.
+        size_t parse(const char *data, size_t size)
+        {
+            if (size < PREAMBLE_SIZE)
+            {
+                return 0;
+            }
+            if (data[0] != 'M' || data[1] != 'W')
+            {
+                throw runtime_error("Not a message frame");
+            }
+            version = static_cast<uint8_t>(data[2]);
+            if (version != VERSION && version != TIMED_VERSION)
+            {
+                throw runtime_error("Unsupported message frame version " + to_string(version));
+            }
+            const char *pos = data + PREAMBLE_SIZE;
+            const char *limit = data + size;
+            uint64_t body;
+            if (!getVarint(pos, limit, body))
+            {
+                return 0;
+            }
+            if (body > static_cast<uint64_t>(limit - pos))
+            {
+                return 0;
+            }
+            end = pos + body;
+            uint64_t peerLength;
+            if (!getVarint(pos, end, peerLength) || peerLength > static_cast<uint64_t>(end - pos))
+            {
+                throw runtime_error("Truncated message frame");
+            }
+            peer = string_view(pos, peerLength);
+            pos += peerLength;
+            if (!getVarint(pos, end, count))
+            {
+                throw runtime_error("Truncated message frame");
+            }
+            messages = pos;
+            return static_cast<size_t>(end - data);
+        }
+
+        string_view getPeer() const
+        {
+            return peer;
+        }
+
+        uint64_t size() const
+        {
+            return count;
+        }
+
+        // Calls f(MessageRecord) for each message in order
+        template <typename F>
+        void forEach(F f) const
+        {
+            forEachTimed([&f](const MessageRecord &record, int64_t) { f(record); });
+        }
+
+        // Calls f(MessageRecord, timestamp) for each message in order; timestamps are 0 in version 1
+        template <typename F>
+        void forEachTimed(F f) const
+        {
+            const char *pos = messages;
+            int64_t timestamp = 0;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                if (pos >= end)
+                {
+                    throw runtime_error("Truncated message frame");
+                }
+                uint8_t tag = static_cast<uint8_t>(*pos++);
+                uint8_t kind = tag & 0x3;
+                uint8_t direction = tag >> 2;
+                uint64_t delta = 0, length;
+                if (kind > static_cast<uint8_t>(MessageKind::VoiceNote) || direction > static_cast<uint8_t>(MessageDirection::Received) ||
+                    (version == TIMED_VERSION && !getVarint(pos, end, delta)) ||
+                    !getVarint(pos, end, length) || length > static_cast<uint64_t>(end - pos) || length > UINT32_MAX)
+                {
+                    throw runtime_error("Malformed message in frame");
+                }
+                timestamp = static_cast<int64_t>(static_cast<uint64_t>(timestamp) + static_cast<uint64_t>(unzigzag(delta)));
+                f(MessageRecord{pos, static_cast<uint32_t>(length), static_cast<MessageKind>(kind), static_cast<MessageDirection>(direction)},
+                  timestamp);
+                pos += length;
+            }
+        }
+    };
+};
+
+// Binary append-only log of every message, replayed at startup
+// File layout: 8-byte magic, then records of
+// [u32 username length][u32 payload length][u8 kind][u8 direction][u64 timestamp ms][username bytes][payload bytes]
+// Kind values past MessageKind mark group records, whose username field names the group or member:
+//   GROUP_RECORD      the group was created (empty payload) or the payload names a member added to it
+//   DELIVERY_RECORD | kind   a group message delivered to the member; the payload is the u64 offset
+//                            of the group's own record of the message, which holds the body
+//   READ_RECORD       the conversation was viewed; the u32 payload is its unread count from then on
+// Version 1 logs ("MPLOG001") lack the timestamp and are upgraded when opened.
+// Records are buffered and written with a single write + fsync per group commit
+class MessageLog
+{
+private:
+    static const size_t GROUP_COMMIT_RECORDS = 256;
+    static const size_t GROUP_COMMIT_BYTES = 1 << 20;
+
+#ifdef _WIN32
+    FILE *file = nullptr;
+#else
+    int fd = -1;
+#endif
+    mutex lock; // Conversations on different ingest workers share the log
+    string buffer;
+    size_t pendingRecords = 0;
+    uint64_t durableLength; // Bytes written and synced
+
+    static void putU32(string &out, uint32_t value)
+    {
+        char bytes[4];
+        for (int i = 0; i < 4; i++)
+        {
+            bytes[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+        }
+        out.append(bytes, 4);
+    }
+
+    static void putU64(string &out, uint64_t value)
+    {
+        putU32(out, static_cast<uint32_t>(value));
+        putU32(out, static_cast<uint32_t>(value >> 32));
+    }
+
+public:
+    static constexpr char MAGIC[8] = {'M', 'P', 'L', 'O', 'G', '0', '0', '2'};
+    static constexpr char LEGACY_MAGIC[8] = {'M', 'P', 'L', 'O', 'G', '0', '0', '1'};
+    static const size_t MAGIC_SIZE = 8;
+    static const size_t RECORD_HEADER_SIZE = 18;
+    static const size_t LEGACY_RECORD_HEADER_SIZE = 10;
+    static const uint8_t GROUP_RECORD = 0x40;
+    static const uint8_t DELIVERY_RECORD = 0x80;
+    static const uint8_t READ_RECORD = 0x20;
+
+    // Opens path for appending, dropping anything past validLength (a torn record from a crash)
+    MessageLog(const string &path, size_t validLength) : durableLength(validLength)
+    {
+#ifdef _WIN32
+        file = fopen(path.c_str(), validLength == 0 ? "wb" : "r+b");
+        if (file == nullptr || _chsize_s(_fileno(file), validLength) != 0 || fseek(file, 0, SEEK_END) != 0)
+        {
+            throw runtime_error("Cannot open message log " + path);
+        }
+#else
+        fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0 || ftruncate(fd, validLength) != 0 || lseek(fd, 0, SEEK_END) < 0)
+        {
+            throw runtime_error("Cannot open message log " + path + ": " + strerror(errno));
+        }
+#endif
+        if (validLength == 0)
+        {
+            buffer.append(MAGIC, MAGIC_SIZE);
+            flush();
+        }
+    }
+
+    MessageLog(const MessageLog &) = delete;
+    MessageLog &operator=(const MessageLog &) = delete;
+
+    // Returns the offset of the record in the log, for delivery records to refer to
+    uint64_t append(string_view username, MessageKind kind, MessageDirection direction, int64_t timestamp, const char *payload, uint32_t length)
+    {
+        return appendRecord(username, static_cast<uint8_t>(kind), static_cast<uint8_t>(direction), timestamp, payload, length);
+    }
+
+    // Records that group was created (empty member) or that member joined it
+    void appendGroup(string_view group, string_view member, int64_t timestamp)
+    {
+        appendRecord(group, GROUP_RECORD, 0, timestamp, member.data(), static_cast<uint32_t>(member.size()));
+    }
+
+    // Records that the group message whose record is at groupRecord was delivered to member
+    void appendDelivery(string_view member, MessageKind kind, MessageDirection direction, int64_t timestamp, uint64_t groupRecord)
+    {
+        string reference;
+        putU64(reference, groupRecord);
+        appendRecord(member, DELIVERY_RECORD | static_cast<uint8_t>(kind), static_cast<uint8_t>(direction), timestamp, reference.data(),
+                     static_cast<uint32_t>(reference.size()));
+    }
+
+    // Records the unread count username's conversation has left after it was read (0) or imported into
+    void appendRead(string_view username, uint32_t unread, int64_t timestamp)
+    {
+        string count;
+        putU32(count, unread);
+        appendRecord(username, READ_RECORD, 0, timestamp, count.data(), static_cast<uint32_t>(count.size()));
+    }
+
+    // Writes out the pending group and syncs it to disk
+    void flush()
+    {
+        lock_guard<mutex> guard(lock);
+        flushLocked();
+    }
+
+    // Length of the log on disk as of the last flush
+    uint64_t getDurableLength()
+    {
+        lock_guard<mutex> guard(lock);
+        return durableLength;
+    }
+
+private:
+    uint64_t appendRecord(string_view username, uint8_t kind, uint8_t direction, int64_t timestamp, const char *payload, uint32_t length)
+    {
+        lock_guard<mutex> guard(lock);
+        uint64_t offset = durableLength + buffer.size();
+        putU32(buffer, static_cast<uint32_t>(username.size()));
+        putU32(buffer, length);
+        buffer.push_back(static_cast<char>(kind));
+        buffer.push_back(static_cast<char>(direction));
+        putU64(buffer, static_cast<uint64_t>(timestamp));
+        buffer.append(username);
+        buffer.append(payload, length);
+        pendingRecords++;
+        if (pendingRecords >= GROUP_COMMIT_RECORDS || buffer.size() >= GROUP_COMMIT_BYTES)
+        {
+            flushLocked();
+        }
+        return offset;
+    }
+
+    void flushLocked()
+    {
+        if (buffer.empty())
+        {
+            return;
+        }
+#ifdef _WIN32
+        if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size() || fflush(file) != 0 || _commit(_fileno(file)) != 0)
+        {
+            throw runtime_error("Cannot write message log");
+        }
+#else
+        size_t written = 0;
+        while (written < buffer.size())
+        {
+            ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw runtime_error(string("Cannot write message log: ") + strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+        if (fsync(fd) != 0)
+        {
+            throw runtime_error(string("Cannot sync message log: ") + strerror(errno));
+        }
+#endif
+        durableLength += buffer.size();
+        buffer.clear();
+        pendingRecords = 0;
+    }
+
+public:
+    ~MessageLog()
+    {
+        try
+        {
+            flush();
+        }
+        catch (const exception &e)
+        {
+            cout << "An error occurred while saving messages: " << e.what() << endl;
+        }
+#ifdef _WIN32
+        if (file != nullptr)
+        {
+            fclose(file);
+        }
+#else
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+};
+
+// Read-only view of a whole file, memory-mapped where the platform allows it
+class MappedFile
+{
+private:
+    const char *data = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<char> contents;
+#endif
+
+public:
+    // A missing file maps as empty; any other failure to read it throws
+    explicit MappedFile(const string &path)
+    {
+#ifdef _WIN32
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            if (errno == ENOENT)
+            {
+                return;
+            }
+            throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+        }
+        char chunk[64 * 1024];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+            contents.insert(contents.end(), chunk, chunk + n);
+        }
+        fclose(file);
+        data = contents.data();
+        length = contents.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+            {
+                return;
+            }
+            throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0)
+        {
+            int error = errno;
+            close(fd);
+            throw runtime_error("Cannot stat " + path + ": " + strerror(error));
+        }
+        if (st.st_size > 0)
+        {
+            void *mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                data = static_cast<const char *>(mapped);
+                length = static_cast<size_t>(st.st_size);
+            }
+        }
+        close(fd);
+        if (data == nullptr && st.st_size > 0)
+        {
+            throw runtime_error("Cannot map " + path);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *getData() const
+    {
+        return data;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (data != nullptr)
+        {
+            munmap(const_cast<char *>(data), length);
+        }
+#endif
+    }
+};
+
+#ifdef _WIN32
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+// Output buffer that formats small pieces into one reusable buffer and writes each
+// chunk with a single vectored write, or appends it to a string for non-blocking sockets
+class OutputBuffer
+{
+private:
+    static const size_t CAPACITY = 256 * 1024;
+    static const size_t INLINE_LIMIT = 512;
+    static const size_t MAX_IOVECS = 512;
+
+    int fd;
+    string *target = nullptr;
+    vector<char> buffer;
+    size_t used = 0;
+    size_t segmentStart = 0; // Start of the buffered bytes not yet covered by an iovec
+    vector<iovec> pieces;
+
+    void closeSegment()
+    {
+        if (used > segmentStart)
+        {
+            pieces.push_back(iovec{buffer.data() + segmentStart, used - segmentStart});
+            segmentStart = used;
+        }
+    }
+
+public:
+    explicit OutputBuffer(int fd) : fd(fd), buffer(CAPACITY) {}
+    explicit OutputBuffer(string &target) : fd(-1), target(&target), buffer(CAPACITY) {}
+
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    // Copies text into the buffer
+    OutputBuffer &operator<<(string_view text)
+    {
+        if (used + text.size() > CAPACITY || pieces.size() + 1 >= MAX_IOVECS)
+        {
+            flush();
+        }
+        if (text.size() > CAPACITY)
+        {
+            pieces.push_back(iovec{const_cast<char *>(text.data()), text.size()});
+            flush();
+            return *this;
+        }
+        memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+        return *this;
+    }
+
+    // Writes text without copying it when it is large; text must stay alive until the next flush()
+    OutputBuffer &reference(string_view text)
+    {
+        if (text.size() <= INLINE_LIMIT)
+        {
+            return *this << text;
+        }
+        closeSegment();
+        pieces.push_back(iovec{const_cast<char *>(text.data()), text.size()});
+        if (pieces.size() + 1 >= MAX_IOVECS)
+        {
+            flush();
+        }
+        return *this;
+    }
+
+    OutputBuffer &operator<<(char c)
+    {
+        return *this << string_view(&c, 1);
+    }
+
+    OutputBuffer &operator<<(size_t value)
+    {
+        char digits[24];
+        int n = snprintf(digits, sizeof(digits), "%zu", value);
+        return *this << string_view(digits, static_cast<size_t>(n));
+    }
+
+    void flush()
+    {
+        closeSegment();
+        if (target != nullptr)
+        {
+            for (const auto &piece : pieces)
+            {
+                target->append(static_cast<const char *>(piece.iov_base), piece.iov_len);
+            }
+            pieces.clear();
+            used = segmentStart = 0;
+            return;
+        }
+        size_t first = 0;
+        while (first < pieces.size())
+        {
+#ifdef _WIN32
+            int n = _write(fd, pieces[first].iov_base, static_cast<unsigned>(pieces[first].iov_len));
+#else
+            ssize_t n = writev(fd, pieces.data() + first, static_cast<int>(pieces.size() - first));
+#endif
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                pieces.clear();
+                used = segmentStart = 0;
+                throw runtime_error(string("Cannot write output: ") + strerror(errno));
+            }
+            // Skip what was written, possibly stopping part-way into a piece
+            size_t written = static_cast<size_t>(n);
+            while (first < pieces.size() && written >= pieces[first].iov_len)
+            {
+                written -= pieces[first].iov_len;
+                first++;
+            }
+            if (first < pieces.size())
+            {
+                pieces[first].iov_base = static_cast<char *>(pieces[first].iov_base) + written;
+                pieces[first].iov_len -= written;
+            }
+        }
+        pieces.clear();
+        used = segmentStart = 0;
+    }
+
+    ~OutputBuffer()
+    {
+        try
+        {
+            flush();
+        }
+        catch (const exception &)
+        {
+        }
+    }
+};
+
+// Sections of a snapshot file, in the order they are written
+enum class SnapshotSection : uint32_t
+{
+    Names,         // Usernames, concatenated
+    Tags,          // Per message, conversation by conversation: kind | direction << 2
+    Lengths,       // Per message: payload length (u32)
+    Timestamps,    // Per message: milliseconds since the epoch (i64)
+    Payloads,      // Message payloads, concatenated
+    Conversations, // SnapshotConversation per conversation, in registry order
+    Members,       // Conversation numbers of group members
+    InboxOrder,    // Conversation numbers, most recently active first
+    Documents,     // Search documents: conversation number and message position
+    Terms,         // SnapshotTerm per search term, sorted by term
+    TermNames,     // Search terms, concatenated
+    BlockFirsts,   // First message id of each posting block (u32)
+    BlockOffsets,  // Start of each posting block within its term's bytes (u32)
+    PostingBytes,  // Varint deltas of all posting lists
+    Count
+};
+
+struct SnapshotConversation
+{
+    static const uint32_t GROUP = 1;
+
+    uint64_t nameOffset;
+    uint64_t firstMessage; // Index of the first message in the per-message sections
+    uint64_t messageCount;
+    uint64_t payloadOffset;
+    uint64_t payloadBytes;
+    uint32_t nameLength;
+    uint32_t unread;
+    uint32_t firstMember;
+    uint32_t memberCount;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct SnapshotTerm
+{
+    uint64_t nameOffset;
+    uint64_t firstBlock;  // Index into BlockFirsts and BlockOffsets
+    uint64_t bytesOffset; // Start of the term's postings in PostingBytes
+    uint64_t bytesLength;
+    uint32_t nameLength;
+    uint32_t blockCount;
+    uint32_t count;
+    uint32_t last;
+};
+
+// Writes a snapshot file: a header page holding the section table, then each section starting
+// on a page boundary so that restoring can map the columns and use them in place.
+// Columns are written in host byte order; the header records it and restore checks it.
+class SnapshotWriter
+{
+public:
+    static constexpr char MAGIC[8] = {'M', 'P', 'S', 'N', 'A', 'P', '0', '1'};
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+    static const size_t PAGE_BYTES = 4096;
+    static const size_t SECTION_COUNT = static_cast<size_t>(SnapshotSection::Count);
+
+    // Header page layout
+    struct Header
+    {
+        char magic[8];
+        uint32_t byteOrder;
+        uint32_t sectionCount;
+        uint64_t logOffset; // Message log bytes already contained in the snapshot
+        uint64_t sections[SECTION_COUNT][2]; // Offset and size of each section
+    };
+
+private:
+    FILE *file;
+    string path;
+    uint64_t offset = PAGE_BYTES;
+    size_t current = 0;
+    Header header;
+
+    void pad(size_t bytes)
+    {
+        static const char zeros[PAGE_BYTES] = {};
+        write(zeros, bytes);
+    }
+
+public:
+    explicit SnapshotWriter(const string &path) : path(path)
+    {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr || fseek(file, PAGE_BYTES, SEEK_SET) != 0)
+        {
+            throw runtime_error("Cannot create snapshot " + path);
+        }
+        memset(&header, 0, sizeof(header));
+    }
+
+    SnapshotWriter(const SnapshotWriter &) = delete;
+    SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+    // Starts the next section on a page boundary
+    void begin(SnapshotSection section)
+    {
+        if (static_cast<size_t>(section) != current)
+        {
+            throw logic_error("Snapshot sections must be written in order");
+        }
+        pad((PAGE_BYTES - offset % PAGE_BYTES) % PAGE_BYTES);
+        header.sections[current][0] = offset;
+    }
+
+    void end()
+    {
+        header.sections[current][1] = offset - header.sections[current][0];
+        current++;
+    }
+
+    void write(const void *data, size_t size)
+    {
+        if (size != 0 && fwrite(data, 1, size, file) != size)
+        {
+            throw runtime_error("Cannot write snapshot " + path);
+        }
+        offset += size;
+    }
+
+    template <typename T>
+    void put(const T &value)
+    {
+        write(&value, sizeof(value));
+    }
+
+    // Writes the header and syncs the file; the snapshot is complete once this returns
+    void finish(uint64_t logOffset)
+    {
+        if (current != SECTION_COUNT)
+        {
+            throw logic_error("Snapshot is missing sections");
+        }
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.byteOrder = BYTE_ORDER_MARK;
+        header.sectionCount = static_cast<uint32_t>(SECTION_COUNT);
+        header.logOffset = logOffset;
+        bool ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && fflush(file) == 0;
+#ifdef _WIN32
+        ok = ok && _commit(_fileno(file)) == 0;
+#else
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok)
+        {
+            throw runtime_error("Cannot write snapshot " + path);
+        }
+    }
+
+    ~SnapshotWriter()
+    {
+        if (file != nullptr)
+        {
+            fclose(file);
+        }
+    }
+};
+
+// Validated sections of a mapped snapshot
+class SnapshotView
+{
+private:
+    const char *data = nullptr;
+    const SnapshotWriter::Header *header = nullptr;
+
+public:
+    // Returns false for a missing file; throws for one that is not a usable snapshot
+    bool open(const MappedFile &file)
+    {
+        if (file.size() == 0)
+        {
+            return false;
+        }
+        const SnapshotWriter::Header *candidate = reinterpret_cast<const SnapshotWriter::Header *>(file.getData());
+        if (file.size() < SnapshotWriter::PAGE_BYTES || memcmp(candidate->magic, SnapshotWriter::MAGIC, sizeof(SnapshotWriter::MAGIC)) != 0)
+        {
+            throw runtime_error("Snapshot has an unknown format");
+        }
+        if (candidate->byteOrder != SnapshotWriter::BYTE_ORDER_MARK || candidate->sectionCount != SnapshotWriter::SECTION_COUNT)
+        {
+            throw runtime_error("Snapshot was written by an incompatible build");
+        }
+        for (const auto &section : candidate->sections)
+        {
+            if (section[0] % SnapshotWriter::PAGE_BYTES != 0 || section[0] > file.size() || section[1] > file.size() - section[0])
+            {
+                throw runtime_error("Snapshot is truncated");
+            }
+        }
+        data = file.getData();
+        header = candidate;
+        return true;
+    }
+
+    uint64_t getLogOffset() const
+    {
+        return header->logOffset;
+    }
+
+    // The section as an array of T; throws if its size is not a whole number of them
+    template <typename T>
+    const T *section(SnapshotSection id, size_t &count) const
+    {
+        const uint64_t *entry = header->sections[static_cast<size_t>(id)];
+        if (entry[1] % sizeof(T) != 0)
+        {
+            throw runtime_error("Snapshot section is corrupt");
+        }
+        count = static_cast<size_t>(entry[1] / sizeof(T));
+        return reinterpret_cast<const T *>(data + entry[0]);
+    }
+};
+
+class Conversation;
+
+// Incremental inverted index over the text of every message in every conversation
+// Posting lists hold message ids in arrival order, delta + varint encoded in blocks of
+// 128 so the newest matches can be read from the tail without decoding whole lists.
+class SearchIndex
+{
+public:
+    // A matching message: the conversation and the message's position in it
+    struct Hit
+    {
+        const Conversation *convo;
+        uint32_t index;
+    };
+
+private:
+    static const uint32_t BLOCK_SIZE = 128;
+    static const size_t MAX_TERM_LENGTH = 32;
+
+    // Read-only view of a posting list, in memory or in a mapped snapshot
+    struct PostingView
+    {
+        const uint8_t *bytes;
+        size_t size;
+        const uint32_t *blockFirst;
+        const uint32_t *blockOffset;
+        size_t blocks;
+
+        // Decodes block b into ids, oldest first
+        void decodeBlock(size_t b, vector<uint32_t> &ids) const
+        {
+            ids.clear();
+            uint32_t id = blockFirst[b];
+            ids.push_back(id);
+            size_t end = b + 1 < blocks ? blockOffset[b + 1] : size;
+            for (size_t pos = blockOffset[b]; pos < end;)
+            {
+                uint32_t delta = 0;
+                int shift = 0;
+                uint8_t byte;
+                do
+                {
+                    byte = bytes[pos++];
+                    delta |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                    shift += 7;
+                } while (byte & 0x80);
+                id += delta;
+                ids.push_back(id);
+            }
+        }
+    };
+
+    struct PostingList
+    {
+        vector<uint8_t> bytes;        // Varint deltas, the first id of each block is kept separately
+        vector<uint32_t> blockFirst;  // First message id of each block
+        vector<uint32_t> blockOffset; // Where each block's deltas start in bytes
+        uint32_t last = 0;
+        uint32_t count = 0;
+
+        void add(uint32_t id)
+        {
+            if (count > 0 && id == last)
+            {
+                return; // Term repeated within the same message
+            }
+            if (count % BLOCK_SIZE == 0)
+            {
+                blockFirst.push_back(id);
+                blockOffset.push_back(static_cast<uint32_t>(bytes.size()));
+            }
+            else
+            {
+                uint32_t delta = id - last;
+                while (delta >= 0x80)
+                {
+                    bytes.push_back(static_cast<uint8_t>(delta | 0x80));
+                    delta >>= 7;
+                }
+                bytes.push_back(static_cast<uint8_t>(delta));
+            }
+            last = id;
+            count++;
+        }
+
+        PostingView view() const
+        {
+            return PostingView{bytes.data(), bytes.size(), blockFirst.data(), blockOffset.data(), blockFirst.size()};
+        }
+    };
+
+    // Walks one posting list from the newest id to the oldest
+    struct ReverseCursor
+    {
+        PostingView list;
+        size_t block;
+        vector<uint32_t> ids;
+        size_t pos = 0;
+
+        explicit ReverseCursor(const PostingView &list) : list(list), block(list.blocks)
+        {
+            advance();
+        }
+
+        bool valid() const
+        {
+            return pos > 0;
+        }
+
+        uint32_t current() const
+        {
+            return ids[pos - 1];
+        }
+
+        void advance()
+        {
+            if (pos > 1)
+            {
+                pos--;
+                return;
+            }
+            if (block == 0)
+            {
+                pos = 0;
+                return;
+            }
+            list.decodeBlock(--block, ids);
+            pos = ids.size();
+        }
+    };
+
+    // Message id -> (conversation number, message position), 8 bytes per message
+    struct Document
+    {
+        uint32_t convo;
+        uint32_t index;
+    };
+
+    // A term restored from a snapshot; its postings stay in the mapping
+    struct BaseTerm
+    {
+        string_view term;
+        PostingView postings;
+        uint32_t count;
+        uint32_t last;
+    };
+
+    mutable mutex lock; // Ingest workers index concurrently
+    map<string, PostingList, less<>> terms;
+    vector<Document> documents; // Ids from baseCount up
+    // Index restored from a snapshot: documents below baseCount and the postings of baseTerms
+    // are read from the mapping, and messages indexed since get the ids after them
+    vector<BaseTerm> baseTerms; // Sorted by term
+    const Document *baseDocuments = nullptr;
+    uint32_t baseCount = 0;
+    vector<Document> ownedBase; // Copy of the restored documents once relocate() changes them
+    vector<const Conversation *> conversationList;
+    unordered_map<const Conversation *, uint32_t> conversationIds;
+
+    template <typename F>
+    static void forEachTerm(string_view text, F f)
+    {
+        char term[MAX_TERM_LENGTH];
+        size_t length = 0;
+        bool tooLong = false;
+        for (size_t i = 0; i <= text.size(); i++)
+        {
+            unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+            if (isalnum(c))
+            {
+                if (length < MAX_TERM_LENGTH)
+                {
+                    term[length++] = static_cast<char>(tolower(c));
+                }
+                else
+                {
+                    tooLong = true;
+                }
+                continue;
+            }
+            if (length > 0 && !tooLong)
+            {
+                f(string_view(term, length));
+            }
+            length = 0;
+            tooLong = false;
+        }
+    }
+
+    // Number of convo in conversationList, assigning one on first use; the lock must be held
+    uint32_t conversationId(const Conversation *convo)
+    {
+        auto found = conversationIds.find(convo);
+        if (found != conversationIds.end())
+        {
+            return found->second;
+        }
+        uint32_t convoId = static_cast<uint32_t>(conversationList.size());
+        conversationIds.emplace(convo, convoId);
+        conversationList.push_back(convo);
+        return convoId;
+    }
+
+public:
+    // Where the messages of a conversation went when it was merged into target
+    struct Relocation
+    {
+        const Conversation *target;
+        const vector<uint32_t> *positions; // New position of each old message position
+    };
+
+    // Indexes the message stored at position index of convo
+    void add(const Conversation *convo, size_t index, string_view text)
+    {
+        lock_guard<mutex> guard(lock);
+        uint32_t convoId = conversationId(convo);
+        uint32_t id = baseCount + static_cast<uint32_t>(documents.size());
+        documents.push_back(Document{convoId, static_cast<uint32_t>(index)});
+
+        forEachTerm(text, [&](string_view term)
+        {
+            auto it = terms.find(term);
+            if (it == terms.end())
+            {
+                it = terms.emplace(string(term), PostingList()).first;
+            }
+            it->second.add(id);
+        });
+    }
+
+    // Finds messages containing a word, newest first
+    // A query ending in '*' matches every word starting with the rest of it.
+    vector<Hit> search(const string &query, size_t limit) const
+    {
+        bool prefix = !query.empty() && query.back() == '*';
+        string key;
+        forEachTerm(prefix ? string_view(query).substr(0, query.size() - 1) : string_view(query), [&](string_view term)
+        {
+            if (key.empty())
+            {
+                key = string(term);
+            }
+        });
+
+        vector<Hit> hits;
+        if (key.empty() || limit == 0)
+        {
+            return hits;
+        }
+
+        lock_guard<mutex> guard(lock);
+        vector<ReverseCursor> cursors;
+        auto base = lower_bound(baseTerms.begin(), baseTerms.end(), key, [](const BaseTerm &entry, const string &term) { return entry.term < term; });
+        if (prefix)
+        {
+            for (; base != baseTerms.end() && base->term.compare(0, key.size(), key) == 0; ++base)
+            {
+                cursors.emplace_back(base->postings);
+            }
+            for (auto it = terms.lower_bound(key); it != terms.end() && it->first.compare(0, key.size(), key) == 0; ++it)
+            {
+                cursors.emplace_back(it->second.view());
+            }
+        }
+        else
+        {
+            if (base != baseTerms.end() && base->term == key)
+            {
+                cursors.emplace_back(base->postings);
+            }
+            auto it = terms.find(key);
+            if (it != terms.end())
+            {
+                cursors.emplace_back(it->second.view());
+            }
+        }
+
+        // Merge the lists newest first, skipping messages matched by several words
+        auto older = [&](size_t a, size_t b) { return cursors[a].current() < cursors[b].current(); };
+        priority_queue<size_t, vector<size_t>, decltype(older)> heap(older);
+        for (size_t i = 0; i < cursors.size(); i++)
+        {
+            if (cursors[i].valid())
+            {
+                heap.push(i);
+            }
+        }
+        uint32_t previous = UINT32_MAX;
+        while (!heap.empty() && hits.size() < limit)
+        {
+            size_t i = heap.top();
+            heap.pop();
+            uint32_t id = cursors[i].current();
+            if (id != previous)
+            {
+                const Document &doc = id < baseCount ? baseDocuments[id] : documents[id - baseCount];
+                if (doc.convo < conversationList.size() && conversationList[doc.convo] != nullptr)
+                {
+                    hits.push_back(Hit{conversationList[doc.convo], doc.index});
+                }
+                previous = id;
+            }
+            cursors[i].advance();
+            if (cursors[i].valid())
+            {
+                heap.push(i);
+            }
+        }
+        return hits;
+    }
+
+    // Moves the hits of merged conversations to their new conversations and positions,
+    // in one pass over the documents; posting lists are untouched
+    void relocate(const unordered_map<const Conversation *, Relocation> &moves)
+    {
+        lock_guard<mutex> guard(lock);
+        size_t known = conversationList.size();
+        vector<const Relocation *> byId(known, nullptr);
+        vector<uint32_t> targetIds(known, 0);
+        for (size_t id = 0; id < known; id++)
+        {
+            auto found = moves.find(conversationList[id]);
+            if (found != moves.end())
+            {
+                byId[id] = &found->second;
+                targetIds[id] = conversationId(found->second.target);
+            }
+        }
+        if (baseCount != 0 && ownedBase.empty())
+        {
+            ownedBase.assign(baseDocuments, baseDocuments + baseCount);
+            baseDocuments = ownedBase.data();
+        }
+        auto relocateDocument = [&](Document &doc)
+        {
+            const Relocation *move = doc.convo < known ? byId[doc.convo] : nullptr;
+            if (move != nullptr)
+            {
+                doc.index = (*move->positions)[doc.index];
+                doc.convo = targetIds[doc.convo];
+            }
+        };
+        for (Document &doc : ownedBase)
+        {
+            relocateDocument(doc);
+        }
+        for (Document &doc : documents)
+        {
+            relocateDocument(doc);
+        }
+        for (size_t id = 0; id < known; id++)
+        {
+            if (byId[id] != nullptr && byId[id]->target != conversationList[id])
+            {
+                conversationIds.erase(conversationList[id]);
+                conversationList[id] = nullptr;
+            }
+        }
+    }
+
+    size_t messageCount() const
+    {
+        lock_guard<mutex> guard(lock);
+        return baseCount + documents.size();
+    }
+
+    // Bytes of the compressed posting lists held in memory; restored ones stay in the mapping
+    size_t postingBytes() const
+    {
+        lock_guard<mutex> guard(lock);
+        size_t bytes = 0;
+        for (const auto &entry : terms)
+        {
+            const PostingList &list = entry.second;
+            bytes += list.bytes.capacity() + (list.blockFirst.capacity() + list.blockOffset.capacity()) * sizeof(uint32_t);
+        }
+        return bytes;
+    }
+
+    // Bytes the index holds in memory: postings, terms, documents and the conversation table
+    size_t memoryUsage() const
+    {
+        size_t bytes = postingBytes();
+        lock_guard<mutex> guard(lock);
+        for (const auto &entry : terms)
+        {
+            bytes += sizeof(entry) + entry.first.capacity() + 4 * sizeof(void *); // Tree node links and colour
+        }
+        bytes += (documents.capacity() + ownedBase.capacity()) * sizeof(Document) + baseTerms.capacity() * sizeof(BaseTerm) +
+                 conversationList.capacity() * sizeof(const Conversation *) +
+                 conversationIds.size() * (sizeof(pair<const Conversation *, uint32_t>) + 2 * sizeof(void *));
+        return bytes;
+    }
+
+    // Writes the index sections of a snapshot; numbers gives each conversation's position in it.
+    // Restored and newer postings of a term are written back to back: blocks decode independently.
+    void save(SnapshotWriter &out, const unordered_map<const Conversation *, uint32_t> &numbers) const
+    {
+        lock_guard<mutex> guard(lock);
+        out.begin(SnapshotSection::Documents);
+        for (size_t id = 0; id < baseCount + documents.size(); id++)
+        {
+            Document doc = id < baseCount ? baseDocuments[id] : documents[id - baseCount];
+            auto found = doc.convo < conversationList.size() ? numbers.find(conversationList[doc.convo]) : numbers.end();
+            doc.convo = found != numbers.end() ? found->second : UINT32_MAX;
+            out.put(doc);
+        }
+        out.end();
+
+        out.begin(SnapshotSection::Terms);
+        uint64_t nameOffset = 0, firstBlock = 0, bytesOffset = 0;
+        forEachIndexedTerm([&](string_view term, const BaseTerm *base, const PostingList *live)
+        {
+            SnapshotTerm entry;
+            entry.nameOffset = nameOffset;
+            entry.nameLength = static_cast<uint32_t>(term.size());
+            entry.firstBlock = firstBlock;
+            entry.blockCount = static_cast<uint32_t>((base != nullptr ? base->postings.blocks : 0) + (live != nullptr ? live->blockFirst.size() : 0));
+            entry.bytesOffset = bytesOffset;
+            entry.bytesLength = (base != nullptr ? base->postings.size : 0) + (live != nullptr ? live->bytes.size() : 0);
+            entry.count = (base != nullptr ? base->count : 0) + (live != nullptr ? live->count : 0);
+            entry.last = live != nullptr ? live->last : base->last;
+            out.put(entry);
+            nameOffset += entry.nameLength;
+            firstBlock += entry.blockCount;
+            bytesOffset += entry.bytesLength;
+        });
+        out.end();
+
+        out.begin(SnapshotSection::TermNames);
+        forEachIndexedTerm([&](string_view term, const BaseTerm *, const PostingList *)
+        {
+            out.write(term.data(), term.size());
+        });
+        out.end();
+
+        out.begin(SnapshotSection::BlockFirsts);
+        forEachIndexedTerm([&](string_view, const BaseTerm *base, const PostingList *live)
+        {
+            if (base != nullptr)
+            {
+                out.write(base->postings.blockFirst, base->postings.blocks * sizeof(uint32_t));
+            }
+            if (live != nullptr)
+            {
+                out.write(live->blockFirst.data(), live->blockFirst.size() * sizeof(uint32_t));
+            }
+        });
+        out.end();
+
+        out.begin(SnapshotSection::BlockOffsets);
+        forEachIndexedTerm([&](string_view, const BaseTerm *base, const PostingList *live)
+        {
+            size_t shift = 0;
+            if (base != nullptr)
+            {
+                out.write(base->postings.blockOffset, base->postings.blocks * sizeof(uint32_t));
+                shift = base->postings.size;
+            }
+            if (live != nullptr)
+            {
+                for (uint32_t offset : live->blockOffset)
+                {
+                    out.put(static_cast<uint32_t>(offset + shift));
+                }
+            }
+        });
+        out.end();
+
+        out.begin(SnapshotSection::PostingBytes);
+        forEachIndexedTerm([&](string_view, const BaseTerm *base, const PostingList *live)
+        {
+            if (base != nullptr)
+            {
+                out.write(base->postings.bytes, base->postings.size);
+            }
+            if (live != nullptr)
+            {
+                out.write(live->bytes.data(), live->bytes.size());
+            }
+        });
+        out.end();
+    }
+
+    // Serves the index saved in a snapshot straight from the mapping, which must outlive it.
+    // convos are the restored conversations in snapshot order. Only the term directory is read.
+    void restore(const SnapshotView &snapshot, const vector<const Conversation *> &convos)
+    {
+        lock_guard<mutex> guard(lock);
+        if (baseCount != 0 || !documents.empty())
+        {
+            throw logic_error("Snapshots restore into an empty index");
+        }
+        size_t termCount, nameBytes, blockCount, offsetCount, byteCount, documentCount;
+        const SnapshotTerm *entries = snapshot.section<SnapshotTerm>(SnapshotSection::Terms, termCount);
+        const char *names = snapshot.section<char>(SnapshotSection::TermNames, nameBytes);
+        const uint32_t *firsts = snapshot.section<uint32_t>(SnapshotSection::BlockFirsts, blockCount);
+        const uint32_t *offsets = snapshot.section<uint32_t>(SnapshotSection::BlockOffsets, offsetCount);
+        const uint8_t *bytes = snapshot.section<uint8_t>(SnapshotSection::PostingBytes, byteCount);
+        const Document *restored = snapshot.section<Document>(SnapshotSection::Documents, documentCount);
+        if (blockCount != offsetCount || documentCount >= UINT32_MAX)
+        {
+            throw runtime_error("Snapshot search index is corrupt");
+        }
+        // Built aside so a corrupt snapshot leaves the index empty
+        vector<BaseTerm> restoredTerms;
+        restoredTerms.reserve(termCount);
+        for (size_t t = 0; t < termCount; t++)
+        {
+            const SnapshotTerm &entry = entries[t];
+            if (entry.nameOffset > nameBytes || entry.nameLength > nameBytes - entry.nameOffset ||
+                entry.firstBlock > blockCount || entry.blockCount > blockCount - entry.firstBlock ||
+                entry.bytesOffset > byteCount || entry.bytesLength > byteCount - entry.bytesOffset || entry.blockCount == 0)
+            {
+                throw runtime_error("Snapshot search index is corrupt");
+            }
+            PostingView postings{bytes + entry.bytesOffset, static_cast<size_t>(entry.bytesLength), firsts + entry.firstBlock,
+                                 offsets + entry.firstBlock, entry.blockCount};
+            restoredTerms.push_back(BaseTerm{string_view(names + entry.nameOffset, entry.nameLength), postings, entry.count, entry.last});
+        }
+        baseTerms.swap(restoredTerms);
+        baseDocuments = restored;
+        baseCount = static_cast<uint32_t>(documentCount);
+        conversationList = convos;
+        conversationIds.clear();
+        for (uint32_t id = 0; id < conversationList.size(); id++)
+        {
+            conversationIds.emplace(conversationList[id], id);
+        }
+    }
+
+private:
+    // Calls f(term, restored postings or null, newer postings or null) for every term, in order
+    template <typename F>
+    void forEachIndexedTerm(F f) const
+    {
+        auto base = baseTerms.begin();
+        auto live = terms.begin();
+        while (base != baseTerms.end() || live != terms.end())
+        {
+            if (live == terms.end() || (base != baseTerms.end() && base->term < live->first))
+            {
+                f(base->term, &*base, nullptr);
+                ++base;
+            }
+            else if (base == baseTerms.end() || live->first < base->term)
+            {
+                f(string_view(live->first), nullptr, &live->second);
+                ++live;
+            }
+            else
+            {
+                f(base->term, &*base, &live->second);
+                ++base;
+                ++live;
+            }
+        }
+    }
+};
+
+// SHA-256 (FIPS 180-4), used for password hashing
+class Sha256
+{
+private:
+    static constexpr uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block[64];
+    size_t blockLength = 0;
+    uint64_t totalLength = 0;
+
+    static uint32_t rotr(uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress()
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = static_cast<uint32_t>(block[4 * i]) << 24 | static_cast<uint32_t>(block[4 * i + 1]) << 16 |
+                   static_cast<uint32_t>(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+public:
+    typedef array<uint8_t, 32> Digest;
+
+    void update(const void *data, size_t length)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        totalLength += length;
+        while (length > 0)
+        {
+            size_t n = min(length, sizeof(block) - blockLength);
+            memcpy(block + blockLength, bytes, n);
+            blockLength += n;
+            bytes += n;
+            length -= n;
+            if (blockLength == sizeof(block))
+            {
+                compress();
+                blockLength = 0;
+            }
+        }
+    }
+
+    Digest finish()
+    {
+        uint64_t bits = totalLength * 8;
+        uint8_t padding = 0x80;
+        update(&padding, 1);
+        padding = 0;
+        while (blockLength != 56)
+        {
+            update(&padding, 1);
+        }
+        uint8_t lengthBytes[8];
+        for (int i = 0; i < 8; i++)
+        {
+            lengthBytes[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        update(lengthBytes, 8);
+        Digest digest;
+        for (int i = 0; i < 8; i++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                digest[4 * i + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+            }
+        }
+        return digest;
+    }
+
+    static Digest hash(const void *data, size_t length)
+    {
+        Sha256 sha;
+        sha.update(data, length);
+        return sha.finish();
+    }
+};
+
+// PBKDF2-HMAC-SHA256 with a single output block, for salted password hashes
+Sha256::Digest pbkdf2Sha256(const string &password, const uint8_t *salt, size_t saltLength, uint32_t iterations)
+{
+    // HMAC key blocks; long passwords are hashed down first
+    uint8_t key[64] = {0};
+    if (password.size() > sizeof(key))
+    {
+        Sha256::Digest digest = Sha256::hash(password.data(), password.size());
+        memcpy(key, digest.data(), digest.size());
+    }
+    else
+    {
+        memcpy(key, password.data(), password.size());
+    }
+    uint8_t innerPad[64], outerPad[64];
+    for (int i = 0; i < 64; i++)
+    {
+        innerPad[i] = key[i] ^ 0x36;
+        outerPad[i] = key[i] ^ 0x5c;
+    }
+    auto hmac = [&](const uint8_t *data, size_t length, const uint8_t *more, size_t moreLength)
+    {
+        Sha256 inner;
+        inner.update(innerPad, sizeof(innerPad));
+        inner.update(data, length);
+        inner.update(more, moreLength);
+        Sha256::Digest innerDigest = inner.finish();
+        Sha256 outer;
+        outer.update(outerPad, sizeof(outerPad));
+        outer.update(innerDigest.data(), innerDigest.size());
+        return outer.finish();
+    };
+
+    const uint8_t blockIndex[4] = {0, 0, 0, 1};
+    Sha256::Digest u = hmac(salt, saltLength, blockIndex, sizeof(blockIndex));
+    Sha256::Digest result = u;
+    for (uint32_t i = 1; i < iterations; i++)
+    {
+        u = hmac(u.data(), u.size(), nullptr, 0);
+        for (size_t j = 0; j < result.size(); j++)
+        {
+            result[j] ^= u[j];
+        }
+    }
+    return result;
+}
+
+// Account details; the password is only kept as a salted PBKDF2 hash
+class Logindetails
+{
+private:
+    static const uint32_t HASH_ITERATIONS = 4096;
+
+    array<uint8_t, 16> salt;
+    Sha256::Digest pass;
+
+public:
+    string username;
+    int friends;
+    float co;
+    Logindetails(string a, string f, int c, float g)
+    {
+        random_device random;
+        for (size_t i = 0; i < salt.size(); i += 4)
+        {
+            uint32_t r = random();
+            memcpy(salt.data() + i, &r, 4);
+        }
+        pass = pbkdf2Sha256(a, salt.data(), salt.size(), HASH_ITERATIONS);
+        username = f;
+        friends = c;
+        co = g;
+    }
+
+    // Compares in constant time so the check does not leak how many bytes matched
+    bool checkPassword(const string &password) const
+    {
+        Sha256::Digest attempt = pbkdf2Sha256(password, salt.data(), salt.size(), HASH_ITERATIONS);
+        uint8_t difference = 0;
+        for (size_t i = 0; i < attempt.size(); i++)
+        {
+            difference |= attempt[i] ^ pass[i];
+        }
+        return difference == 0;
+    }
+
+    // Does the hashing work of checkPassword for a username with no account, against a fixed
+    // salt, so a failed login takes as long whether or not the name exists. The digest goes
+    // to an atomic so the compiler cannot drop the unused hash.
+    static void hashWithoutAccount(const string &password)
+    {
+        static const uint8_t DUMMY_SALT[16] = {'n', 'o', ' ', 's', 'u', 'c', 'h', ' ', 'a', 'c', 'c', 'o', 'u', 'n', 't', '.'};
+        static atomic<uint8_t> sink{0};
+        Sha256::Digest attempt = pbkdf2Sha256(password, DUMMY_SALT, sizeof(DUMMY_SALT), HASH_ITERATIONS);
+        sink.store(attempt[0], memory_order_relaxed);
+    }
+};
+
+// Hash table of accounts, split into independently locked shards
+// Logins only take a shard's shared lock, and the password hashing runs outside any lock,
+// so many threads can verify logins at once.
+class CredentialStore
+{
+private:
+    static const size_t SHARD_COUNT = 64;
+
+    struct Shard
+    {
+        mutable shared_mutex lock;
+        unordered_map<string, shared_ptr<const Logindetails>> accounts;
+    };
+
+    Shard shards[SHARD_COUNT];
+
+    Shard &shardFor(const string &username)
+    {
+        return shards[hash<string>()(username) % SHARD_COUNT];
+    }
+
+    const Shard &shardFor(const string &username) const
+    {
+        return shards[hash<string>()(username) % SHARD_COUNT];
+    }
+
+    // Heap bytes behind a string, none when its text fits inside the string object
+    static size_t textBytes(const string &text)
+    {
+        const char *data = text.data();
+        bool inlined = data >= reinterpret_cast<const char *>(&text) && data < reinterpret_cast<const char *>(&text + 1);
+        return inlined ? 0 : text.capacity() + 1;
+    }
+
+public:
+    // Returns false if the username is already taken
+    bool createAccount(const string &username, const string &password)
+    {
+        if (find(username) != nullptr)
+        {
+            return false;
+        }
+        // Hash before locking; a racing creator of the same name loses at the insert
+        shared_ptr<const Logindetails> account = make_shared<Logindetails>(password, username, 0, 0.0f);
+        Shard &shard = shardFor(username);
+        unique_lock<shared_mutex> guard(shard.lock);
+        return shard.accounts.emplace(username, account).second;
+    }
+
+    shared_ptr<const Logindetails> find(const string &username) const
+    {
+        const Shard &shard = shardFor(username);
+        shared_lock<shared_mutex> guard(shard.lock);
+        auto it = shard.accounts.find(username);
+        return it == shard.accounts.end() ? nullptr : it->second;
+    }
+
+    // Unknown usernames cost a hash too, so timing does not reveal which accounts exist
+    bool verifyLogin(const string &username, const string &password) const
+    {
+        shared_ptr<const Logindetails> account = find(username);
+        if (account == nullptr)
+        {
+            Logindetails::hashWithoutAccount(password);
+            return false;
+        }
+        return account->checkPassword(password);
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for (const auto &shard : shards)
+        {
+            shared_lock<shared_mutex> guard(shard.lock);
+            total += shard.accounts.size();
+        }
+        return total;
+    }
+
+    // Bytes held for all accounts: hash buckets, entries and the shared account records
+    size_t memoryUsage() const
+    {
+        size_t bytes = sizeof(*this);
+        for (const auto &shard : shards)
+        {
+            shared_lock<shared_mutex> guard(shard.lock);
+            bytes += shard.accounts.bucket_count() * sizeof(void *);
+            for (const auto &entry : shard.accounts)
+            {
+                // Node with its link and cached hash, then the record sharing a block with its reference counts
+                bytes += sizeof(entry) + 2 * sizeof(void *) + textBytes(entry.first);
+                bytes += sizeof(Logindetails) + 2 * sizeof(void *) + textBytes(entry.second->username);
+            }
+        }
+        return bytes;
+    }
+};
+
+const size_t ATTACHMENT_DIGEST_LENGTH = 64;
+
+// True for a hex SHA-256 digest naming a stored attachment
+bool isAttachmentDigest(string_view digest)
+{
+    if (digest.size() != ATTACHMENT_DIGEST_LENGTH)
+    {
+        return false;
+    }
+    for (char c : digest)
+    {
+        if (!isxdigit(static_cast<unsigned char>(c)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Splits an attachment payload of the form "<sha256 hex>:<filename>"
+// Returns false for plain payloads (text, or media whose file was not found when sent)
+bool parseAttachment(string_view payload, string_view &digest, string_view &filename)
+{
+    const size_t DIGEST_LENGTH = ATTACHMENT_DIGEST_LENGTH;
+    if (payload.size() <= DIGEST_LENGTH || payload[DIGEST_LENGTH] != ':' || !isAttachmentDigest(payload.substr(0, DIGEST_LENGTH)))
+    {
+        return false;
+    }
+    digest = payload.substr(0, DIGEST_LENGTH);
+    filename = payload.substr(DIGEST_LENGTH + 1);
+    return true;
+}
+
+// Resolves a file name given in a command. With an empty directory the name is used as it is,
+// for local users naming their own files; otherwise it must be a relative name that stays inside
+// directory, so server clients cannot reach other files. Returns an empty path for a refused name.
+filesystem::path resolveClientPath(const string &directory, const string &name)
+{
+    filesystem::path path(name);
+    if (directory.empty() || name.empty())
+    {
+        return path;
+    }
+    if (path.has_root_path())
+    {
+        return filesystem::path();
+    }
+    for (const auto &part : path)
+    {
+        if (part == "..")
+        {
+            return filesystem::path();
+        }
+    }
+    return filesystem::path(directory) / path;
+}
+
+// Content-addressed store for image and voice note files
+// Each file is kept once under its SHA-256 digest, however many messages reference it
+class AttachmentStore
+{
+private:
+    filesystem::path directory;
+    atomic<uint64_t> storedFiles{0};
+    atomic<uint64_t> storedBytes{0};
+    atomic<uint64_t> referencedFiles{0};
+    atomic<uint64_t> referencedBytes{0};
+
+    static string toHex(const Sha256::Digest &digest)
+    {
+        static const char HEX[] = "0123456789abcdef";
+        string hex;
+        for (uint8_t byte : digest)
+        {
+            hex.push_back(HEX[byte >> 4]);
+            hex.push_back(HEX[byte & 0xF]);
+        }
+        return hex;
+    }
+
+    filesystem::path pathFor(string_view digest) const
+    {
+        if (!isAttachmentDigest(digest))
+        {
+            throw invalid_argument("Invalid attachment id " + string(digest));
+        }
+        return directory / string(digest);
+    }
+
+public:
+    explicit AttachmentStore(const filesystem::path &directory) : directory(directory)
+    {
+        filesystem::create_directories(directory);
+    }
+
+    // Stores the file at sourcePath (once per distinct content) and returns its digest,
+    // or an empty string if there is no such file
+    string put(const string &sourcePath)
+    {
+        error_code error;
+        if (sourcePath.empty() || !filesystem::is_regular_file(sourcePath, error))
+        {
+            return "";
+        }
+        MappedFile source(sourcePath);
+        string digest = toHex(Sha256::hash(source.getData(), source.size()));
+        referencedFiles++;
+        referencedBytes += source.size();
+
+        filesystem::path target = directory / digest;
+        if (!filesystem::exists(target, error))
+        {
+            // Copy next to the target, then rename so readers never see a partial file
+            filesystem::path temporary = target;
+            temporary += ".tmp" + to_string(hash<thread::id>()(this_thread::get_id()));
+            filesystem::copy_file(sourcePath, temporary, filesystem::copy_options::overwrite_existing);
+            filesystem::rename(temporary, target);
+            storedFiles++;
+            storedBytes += source.size();
+        }
+        return digest;
+    }
+
+    // Maps a stored attachment for zero-copy reads
+    unique_ptr<MappedFile> open(string_view digest) const
+    {
+        filesystem::path path = pathFor(digest);
+        if (!filesystem::exists(path))
+        {
+            throw invalid_argument("No attachment " + string(digest));
+        }
+        return unique_ptr<MappedFile>(new MappedFile(path.string()));
+    }
+
+    // Streams a stored attachment to fd in chunks, kernel-to-kernel where sendfile is available
+    void streamTo(string_view digest, int fd, size_t chunkSize = 1 << 20) const
+    {
+#ifdef __linux__
+        filesystem::path path = pathFor(digest);
+        int in = ::open(path.c_str(), O_RDONLY);
+        if (in < 0)
+        {
+            throw invalid_argument("No attachment " + string(digest));
+        }
+        struct stat st;
+        fstat(in, &st);
+        off_t offset = 0;
+        while (offset < st.st_size)
+        {
+            ssize_t n = sendfile(fd, in, &offset, min(chunkSize, static_cast<size_t>(st.st_size - offset)));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                int error = errno;
+                close(in);
+                throw runtime_error(string("Cannot send attachment: ") + strerror(error));
+            }
+        }
+        close(in);
+#else
+        unique_ptr<MappedFile> file = open(digest);
+        for (size_t offset = 0; offset < file->size(); offset += chunkSize)
+        {
+            size_t n = min(chunkSize, file->size() - offset);
+            if (_write(fd, file->getData() + offset, static_cast<unsigned>(n)) != static_cast<int>(n))
+            {
+                throw runtime_error("Cannot send attachment");
+            }
+        }
+#endif
+    }
+
+    uint64_t getStoredFiles() const
+    {
+        return storedFiles;
+    }
+
+    uint64_t getStoredBytes() const
+    {
+        return storedBytes;
+    }
+
+    uint64_t getReferencedFiles() const
+    {
+        return referencedFiles;
+    }
+
+    uint64_t getReferencedBytes() const
+    {
+        return referencedBytes;
+    }
+};
+
+// Chat operations whose latency is tracked
+enum class Operation : uint8_t
+{
+    StartConversation,
+    SendMessage,
+    ViewConversation,
+    ReceiveMessage,
+    Search,
+    Count
+};
+
+constexpr string_view OPERATION_NAMES[] = {"start conversation", "send message", "view conversation", "receive message", "search"};
+
+// Log-linear latency histogram in the style of HdrHistogram
+// Values below 16 ns get their own bucket; above that each power of two is split into 16
+// sub-buckets, so any recorded value is known to within 1/16 (6.25%).
+// Written by one thread, read by snapshots from any thread.
+class LatencyHistogram
+{
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    atomic<uint64_t> counts[BUCKETS] = {};
+
+    static int bucketFor(uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+        {
+            return static_cast<int>(value);
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = static_cast<int>((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t lowestValueOf(int bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+        {
+            return static_cast<uint64_t>(bucket);
+        }
+        int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t sub = static_cast<uint64_t>(bucket % SUB_BUCKETS);
+        return (SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS);
+    }
+
+public:
+    // Single writer: a plain load + store is enough and avoids a locked instruction
+    void record(uint64_t nanoseconds)
+    {
+        atomic<uint64_t> &count = counts[bucketFor(nanoseconds)];
+        count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    void addTo(vector<uint64_t> &totals) const
+    {
+        totals.resize(BUCKETS);
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            totals[i] += counts[i].load(memory_order_relaxed);
+        }
+    }
+
+    // Value at quantile q (0..1) of merged bucket totals
+    static uint64_t valueAt(const vector<uint64_t> &totals, double q)
+    {
+        uint64_t total = 0;
+        for (uint64_t count : totals)
+        {
+            total += count;
+        }
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < static_cast<int>(totals.size()); i++)
+        {
+            seen += totals[i];
+            if (seen >= rank)
+            {
+                return lowestValueOf(i);
+            }
+        }
+        return lowestValueOf(BUCKETS - 1);
+    }
+};
+
+// Process-wide operation metrics
+// Every thread records into its own block, so the hot path never contends; snapshots
+// merge all blocks on demand. Operations are all counted, but only one in LATENCY_SAMPLE_EVERY
+// of each kind is timed, since reading the clock twice costs more than all the rest. Build with
+// -DNO_METRICS to compile the recording out, which is how --metrics-bench measures what it costs.
+class Metrics
+{
+private:
+    static const uint32_t LATENCY_SAMPLE_EVERY = 8;
+
+    struct ThreadBlock
+    {
+        LatencyHistogram latency[static_cast<int>(Operation::Count)];
+        atomic<uint64_t> operations[static_cast<int>(Operation::Count)] = {};
+        uint32_t ticks[static_cast<int>(Operation::Count)] = {}; // Only read by the owning thread
+        atomic<uint64_t> messages[2][3] = {};
+        atomic<uint64_t> bytes[2][3] = {};
+    };
+
+    mutex lock;
+    vector<unique_ptr<ThreadBlock>> blocks; // Kept after their thread exits so counts survive
+
+    ThreadBlock &local()
+    {
+        thread_local ThreadBlock *block = nullptr;
+        if (block == nullptr)
+        {
+            lock_guard<mutex> guard(lock);
+            blocks.push_back(unique_ptr<ThreadBlock>(new ThreadBlock()));
+            block = blocks.back().get();
+        }
+        return *block;
+    }
+
+    static void bump(atomic<uint64_t> &counter, uint64_t amount)
+    {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+public:
+    static Metrics &instance()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    // Counts an operation; returns whether to time it, which the first of each kind always is
+    bool beginOperation(Operation operation)
+    {
+#ifdef NO_METRICS
+        (void)operation;
+        return false;
+#else
+        ThreadBlock &block = local();
+        bump(block.operations[static_cast<int>(operation)], 1);
+        return block.ticks[static_cast<int>(operation)]++ % LATENCY_SAMPLE_EVERY == 0;
+#endif
+    }
+
+    void recordLatency(Operation operation, uint64_t nanoseconds)
+    {
+#ifdef NO_METRICS
+        (void)operation;
+        (void)nanoseconds;
+#else
+        local().latency[static_cast<int>(operation)].record(nanoseconds);
+#endif
+    }
+
+    void recordMessage(MessageKind kind, MessageDirection direction, size_t length)
+    {
+#ifdef NO_METRICS
+        (void)kind;
+        (void)direction;
+        (void)length;
+#else
+        ThreadBlock &block = local();
+        bump(block.messages[static_cast<int>(direction)][static_cast<int>(kind)], 1);
+        bump(block.bytes[static_cast<int>(direction)][static_cast<int>(kind)], length);
+#endif
+    }
+
+    // Writes latency percentiles and message counts as text
+    template <typename Out>
+    void snapshot(Out &out)
+    {
+        lock_guard<mutex> guard(lock);
+        out << "operation\tcount\tp50 us\tp99 us\tmax us\n";
+        for (int op = 0; op < static_cast<int>(Operation::Count); op++)
+        {
+            vector<uint64_t> totals;
+            uint64_t count = 0;
+            for (auto &block : blocks)
+            {
+                block->latency[op].addTo(totals);
+                count += block->operations[op].load(memory_order_relaxed);
+            }
+            out << OPERATION_NAMES[op] << '\t' << static_cast<size_t>(count) << '\t'
+                << static_cast<size_t>(LatencyHistogram::valueAt(totals, 0.50) / 1000) << '\t'
+                << static_cast<size_t>(LatencyHistogram::valueAt(totals, 0.99) / 1000) << '\t'
+                << static_cast<size_t>(LatencyHistogram::valueAt(totals, 1.0) / 1000) << '\n';
+        }
+        out << "message kind\tcount\tbytes\n";
+        for (int direction = 0; direction < 2; direction++)
+        {
+            for (int kind = 0; kind < 3; kind++)
+            {
+                uint64_t messages = 0, bytes = 0;
+                for (auto &block : blocks)
+                {
+                    messages += block->messages[direction][kind].load(memory_order_relaxed);
+                    bytes += block->bytes[direction][kind].load(memory_order_relaxed);
+                }
+                string_view name = MESSAGE_TYPE_NAMES[direction][kind];
+                out << name.substr(name.find_first_not_of('\t')) << '\t' << static_cast<size_t>(messages) << '\t' << static_cast<size_t>(bytes) << '\n';
+            }
+        }
+    }
+};
+
+// Records how long the enclosing scope took under an operation; does nothing with -DNO_METRICS
+class ScopedTimer
+{
+#ifdef NO_METRICS
+public:
+    explicit ScopedTimer(Operation) {}
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+#else
+private:
+    Operation operation;
+    bool timed; // Operations not sampled for latency are only counted
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(Operation operation) : operation(operation), timed(Metrics::instance().beginOperation(operation))
+    {
+        if (timed)
+        {
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+    ~ScopedTimer()
+    {
+        if (timed)
+        {
+            uint64_t elapsed = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            Metrics::instance().recordLatency(operation, elapsed);
+        }
+    }
+#endif
+};
+
+// Conversations ordered by most recent activity, for the CHATS list
+// Every new message moves its conversation to the front in O(log N), so showing the newest
+// chats touches only the entries shown, however many conversations and messages exist.
+class Inbox
+{
+private:
+    mutable mutex lock;
+    set<pair<uint64_t, Conversation *>, greater<pair<uint64_t, Conversation *>>> order; // Newest first
+    uint64_t clock = 0;
+
+public:
+    // Moves convo to the front and returns its new position stamp; previous 0 means not listed yet
+    uint64_t touch(Conversation *convo, uint64_t previous)
+    {
+        lock_guard<mutex> guard(lock);
+        if (previous != 0)
+        {
+            order.erase(make_pair(previous, convo));
+        }
+        order.insert(make_pair(++clock, convo));
+        return clock;
+    }
+
+    // Moves convo to an earlier stamp's position, e.g. one taken over from a merged conversation
+    uint64_t restamp(Conversation *convo, uint64_t previous, uint64_t stamp)
+    {
+        lock_guard<mutex> guard(lock);
+        order.erase(make_pair(previous, convo));
+        order.insert(make_pair(stamp, convo));
+        return stamp;
+    }
+
+    void remove(Conversation *convo, uint64_t stamp)
+    {
+        lock_guard<mutex> guard(lock);
+        order.erase(make_pair(stamp, convo));
+    }
+
+    // Up to limit conversations, most recently active first; limit 0 means all
+    vector<Conversation *> recent(size_t limit = 0) const
+    {
+        lock_guard<mutex> guard(lock);
+        vector<Conversation *> result;
+        for (const auto &entry : order)
+        {
+            if (limit != 0 && result.size() == limit)
+            {
+                break;
+            }
+            result.push_back(entry.second);
+        }
+        return result;
+    }
+
+    size_t size() const
+    {
+        lock_guard<mutex> guard(lock);
+        return order.size();
+    }
+};
+
+// Incrementally maintained overview of a conversation for the CHATS list
+struct ConversationSummary
+{
+    static const size_t PREVIEW_LENGTH = 40;
+
+    uint64_t inboxStamp = 0;   // Position in the inbox, 0 if not listed
+    int64_t lastActivity = 0;  // Milliseconds since the epoch, 0 if unknown (history from version 1 logs)
+    uint32_t unread = 0;       // Received messages since the conversation was last viewed or answered
+    MessageKind lastKind = MessageKind::Text;
+    MessageDirection lastDirection = MessageDirection::Sent;
+    string preview;            // Start of the last message, or the attachment's filename
+};
+
+// Milliseconds since the epoch
+int64_t currentTimeMillis()
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Formats milliseconds since the epoch as local "YYYY-MM-DD HH:MM"
+string formatTimestamp(int64_t millis)
+{
+    time_t seconds = static_cast<time_t>(millis / 1000);
+    tm local;
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M", &local);
+    return text;
+}
+
+// Handle of a string interned in the StringPool
+using StringHandle = uint32_t;
+
+// Process-wide table of interned strings such as usernames. Each distinct string is stored once
+// and named by a dense 32-bit handle, so holders keep 4 bytes instead of a std::string and equal
+// strings compare as equal handles. Interning and lookups by text take a lock; resolving a handle
+// does not, since entries and their bytes never move once added.
+class StringPool
+{
+private:
+    struct Entry
+    {
+        const char *data;
+        uint32_t length;
+        uint32_t hash;
+    };
+
+    static const size_t BLOCK_SHIFT = 16; // Entries per block, as a power of two
+    static const size_t BLOCK_ENTRIES = size_t(1) << BLOCK_SHIFT;
+    static const size_t MAX_BLOCKS = size_t(1) << (32 - BLOCK_SHIFT);
+    static const size_t ARENA_BYTES = 64 * 1024;
+
+    unique_ptr<atomic<Entry *>[]> blocks; // Fixed table of entry blocks, so readers never see it move
+    vector<unique_ptr<char[]>> arenas;    // String bytes, without terminators
+    char *arena = nullptr;                // The one short strings are added to
+    size_t arenaUsed = ARENA_BYTES;
+    size_t arenaBytes = 0;
+    vector<uint32_t> slots; // Handle + 1, 0 means empty slot
+    uint32_t count = 0;
+    mutable mutex lock;
+
+    StringPool() : blocks(new atomic<Entry *>[MAX_BLOCKS]()) {}
+
+    static uint32_t hashText(string_view text)
+    {
+        return static_cast<uint32_t>(hash<string_view>()(text));
+    }
+
+    const Entry &entry(StringHandle handle) const
+    {
+        return blocks[handle >> BLOCK_SHIFT].load(memory_order_acquire)[handle & (BLOCK_ENTRIES - 1)];
+    }
+
+    // Linear probing; returns the slot holding text or the empty slot where it would go
+    size_t probe(string_view text, uint32_t h) const
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        while (slots[i] != 0)
+        {
+            const Entry &e = entry(slots[i] - 1);
+            if (e.hash == h && e.length == text.size() && memcmp(e.data, text.data(), text.size()) == 0)
+            {
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow()
+    {
+        slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+        for (uint32_t handle = 0; handle < count; handle++)
+        {
+            const Entry &e = entry(handle);
+            slots[probe(string_view(e.data, e.length), e.hash)] = handle + 1;
+        }
+    }
+
+    // Copies text into the arenas; long strings get an allocation of their own
+    const char *store(string_view text)
+    {
+        if (text.size() > ARENA_BYTES / 4)
+        {
+            arenas.emplace_back(new char[text.size()]);
+            arenaBytes += text.size();
+            memcpy(arenas.back().get(), text.data(), text.size());
+            return arenas.back().get();
+        }
+        if (arenaUsed + text.size() > ARENA_BYTES)
+        {
+            arenas.emplace_back(new char[ARENA_BYTES]);
+            arenaBytes += ARENA_BYTES;
+            arena = arenas.back().get();
+            arenaUsed = 0;
+        }
+        char *destination = arena + arenaUsed;
+        memcpy(destination, text.data(), text.size());
+        arenaUsed += text.size();
+        return destination;
+    }
+
+public:
+    StringPool(const StringPool &) = delete;
+    StringPool &operator=(const StringPool &) = delete;
+
+    ~StringPool()
+    {
+        for (size_t b = 0; b < MAX_BLOCKS && blocks[b].load() != nullptr; b++)
+        {
+            delete[] blocks[b].load();
+        }
+    }
+
+    static StringPool &instance()
+    {
+        static StringPool pool;
+        return pool;
+    }
+
+    // Returns the handle of text, adding it if it is new
+    StringHandle intern(string_view text)
+    {
+        if (text.size() > UINT32_MAX)
+        {
+            throw length_error("String too long to intern");
+        }
+        uint32_t h = hashText(text);
+        lock_guard<mutex> guard(lock);
+        if (!slots.empty())
+        {
+            size_t slot = probe(text, h);
+            if (slots[slot] != 0)
+            {
+                return slots[slot] - 1;
+            }
+        }
+        if (count == UINT32_MAX - 1)
+        {
+            throw length_error("Too many interned strings");
+        }
+        StringHandle handle = count;
+        if ((handle & (BLOCK_ENTRIES - 1)) == 0)
+        {
+            blocks[handle >> BLOCK_SHIFT].store(new Entry[BLOCK_ENTRIES], memory_order_release);
+        }
+        Entry &e = blocks[handle >> BLOCK_SHIFT].load(memory_order_relaxed)[handle & (BLOCK_ENTRIES - 1)];
+        e.data = store(text);
+        e.length = static_cast<uint32_t>(text.size());
+        e.hash = h;
+        count++;
+        if ((static_cast<size_t>(count) + 1) * 2 > slots.size())
+        {
+            grow();
+        }
+        else
+        {
+            slots[probe(text, h)] = handle + 1;
+        }
+        return handle;
+    }
+
+    // Finds the handle of text without interning it
+    bool lookup(string_view text, StringHandle &handle) const
+    {
+        uint32_t h = hashText(text);
+        lock_guard<mutex> guard(lock);
+        if (slots.empty())
+        {
+            return false;
+        }
+        size_t slot = probe(text, h);
+        if (slots[slot] == 0)
+        {
+            return false;
+        }
+        handle = slots[slot] - 1;
+        return true;
+    }
+
+    string_view view(StringHandle handle) const
+    {
+        const Entry &e = entry(handle);
+        return string_view(e.data, e.length);
+    }
+
+    size_t size() const
+    {
+        lock_guard<mutex> guard(lock);
+        return count;
+    }
+
+    // Bytes held for all interned strings: text, entries, hash slots and the block table
+    size_t memoryUsage() const
+    {
+        lock_guard<mutex> guard(lock);
+        size_t blockCount = (count + BLOCK_ENTRIES - 1) / BLOCK_ENTRIES;
+        return arenaBytes + blockCount * BLOCK_ENTRIES * sizeof(Entry) + slots.capacity() * sizeof(uint32_t) +
+               MAX_BLOCKS * sizeof(atomic<Entry *>);
+    }
+};
+
+// Interned identity of a contact: the handle of their username
+using UserId = StringHandle;
+
+// Nanoseconds on the monotonic clock, for rate limiting
+int64_t steadyNanos()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Token bucket kept in a single atomic: the time at which the bucket would be full again (the
+// generic cell rate algorithm). Every token pushes that time one interval further; a token is
+// available while it stays within capacity of now. Taking one is a compare-and-swap, no lock.
+class TokenBucket
+{
+private:
+    atomic<int64_t> fullAt{0};
+
+public:
+    // interval: nanoseconds per token; capacity: interval times the burst size
+    bool take(int64_t now, int64_t interval, int64_t capacity)
+    {
+        int64_t current = fullAt.load(memory_order_relaxed);
+        for (;;)
+        {
+            int64_t next = (current > now ? current : now) + interval;
+            if (next - now > capacity)
+            {
+                return false;
+            }
+            if (fullAt.compare_exchange_weak(current, next, memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    // Gives back a token taken by take()
+    void refund(int64_t interval)
+    {
+        fullAt.fetch_sub(interval, memory_order_relaxed);
+    }
+};
+
+// Messages per second and burst sizes for admission control; a rate of 0 turns that limit off
+struct RateLimits
+{
+    double userRate = 0;
+    double userBurst = 0;
+    double globalRate = 0;
+    double globalBurst = 0;
+
+    bool enabled() const
+    {
+        return userRate > 0 || globalRate > 0;
+    }
+};
+
+enum class Admission : uint8_t
+{
+    Admitted,
+    UserLimited,
+    GlobalLimited
+};
+
+// Thrown when a message is turned away by the rate limiter
+class RateLimitExceeded : public runtime_error
+{
+public:
+    explicit RateLimitExceeded(const string &what) : runtime_error(what) {}
+};
+
+// Admission control in front of every send and receive. Each user has a token bucket (kept in
+// their canonical conversation) and all of them share a global one. The user's bucket is checked
+// first, so a flooding sender runs out of its own tokens without using up everyone else's.
+class RateLimiter
+{
+private:
+    int64_t userInterval = 0, userCapacity = 0;
+    int64_t globalInterval = 0, globalCapacity = 0;
+    // Every sender writes the global bucket and the counters, so each gets its own cache line
+    // away from the limits above, which every admit() reads
+    alignas(64) TokenBucket global;
+    alignas(64) atomic<uint64_t> admitted{0};
+    alignas(64) atomic<uint64_t> userLimited{0};
+    alignas(64) atomic<uint64_t> globalLimited{0};
+
+    static void toBucket(double rate, double burst, int64_t &interval, int64_t &capacity)
+    {
+        if (rate <= 0)
+        {
+            return;
+        }
+        interval = static_cast<int64_t>(1e9 / rate);
+        interval = interval > 0 ? interval : 1;
+        capacity = static_cast<int64_t>(interval * (burst >= 1 ? burst : 1));
+    }
+
+public:
+    explicit RateLimiter(const RateLimits &limits)
+    {
+        toBucket(limits.userRate, limits.userBurst, userInterval, userCapacity);
+        toBucket(limits.globalRate, limits.globalBurst, globalInterval, globalCapacity);
+    }
+
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    // Takes a token from the user's bucket and from the global one, or neither
+    Admission admit(TokenBucket &user, int64_t now)
+    {
+        if (userInterval != 0 && !user.take(now, userInterval, userCapacity))
+        {
+            userLimited.fetch_add(1, memory_order_relaxed);
+            return Admission::UserLimited;
+        }
+        if (globalInterval != 0 && !global.take(now, globalInterval, globalCapacity))
+        {
+            if (userInterval != 0)
+            {
+                user.refund(userInterval);
+            }
+            globalLimited.fetch_add(1, memory_order_relaxed);
+            return Admission::GlobalLimited;
+        }
+        admitted.fetch_add(1, memory_order_relaxed);
+        return Admission::Admitted;
+    }
+
+    Admission admit(TokenBucket &user)
+    {
+        return admit(user, steadyNanos());
+    }
+
+    uint64_t getAdmitted() const
+    {
+        return admitted.load(memory_order_relaxed);
+    }
+
+    uint64_t getUserLimited() const
+    {
+        return userLimited.load(memory_order_relaxed);
+    }
+
+    uint64_t getGlobalLimited() const
+    {
+        return globalLimited.load(memory_order_relaxed);
+    }
+};
+
+class Snapshotter;
+
+// Shared services every conversation reports new messages to; any of them may be null
+struct ChatServices
+{
+    MessageLog *log = nullptr;
+    SearchIndex *search = nullptr;
+    AttachmentStore *attachments = nullptr;
+    HistoryTier *history = nullptr;
+    Inbox *inbox = nullptr;
+    RateLimiter *limiter = nullptr;
+    Snapshotter *snapshots = nullptr; // Used by the snapshot command, not by conversations
+    string fileDirectory; // Where files named in commands live; empty lets names point anywhere
+};
+
+// Base class for all conversation types
+class Conversation
+{
+protected:
+    MessageStore messages;  // Store multiple messages for each user
+    ChatServices *services; // Log and index new messages are reported to, may be null
+    ConversationSummary summary;
+    TokenBucket rateBucket; // The user's share of the rate limit
+    UserId name;            // Interned username, also the user's identity in a registry
+    atomic<uint32_t> queued{0}; // Submitted to an IngestEngine and not applied yet
+
+public:
+    Conversation(ChatServices *services = nullptr, string_view username = "") : services(services), name(StringPool::instance().intern(username))
+    {
+        messages.setTier(services != nullptr ? services->history : nullptr);
+        if (services != nullptr && services->inbox != nullptr)
+        {
+            summary.inboxStamp = services->inbox->touch(this, 0);
+        }
+    }
+
+    // View of the interned name, valid for the life of the process
+    string_view getUsername() const
+    {
+        return StringPool::instance().view(name);
+    }
+
+    UserId getUserId() const
+    {
+        return name;
+    }
+
+    const MessageStore &getMessages() const
+    {
+        return messages;
+    }
+
+    MessageStore &getMutableMessages()
+    {
+        return messages;
+    }
+
+    const ConversationSummary &getSummary() const
+    {
+        return summary;
+    }
+
+    // Called once the user has seen the conversation; the log keeps the read state for replay
+    void markRead()
+    {
+        if (summary.unread != 0)
+        {
+            summary.unread = 0;
+            logUnread();
+        }
+    }
+
+    // Writes the current unread count to the log, so replaying it ends with the same count
+    void logUnread()
+    {
+        if (services != nullptr && services->log != nullptr)
+        {
+            services->log->appendRead(getUsername(), summary.unread, currentTimeMillis());
+        }
+    }
+
+    // Takes the unread count from a read record during replay
+    void replayUnread(uint32_t unread)
+    {
+        summary.unread = unread;
+    }
+
+    // Asks the rate limiter, if any, to let one more message through for this user
+    Admission tryAdmit()
+    {
+        if (services == nullptr || services->limiter == nullptr)
+        {
+            return Admission::Admitted;
+        }
+        return services->limiter->admit(rateBucket);
+    }
+
+    // Throws RateLimitExceeded unless the message may go through
+    void admitMessage()
+    {
+        Admission admission = tryAdmit();
+        if (admission == Admission::UserLimited)
+        {
+            throw RateLimitExceeded("Too many messages for " + string(getUsername()) + ", slow down");
+        }
+        if (admission == Admission::GlobalLimited)
+        {
+            throw RateLimitExceeded("The platform is busy, try again shortly");
+        }
+    }
+
+    // Entry point for messages from users (menu, batch, server, sessions): admits, then stores
+    void submitMessage(MessageKind kind, MessageDirection direction, const string &content)
+    {
+        admitMessage();
+        addMessage(kind, direction, content);
+    }
+
+    atomic<uint32_t> &getQueued()
+    {
+        return queued;
+    }
+
+    // Stores a new message, appends it to the message log and indexes it for search
+    virtual void addMessage(MessageKind kind, MessageDirection direction, const string &content)
+    {
+        string reference = resolveAttachment(kind, content);
+        messages.append(kind, direction, currentTimeMillis(), reference.empty() ? content : reference);
+        recordMessage(messages.size() - 1);
+    }
+
+    // Adds a message from an import: it keeps its timestamp and counts as read, and a group
+    // does not deliver it to its members, whose own histories were imported with it.
+    // The importer logs the unread count afterwards (logUnread) so replay also counts it as read.
+    void importMessage(MessageKind kind, MessageDirection direction, int64_t timestamp, string_view content)
+    {
+        messages.append(kind, direction, timestamp, content);
+        size_t index = messages.size() - 1;
+        const MessageRecord &record = messages.record(index);
+        Metrics::instance().recordMessage(record.kind, record.direction, record.length);
+        if (services != nullptr && services->log != nullptr)
+        {
+            services->log->append(getUsername(), record.kind, record.direction, timestamp, record.payload, record.length);
+        }
+        indexMessage(index);
+        summarize(record, timestamp, false);
+    }
+
+    // Adds an already persisted message whose payload lives outside the store (e.g. in the mapped log)
+    void attachMessage(MessageKind kind, MessageDirection direction, int64_t timestamp, const char *payload, uint32_t length)
+    {
+        messages.attach(kind, direction, timestamp, payload, length);
+        indexMessage(messages.size() - 1);
+        // Counted like a live message; read records in the log reset the count
+        summarize(messages.record(messages.size() - 1), messages.timestamp(messages.size() - 1), true);
+    }
+
+    // Adds a message delivered through a group; the body is shared, not copied, and is not
+    // indexed again since the group conversation already holds it. The log only gets a reference
+    // to the group's record of the message at groupRecord (0 if it was not logged).
+    void deliverShared(MessageKind kind, MessageDirection direction, int64_t timestamp, SharedBody *body, uint64_t groupRecord)
+    {
+        messages.attachShared(kind, direction, timestamp, body);
+        if (groupRecord != 0 && services != nullptr && services->log != nullptr)
+        {
+            services->log->appendDelivery(getUsername(), kind, direction, timestamp, groupRecord);
+        }
+        summarize(messages.record(messages.size() - 1), messages.timestamp(messages.size() - 1), true);
+    }
+
+    // Replays a group delivery whose body lives in the group's record in the mapped log
+    void attachDelivered(MessageKind kind, MessageDirection direction, int64_t timestamp, const char *payload, uint32_t length)
+    {
+        messages.attach(kind, direction, timestamp, payload, length);
+        summarize(messages.record(messages.size() - 1), messages.timestamp(messages.size() - 1), true);
+    }
+
+    // Takes over the messages of duplicate conversations with the same user, interleaved by time,
+    // along with their unread counts and the most recent of their inbox positions.
+    // positions receives where each message went, as for MessageStore::merge.
+    void absorb(const vector<Conversation *> &duplicates, vector<vector<uint32_t>> &positions)
+    {
+        vector<MessageStore *> others;
+        uint32_t unread = summary.unread;
+        uint64_t stamp = summary.inboxStamp;
+        for (auto duplicate : duplicates)
+        {
+            others.push_back(&duplicate->messages);
+            unread += duplicate->summary.unread;
+            stamp = max(stamp, duplicate->summary.inboxStamp);
+        }
+        messages.merge(others, positions);
+        if (!messages.empty())
+        {
+            summarize(messages.record(messages.size() - 1), messages.timestamp(messages.size() - 1), false);
+        }
+        summary.unread = unread;
+        if (summary.inboxStamp != 0)
+        {
+            summary.inboxStamp = services->inbox->restamp(this, summary.inboxStamp, stamp);
+        }
+    }
+
+    // Takes count messages from mapped snapshot columns without reading them (see
+    // MessageStore::restoreLazily); the summary comes from the last message alone
+    void restoreMessages(const uint8_t *tags, const uint32_t *lengths, const int64_t *timestamps, const char *payloads,
+                         size_t count, uint64_t payloadBytes, uint32_t unread)
+    {
+        messages.restoreLazily(tags, lengths, timestamps, payloads, count);
+        if (count != 0)
+        {
+            size_t last = count - 1;
+            MessageRecord record{payloads + payloadBytes - lengths[last], lengths[last], static_cast<MessageKind>(tags[last] & 3),
+                                 static_cast<MessageDirection>(tags[last] >> 2)};
+            summarize(record, timestamps[last], false);
+        }
+        summary.unread = unread;
+    }
+
+    // Moves the conversation to the top of the inbox
+    void touchInbox()
+    {
+        if (summary.inboxStamp != 0)
+        {
+            summary.inboxStamp = services->inbox->touch(this, summary.inboxStamp);
+        }
+    }
+
+    // Approximate bytes owned by this conversation
+    virtual size_t memoryUsage() const
+    {
+        return sizeof(*this) + summary.preview.capacity() + messages.memoryUsage();
+    }
+
+    virtual ~Conversation()
+    {
+        if (summary.inboxStamp != 0)
+        {
+            services->inbox->remove(this, summary.inboxStamp);
+        }
+    }
+
+protected:
+    // Images and voice notes naming a local file are stored as references to the attachment store.
+    // Returns the reference payload, or an empty string to keep the content as typed.
+    string resolveAttachment(MessageKind kind, const string &content)
+    {
+        if (kind != MessageKind::Text && services != nullptr && services->attachments != nullptr)
+        {
+            // A refused name is kept as typed, like a file that does not exist
+            filesystem::path source = resolveClientPath(services->fileDirectory, content);
+            string digest = source.empty() ? "" : services->attachments->put(source.string());
+            if (!digest.empty())
+            {
+                return digest + ":" + content;
+            }
+        }
+        return "";
+    }
+
+    // Counts, logs and indexes the message just stored at index
+    // Returns the message's offset in the log, 0 if there is no log
+    uint64_t recordMessage(size_t index)
+    {
+        const MessageRecord &record = messages.record(index);
+        Metrics::instance().recordMessage(record.kind, record.direction, record.length);
+        uint64_t offset = 0;
+        if (services != nullptr && services->log != nullptr)
+        {
+            offset = services->log->append(getUsername(), record.kind, record.direction, messages.timestamp(index), record.payload, record.length);
+        }
+        indexMessage(index);
+        summarize(record, messages.timestamp(index), true);
+        return offset;
+    }
+
+private:
+    // Updates the summary for a newly stored message and moves the conversation up the inbox
+    // Live and replayed messages also update the unread count; imports and merges set it themselves.
+    void summarize(const MessageRecord &record, int64_t timestamp, bool live)
+    {
+        string_view text(record.payload, record.length);
+        string_view digest, filename;
+        if (record.kind != MessageKind::Text && parseAttachment(text, digest, filename))
+        {
+            text = filename;
+        }
+        if (text.size() > ConversationSummary::PREVIEW_LENGTH)
+        {
+            // Cut on a UTF-8 character boundary
+            size_t cut = ConversationSummary::PREVIEW_LENGTH;
+            while (cut > 0 && (static_cast<unsigned char>(text[cut]) & 0xC0) == 0x80)
+            {
+                cut--;
+            }
+            text = text.substr(0, cut);
+        }
+        summary.preview.assign(text.data(), text.size());
+        summary.lastKind = record.kind;
+        summary.lastDirection = record.direction;
+        if (timestamp != 0)
+        {
+            summary.lastActivity = timestamp;
+        }
+        if (live)
+        {
+            // Answering a chat means it has been read
+            summary.unread = record.direction == MessageDirection::Received ? summary.unread + 1 : 0;
+        }
+        touchInbox();
+    }
+
+    void indexMessage(size_t index)
+    {
+        if (services != nullptr && services->search != nullptr)
+        {
+            services->search->add(this, index, messages[index].getContentView());
+        }
+    }
+};
+
+// Derived class for a conversation with multimedia support
+class MultimediaConversation : public Conversation
+{
+public:
+    MultimediaConversation(ChatServices *services = nullptr, string_view username = "") : Conversation(services, username) {}
+
+#ifndef HAVE_COROUTINES
+    // The receive menu of the C++17 build; C++20 builds run it as a chat session
+    void receiveMessage()
+    {
+        try
+        {
+            int ch;
+            do
+            {
+                // Clear the screen
+                cout << "\n\t\t-----------------------------\n";
+                cout << "\t\tSelect type of message to receive:\n";
+                cout << "\t\t-----------------------------\n";
+                cout << "\t\t1. Receive Text Message\n";
+                cout << "\t\t2. Receive Image Message\n";
+                cout << "\t\t3. Receive Voice Note Message\n";
+                cout << "\t\t4. Back\n";
+                cout << "\t\t-----------------------------\n";
+                cout << "Enter your choice: ";
+                cin >> ch;
+                cin.ignore(); // Clear newline character from buffer
+
+                switch (ch)
+                {
+                case 1:
+                    receiveTextMessage();
+                    break;
+                case 2:
+                    receiveImageMessage();
+                    break;
+                case 3:
+                    receiveVoiceNoteMessage();
+                    break;
+                case 4:
+                    break;
+                default:
+                    cout << "Invalid choice!\n";
+                }
+            } while (ch != 4);
+        }
+        catch (const exception &e)
+        {
+            cout << "An error occurred while receiving the message: " << e.what() << endl;
+        }
+    }
+
+    void receiveTextMessage()
+    {
+        try
+        {
+            cout << "Enter the received text message: ";
+            string input;
+            getline(cin, input);
+            ScopedTimer timer(Operation::ReceiveMessage);
+            submitMessage(MessageKind::Text, MessageDirection::Received, input); // Store the received text message
+        }
+        catch (const exception &e)
+        {
+            cout << "An error occurred while receiving the text message: " << e.what() << endl;
+        }
+    }
+
+    void receiveImageMessage()
+    {
+        try
+        {
+            cout << "Enter the filename of the received image (Add .jpg at end): ";
+            string input;
+            getline(cin, input);
+            ScopedTimer timer(Operation::ReceiveMessage);
+            submitMessage(MessageKind::Image, MessageDirection::Received, input); // Store the received image message
+        }
+        catch (const exception &e)
+        {
+            cout << "An error occurred while receiving the image message: " << e.what() << endl;
+        }
+    }
+
+    void receiveVoiceNoteMessage()
+    {
+        try
+        {
+            cout << "Enter the filename of the received voice note (Add .acc at end): ";
+            string input;
+            getline(cin, input);
+            ScopedTimer timer(Operation::ReceiveMessage);
+            submitMessage(MessageKind::VoiceNote, MessageDirection::Received, input); // Store the received voice note message
+        }
+        catch (const exception &e)
+        {
+            cout << "An error occurred while receiving the voice note message: " << e.what() << endl;
+        }
+    }
+#endif
+};
+
+// Group conversation whose messages fan out to every member's conversation
+// A message is stored once in a SharedBody; the group and each member hold a reference to
+// it instead of a copy. The group's own history is logged and indexed, member copies are not.
+class GroupConversation : public MultimediaConversation
+{
+private:
+    vector<Conversation *> members;
+    unordered_set<const Conversation *> memberSet;
+
+public:
+    GroupConversation(ChatServices *services = nullptr, string_view name = "") : MultimediaConversation(services, name) {}
+
+    // member must outlive the group; adding a member twice has no effect
+    void addMember(Conversation *member)
+    {
+        if (member == this || !memberSet.insert(member).second)
+        {
+            return;
+        }
+        members.push_back(member);
+        if (services != nullptr && services->log != nullptr)
+        {
+            services->log->appendGroup(getUsername(), member->getUsername(), currentTimeMillis());
+        }
+    }
+
+    const vector<Conversation *> &getMembers() const
+    {
+        return members;
+    }
+
+    // Points memberships of merged conversations at the conversations that absorbed them
+    void replaceMembers(const unordered_map<const Conversation *, Conversation *> &replaced)
+    {
+        size_t kept = 0;
+        for (auto member : members)
+        {
+            auto found = replaced.find(member);
+            if (found != replaced.end())
+            {
+                memberSet.erase(member);
+                member = found->second;
+                if (!memberSet.insert(member).second)
+                {
+                    continue; // Already a member in its own right
+                }
+            }
+            members[kept++] = member;
+        }
+        members.resize(kept);
+    }
+
+    size_t memoryUsage() const override
+    {
+        return MultimediaConversation::memoryUsage() + members.capacity() * sizeof(Conversation *) +
+               memberSet.size() * (sizeof(void *) * 2 + sizeof(size_t));
+    }
+
+    void addMessage(MessageKind kind, MessageDirection direction, const string &content) override
+    {
+        string reference = resolveAttachment(kind, content);
+        SharedBody *body = SharedBody::create(reference.empty() ? content : reference);
+        try
+        {
+            int64_t timestamp = currentTimeMillis();
+            messages.attachShared(kind, direction, timestamp, body);
+            uint64_t record = recordMessage(messages.size() - 1);
+            for (auto member : members)
+            {
+                member->deliverShared(kind, direction, timestamp, body, record);
+            }
+        }
+        catch (...)
+        {
+            body->release();
+            throw;
+        }
+        body->release();
+    }
+};
+
+// Registry of all conversations, one canonical conversation per user
+// Keeps insertion order for the CHATS listing and indexes conversations by interned UserId;
+// the index is sized by the largest UserId registered, since ids come from the StringPool.
+// add() still accepts a second conversation for a user (older callers and traces do that);
+// lookups then keep returning the first one until compact() merges them.
+class ConversationRegistry
+{
+private:
+    // A user and the index of their first conversation + 1, 0 meaning an empty slot
+    struct Slot
+    {
+        UserId user;
+        uint32_t index;
+    };
+
+    vector<Conversation *> conversations; // Insertion order
+    // Open-addressed table of this registry's users, at most half full. It grows with the users
+    // here, not with every name interned in the process.
+    vector<Slot> canonical;
+    size_t users = 0;
+    size_t duplicates = 0;
+
+    // Slot holding user, or the empty slot where it would go
+    size_t probe(UserId user) const
+    {
+        size_t mask = canonical.size() - 1;
+        size_t i = static_cast<size_t>((static_cast<uint64_t>(user) * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+        while (canonical[i].index != 0 && canonical[i].user != user)
+        {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow()
+    {
+        vector<Slot> old(canonical.empty() ? 16 : canonical.size() * 2, Slot{0, 0});
+        old.swap(canonical);
+        for (const Slot &slot : old)
+        {
+            if (slot.index != 0)
+            {
+                canonical[probe(slot.user)] = slot;
+            }
+        }
+    }
+
+    // Makes conversations[idx] the lookup target for its user unless the user has one already;
+    // returns whether it did
+    bool index(size_t idx)
+    {
+        if ((users + 1) * 2 > canonical.size())
+        {
+            grow();
+        }
+        UserId user = conversations[idx]->getUserId();
+        Slot &slot = canonical[probe(user)];
+        if (slot.index != 0)
+        {
+            return false;
+        }
+        slot = Slot{user, static_cast<uint32_t>(idx + 1)};
+        users++;
+        return true;
+    }
+
+    void reindex()
+    {
+        fill(canonical.begin(), canonical.end(), Slot{0, 0});
+        users = 0;
+        for (size_t idx = 0; idx < conversations.size(); idx++)
+        {
+            index(idx);
+        }
+    }
+
+public:
+    ConversationRegistry() {}
+    ConversationRegistry(const ConversationRegistry &) = delete;
+    ConversationRegistry &operator=(const ConversationRegistry &) = delete;
+
+    // Takes ownership of convo. If the user already has a conversation that one stays the lookup target.
+    void add(Conversation *convo)
+    {
+        conversations.push_back(convo);
+        if (!index(conversations.size() - 1))
+        {
+            duplicates++;
+        }
+    }
+
+    // The user's conversation, started as a multimedia conversation if there is none yet
+    Conversation *open(string_view username, ChatServices *services)
+    {
+        Conversation *convo = find(username);
+        if (convo == nullptr)
+        {
+            convo = new MultimediaConversation(services, username);
+            add(convo);
+        }
+        return convo;
+    }
+
+    // The group conversation called name, created if there is none; throws if the name
+    // belongs to a one-to-one conversation
+    GroupConversation *openGroup(string_view name, ChatServices *services)
+    {
+        Conversation *existing = find(name);
+        GroupConversation *group = dynamic_cast<GroupConversation *>(existing);
+        if (existing != nullptr && group == nullptr)
+        {
+            throw invalid_argument(string(name) + " is already a one-to-one conversation");
+        }
+        if (group == nullptr)
+        {
+            group = new GroupConversation(services, name);
+            add(group);
+            if (services != nullptr && services->log != nullptr)
+            {
+                services->log->appendGroup(name, "", currentTimeMillis());
+            }
+        }
+        return group;
+    }
+
+    Conversation *find(string_view username) const
+    {
+        UserId id;
+        return StringPool::instance().lookup(username, id) ? find(id) : nullptr;
+    }
+
+    Conversation *find(UserId id) const
+    {
+        if (canonical.empty())
+        {
+            return nullptr;
+        }
+        const Slot &slot = canonical[probe(id)];
+        return slot.index != 0 ? conversations[slot.index - 1] : nullptr;
+    }
+
+    // Conversations that share their user with an earlier one
+    size_t duplicateCount() const
+    {
+        return duplicates;
+    }
+
+    // Merges every duplicate conversation into its user's canonical one and deletes it.
+    // Each merged history is interleaved by timestamp, so sequence numbers in it are renumbered;
+    // search hits and group memberships move along. Group chats are never merged.
+    // Returns the number of conversations removed. Payload views taken before are invalidated.
+    size_t compact(SearchIndex *search)
+    {
+        if (duplicates == 0)
+        {
+            return 0;
+        }
+        map<size_t, vector<Conversation *>> merges; // Canonical index -> its duplicates, in order
+        for (size_t idx = 0; idx < conversations.size(); idx++)
+        {
+            size_t first = canonical[probe(conversations[idx]->getUserId())].index - 1;
+            if (first != idx && dynamic_cast<GroupConversation *>(conversations[idx]) == nullptr &&
+                dynamic_cast<GroupConversation *>(conversations[first]) == nullptr)
+            {
+                merges[first].push_back(conversations[idx]);
+            }
+        }
+
+        list<vector<vector<uint32_t>>> positions; // Kept alive until the search index is updated
+        unordered_map<const Conversation *, SearchIndex::Relocation> moves;
+        unordered_map<const Conversation *, Conversation *> replaced;
+        for (auto &merge : merges)
+        {
+            Conversation *target = conversations[merge.first];
+            positions.emplace_back();
+            target->absorb(merge.second, positions.back());
+            moves[target] = SearchIndex::Relocation{target, &positions.back()[0]};
+            for (size_t d = 0; d < merge.second.size(); d++)
+            {
+                moves[merge.second[d]] = SearchIndex::Relocation{target, &positions.back()[d + 1]};
+                replaced[merge.second[d]] = target;
+            }
+        }
+        if (search != nullptr)
+        {
+            search->relocate(moves);
+        }
+        for (auto convo : conversations)
+        {
+            GroupConversation *group = dynamic_cast<GroupConversation *>(convo);
+            if (group != nullptr)
+            {
+                group->replaceMembers(replaced);
+            }
+        }
+
+        size_t kept = 0;
+        for (auto convo : conversations)
+        {
+            if (replaced.count(convo) != 0)
+            {
+                delete convo;
+            }
+            else
+            {
+                conversations[kept++] = convo;
+            }
+        }
+        conversations.resize(kept);
+        duplicates -= replaced.size();
+        reindex();
+        return replaced.size();
+    }
+
+    bool empty() const
+    {
+        return conversations.empty();
+    }
+
+    size_t size() const
+    {
+        return conversations.size();
+    }
+
+    vector<Conversation *>::const_iterator begin() const
+    {
+        return conversations.begin();
+    }
+
+    vector<Conversation *>::const_iterator end() const
+    {
+        return conversations.end();
+    }
+
+    ~ConversationRegistry()
+    {
+        for (auto convo : conversations)
+        {
+            delete convo;
+        }
+    }
+};
+
+// Reads a little-endian u32 from a log record
+uint32_t readLogU32(const char *p)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(p);
+    return static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+           static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+}
+
+// Rebuilds conversations from a mapped message log, starting at offset from (e.g. where a snapshot ends)
+// Only record headers are parsed; payloads stay in the mapping and are referenced in place.
+// Returns the length of the valid prefix so a torn tail record can be dropped.
+size_t replayMessageLog(const MappedFile &file, ConversationRegistry &conversations, ChatServices *services, size_t from = 0)
+{
+    const char *data = file.getData();
+    size_t size = file.size();
+    if (size < MessageLog::MAGIC_SIZE || memcmp(data, MessageLog::MAGIC, MessageLog::MAGIC_SIZE) != 0)
+    {
+        if (size != 0)
+        {
+            throw runtime_error("Message log has an unknown format");
+        }
+        return 0;
+    }
+
+    size_t offset = from > MessageLog::MAGIC_SIZE ? from : MessageLog::MAGIC_SIZE;
+    Conversation *convo = nullptr;
+    while (size - offset >= MessageLog::RECORD_HEADER_SIZE)
+    {
+        const char *header = data + offset;
+        uint32_t usernameLength = readLogU32(header);
+        uint32_t payloadLength = readLogU32(header + 4);
+        uint8_t kind = static_cast<uint8_t>(header[8]);
+        uint8_t direction = static_cast<uint8_t>(header[9]);
+        int64_t timestamp = static_cast<int64_t>(readLogU32(header + 10) | static_cast<uint64_t>(readLogU32(header + 14)) << 32);
+        size_t recordSize = MessageLog::RECORD_HEADER_SIZE + static_cast<size_t>(usernameLength) + payloadLength;
+        if (recordSize > size - offset || direction > static_cast<uint8_t>(MessageDirection::Received))
+        {
+            break;
+        }
+        const char *name = header + MessageLog::RECORD_HEADER_SIZE;
+        if (kind == MessageLog::GROUP_RECORD)
+        {
+            // A name already taken by a one-to-one chat (logs from before groups were logged) stays one
+            string_view groupName(name, usernameLength);
+            Conversation *existing = conversations.find(groupName);
+            GroupConversation *group = existing == nullptr ? conversations.openGroup(groupName, services) : dynamic_cast<GroupConversation *>(existing);
+            if (group != nullptr && payloadLength != 0)
+            {
+                group->addMember(conversations.open(string_view(name + usernameLength, payloadLength), services));
+            }
+            convo = nullptr;
+            offset += recordSize;
+            continue;
+        }
+        if ((kind & MessageLog::DELIVERY_RECORD) != 0)
+        {
+            // The body is in the group's record, which always comes earlier in the log
+            kind &= static_cast<uint8_t>(~MessageLog::DELIVERY_RECORD);
+            uint64_t groupRecord = payloadLength == 8 ? readLogU32(name + usernameLength) |
+                                                            static_cast<uint64_t>(readLogU32(name + usernameLength + 4)) << 32
+                                                      : 0;
+            if (kind > static_cast<uint8_t>(MessageKind::VoiceNote) || groupRecord < MessageLog::MAGIC_SIZE ||
+                groupRecord + MessageLog::RECORD_HEADER_SIZE > offset)
+            {
+                break;
+            }
+            const char *source = data + groupRecord;
+            uint64_t sourceName = readLogU32(source);
+            uint64_t sourcePayload = readLogU32(source + 4);
+            if (groupRecord + MessageLog::RECORD_HEADER_SIZE + sourceName + sourcePayload > offset ||
+                static_cast<uint8_t>(source[8]) > static_cast<uint8_t>(MessageKind::VoiceNote))
+            {
+                break;
+            }
+            conversations.open(string_view(name, usernameLength), services)
+                ->attachDelivered(static_cast<MessageKind>(kind), static_cast<MessageDirection>(direction), timestamp,
+                                  source + MessageLog::RECORD_HEADER_SIZE + sourceName, static_cast<uint32_t>(sourcePayload));
+            convo = nullptr;
+            offset += recordSize;
+            continue;
+        }
+        if (kind == MessageLog::READ_RECORD)
+        {
+            if (payloadLength != 4)
+            {
+                break;
+            }
+            conversations.open(string_view(name, usernameLength), services)->replayUnread(readLogU32(name + usernameLength));
+            offset += recordSize;
+            continue;
+        }
+        if (kind > static_cast<uint8_t>(MessageKind::VoiceNote))
+        {
+            break;
+        }
+
+        // Consecutive records usually belong to the same conversation
+        if (convo == nullptr || convo->getUsername() != string_view(name, usernameLength))
+        {
+            convo = conversations.open(string_view(name, usernameLength), services);
+        }
+        convo->attachMessage(static_cast<MessageKind>(kind), static_cast<MessageDirection>(direction), timestamp,
+                             name + usernameLength, payloadLength);
+        offset += recordSize;
+    }
+    return offset;
+}
+
+// Writes all conversations, their messages and the search index to path as a snapshot holding
+// the first logOffset bytes of the message log. Spilled history is paged into this process.
+void writeSnapshot(const string &path, const ConversationRegistry &conversations, const Inbox *inbox, const SearchIndex *search, uint64_t logOffset)
+{
+    SnapshotWriter out(path);
+    unordered_map<const Conversation *, uint32_t> numbers;
+    for (const auto &convo : conversations)
+    {
+        uint32_t number = static_cast<uint32_t>(numbers.size());
+        numbers.emplace(convo, number);
+    }
+
+    out.begin(SnapshotSection::Names);
+    for (const auto &convo : conversations)
+    {
+        out.write(convo->getUsername().data(), convo->getUsername().size());
+    }
+    out.end();
+
+    // Kinds and lengths stay in the records of spilled segments, so these passes page nothing in
+    out.begin(SnapshotSection::Tags);
+    for (const auto &convo : conversations)
+    {
+        const MessageStore &store = convo->getMessages();
+        for (size_t s = 0; s < store.segmentCount(); s++)
+        {
+            for (const MessageRecord &record : store.segmentHeaders(s))
+            {
+                out.put(static_cast<uint8_t>(static_cast<uint8_t>(record.kind) | static_cast<uint8_t>(record.direction) << 2));
+            }
+        }
+    }
+    out.end();
+
+    vector<uint64_t> payloadBytes;
+    payloadBytes.reserve(conversations.size());
+    out.begin(SnapshotSection::Lengths);
+    for (const auto &convo : conversations)
+    {
+        const MessageStore &store = convo->getMessages();
+        uint64_t bytes = 0;
+        for (size_t s = 0; s < store.segmentCount(); s++)
+        {
+            for (const MessageRecord &record : store.segmentHeaders(s))
+            {
+                out.put(record.length);
+                bytes += record.length;
+            }
+        }
+        payloadBytes.push_back(bytes);
+    }
+    out.end();
+
+    out.begin(SnapshotSection::Timestamps);
+    for (const auto &convo : conversations)
+    {
+        const MessageStore &store = convo->getMessages();
+        for (size_t i = 0; i < store.size(); i++)
+        {
+            out.put(store.timestamp(i));
+        }
+    }
+    out.end();
+
+    out.begin(SnapshotSection::Payloads);
+    for (const auto &convo : conversations)
+    {
+        const MessageStore &store = convo->getMessages();
+        for (size_t s = 0; s < store.segmentCount(); s++)
+        {
+            for (const MessageRecord &record : store.segment(s))
+            {
+                out.write(record.payload, record.length);
+            }
+        }
+    }
+    out.end();
+
+    out.begin(SnapshotSection::Conversations);
+    uint64_t nameOffset = 0, firstMessage = 0, payloadOffset = 0;
+    uint32_t firstMember = 0;
+    size_t number = 0;
+    for (const auto &convo : conversations)
+    {
+        const GroupConversation *group = dynamic_cast<const GroupConversation *>(convo);
+        SnapshotConversation entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.nameOffset = nameOffset;
+        entry.nameLength = static_cast<uint32_t>(convo->getUsername().size());
+        entry.firstMessage = firstMessage;
+        entry.messageCount = convo->getMessages().size();
+        entry.payloadOffset = payloadOffset;
+        entry.payloadBytes = payloadBytes[number++];
+        entry.unread = convo->getSummary().unread;
+        entry.firstMember = firstMember;
+        entry.memberCount = group != nullptr ? static_cast<uint32_t>(group->getMembers().size()) : 0;
+        entry.flags = group != nullptr ? SnapshotConversation::GROUP : 0;
+        out.put(entry);
+        nameOffset += entry.nameLength;
+        firstMessage += entry.messageCount;
+        payloadOffset += entry.payloadBytes;
+        firstMember += entry.memberCount;
+    }
+    out.end();
+
+    out.begin(SnapshotSection::Members);
+    for (const auto &convo : conversations)
+    {
+        const GroupConversation *group = dynamic_cast<const GroupConversation *>(convo);
+        if (group != nullptr)
+        {
+            for (const Conversation *member : group->getMembers())
+            {
+                out.put(numbers.at(member));
+            }
+        }
+    }
+    out.end();
+
+    out.begin(SnapshotSection::InboxOrder);
+    if (inbox != nullptr)
+    {
+        for (const Conversation *convo : inbox->recent())
+        {
+            auto found = numbers.find(convo);
+            if (found != numbers.end())
+            {
+                out.put(found->second);
+            }
+        }
+    }
+    out.end();
+
+    if (search != nullptr)
+    {
+        search->save(out, numbers);
+    }
+    else
+    {
+        for (size_t section = static_cast<size_t>(SnapshotSection::Documents); section < SnapshotWriter::SECTION_COUNT; section++)
+        {
+            out.begin(static_cast<SnapshotSection>(section));
+            out.end();
+        }
+    }
+    out.finish(logOffset);
+}
+
+// Restores the conversations and search index saved in a snapshot. Message columns and postings
+// stay in the mapping, which must outlive the conversations, and each conversation's messages
+// are only attached when it is first used, so restoring costs about one step per conversation.
+// Returns false, restoring nothing, if there is no snapshot or the log no longer reaches the
+// point it was taken at; logOffset is where replaying the message log should continue.
+bool restoreSnapshot(const MappedFile &file, size_t logSize, ConversationRegistry &conversations, ChatServices *services, size_t &logOffset)
+{
+    SnapshotView snapshot;
+    if (!snapshot.open(file) || snapshot.getLogOffset() > logSize)
+    {
+        return false;
+    }
+    size_t nameBytes, tagCount, lengthCount, timestampCount, payloadSize, entryCount, memberCount, inboxCount;
+    const char *names = snapshot.section<char>(SnapshotSection::Names, nameBytes);
+    const uint8_t *tags = snapshot.section<uint8_t>(SnapshotSection::Tags, tagCount);
+    const uint32_t *lengths = snapshot.section<uint32_t>(SnapshotSection::Lengths, lengthCount);
+    const int64_t *timestamps = snapshot.section<int64_t>(SnapshotSection::Timestamps, timestampCount);
+    const char *payloads = snapshot.section<char>(SnapshotSection::Payloads, payloadSize);
+    const SnapshotConversation *entries = snapshot.section<SnapshotConversation>(SnapshotSection::Conversations, entryCount);
+    const uint32_t *members = snapshot.section<uint32_t>(SnapshotSection::Members, memberCount);
+    const uint32_t *inboxOrder = snapshot.section<uint32_t>(SnapshotSection::InboxOrder, inboxCount);
+    if (tagCount != lengthCount || tagCount != timestampCount)
+    {
+        throw runtime_error("Snapshot message columns are corrupt");
+    }
+    for (size_t i = 0; i < entryCount; i++)
+    {
+        const SnapshotConversation &entry = entries[i];
+        if (entry.nameOffset > nameBytes || entry.nameLength > nameBytes - entry.nameOffset ||
+            entry.firstMessage > tagCount || entry.messageCount > tagCount - entry.firstMessage ||
+            entry.payloadOffset > payloadSize || entry.payloadBytes > payloadSize - entry.payloadOffset ||
+            entry.firstMember > memberCount || entry.memberCount > memberCount - entry.firstMember)
+        {
+            throw runtime_error("Snapshot conversation table is corrupt");
+        }
+        if (entry.memberCount > 0 && (entry.flags & SnapshotConversation::GROUP) == 0)
+        {
+            throw runtime_error("Snapshot group members are corrupt");
+        }
+        for (uint32_t m = 0; m < entry.memberCount; m++)
+        {
+            if (members[entry.firstMember + m] >= entryCount)
+            {
+                throw runtime_error("Snapshot group members are corrupt");
+            }
+        }
+        // Messages are attached lazily, so check now what attaching them will rely on,
+        // as replayMessageLog does: valid kinds and directions, payloads that add up
+        uint64_t payloadBytes = 0;
+        for (size_t m = entry.firstMessage; m < entry.firstMessage + entry.messageCount; m++)
+        {
+            if ((tags[m] & 3) > static_cast<uint8_t>(MessageKind::VoiceNote) || (tags[m] >> 2) > static_cast<uint8_t>(MessageDirection::Received))
+            {
+                throw runtime_error("Snapshot message tags are corrupt");
+            }
+            payloadBytes += lengths[m];
+        }
+        if (payloadBytes != entry.payloadBytes)
+        {
+            throw runtime_error("Snapshot message lengths are corrupt");
+        }
+    }
+
+    // Nothing is registered until the whole snapshot has been read, so a corrupt one restores nothing
+    vector<unique_ptr<Conversation>> restored;
+    restored.reserve(entryCount);
+    for (size_t i = 0; i < entryCount; i++)
+    {
+        const SnapshotConversation &entry = entries[i];
+        string username(names + entry.nameOffset, entry.nameLength);
+        Conversation *convo;
+        if (entry.flags & SnapshotConversation::GROUP)
+        {
+            convo = new GroupConversation(services, username);
+        }
+        else
+        {
+            convo = new MultimediaConversation(services, username);
+        }
+        restored.emplace_back(convo);
+        size_t first = static_cast<size_t>(entry.firstMessage);
+        convo->restoreMessages(tags + first, lengths + first, timestamps + first, payloads + entry.payloadOffset,
+                               static_cast<size_t>(entry.messageCount), entry.payloadBytes, entry.unread);
+    }
+    for (size_t i = 0; i < entryCount; i++)
+    {
+        for (uint32_t m = 0; m < entries[i].memberCount; m++)
+        {
+            uint32_t member = members[entries[i].firstMember + m];
+            static_cast<GroupConversation *>(restored[i].get())->addMember(restored[member].get());
+        }
+    }
+    if (services != nullptr && services->search != nullptr)
+    {
+        vector<const Conversation *> ids;
+        ids.reserve(entryCount);
+        for (const auto &convo : restored)
+        {
+            ids.push_back(convo.get());
+        }
+        services->search->restore(snapshot, ids);
+    }
+    vector<Conversation *> registered;
+    registered.reserve(entryCount);
+    for (auto &convo : restored)
+    {
+        registered.push_back(convo.release());
+        conversations.add(registered.back());
+    }
+    // Touch the oldest first so the most recently active ends up on top
+    for (size_t i = inboxCount; i-- > 0;)
+    {
+        if (inboxOrder[i] < entryCount)
+        {
+            registered[inboxOrder[i]]->touchInbox();
+        }
+    }
+    logOffset = static_cast<size_t>(snapshot.getLogOffset());
+    return true;
+}
+
+// Takes point-in-time snapshots without stopping the platform. start() freezes the state by
+// forking: the child process writes the snapshot from its copy-on-write image of memory while
+// this process carries on, and a background thread waits for the child and records the outcome.
+// The file is written next to path and renamed over it once complete.
+class Snapshotter
+{
+private:
+    string path;
+    thread waiter;
+    atomic<bool> running{false};
+    atomic<bool> lastSucceeded{false};
+    atomic<uint64_t> completed{0};
+    atomic<int64_t> lastWriteMicros{0};
+
+    static int64_t microsSince(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+public:
+    explicit Snapshotter(const string &path) : path(path) {}
+
+    Snapshotter(const Snapshotter &) = delete;
+    Snapshotter &operator=(const Snapshotter &) = delete;
+
+    // Starts a snapshot and returns how long the caller was paused, in microseconds. Call it
+    // between operations, when no other thread is changing the conversations. Throws while the
+    // previous snapshot is still being written.
+    int64_t start(const ConversationRegistry &conversations, const Inbox *inbox, const SearchIndex *search, MessageLog *log)
+    {
+        if (running)
+        {
+            throw runtime_error("A snapshot is still being written");
+        }
+        if (waiter.joinable())
+        {
+            waiter.join();
+        }
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        uint64_t logOffset = 0;
+        if (log != nullptr)
+        {
+            log->flush();
+            logOffset = log->getDurableLength();
+        }
+        string temporary = path + ".tmp";
+#ifdef _WIN32
+        // No fork() here, so the snapshot is written before returning
+        writeSnapshot(temporary, conversations, inbox, search, logOffset);
+        remove(path.c_str());
+        if (rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            throw runtime_error("Cannot install snapshot " + path);
+        }
+        lastWriteMicros = microsSince(begin);
+        lastSucceeded = true;
+        completed++;
+        return lastWriteMicros;
+#else
+        pid_t child = fork();
+        if (child < 0)
+        {
+            throw runtime_error(string("Cannot start snapshot: ") + strerror(errno));
+        }
+        if (child == 0)
+        {
+            int status = 0;
+            try
+            {
+                writeSnapshot(temporary, conversations, inbox, search, logOffset);
+                if (rename(temporary.c_str(), path.c_str()) != 0)
+                {
+                    status = 1;
+                }
+            }
+            catch (...)
+            {
+                status = 1;
+            }
+            _exit(status); // Skip destructors and stdio buffers, which belong to the parent
+        }
+        int64_t pause = microsSince(begin);
+        running = true;
+        waiter = thread([this, child, begin]()
+        {
+            int status = 0;
+            while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+            {
+            }
+            lastSucceeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            lastWriteMicros = microsSince(begin);
+            completed++;
+            running = false;
+        });
+        return pause;
+#endif
+    }
+
+    bool isRunning() const
+    {
+        return running;
+    }
+
+    // Waits for the snapshot being written, if any; returns whether the last one succeeded
+    bool wait()
+    {
+        if (waiter.joinable())
+        {
+            waiter.join();
+        }
+        return lastSucceeded;
+    }
+
+    uint64_t getCompleted() const
+    {
+        return completed;
+    }
+
+    // Time from start() until the last snapshot was complete on disk
+    int64_t getLastWriteMicros() const
+    {
+        return lastWriteMicros;
+    }
+
+    ~Snapshotter()
+    {
+        wait();
+    }
+};
+
+// Bulk export and import of every conversation, in one of two formats.
+// NDJSON has one object per line: a group with its members, a message, or a user with no
+// message fields, which only opens their conversation:
+//   {"group":"team","members":["alice","bob"]}
+//   {"user":"alice","kind":"text","direction":"sent","type":"Sent Text","timestamp":1700000000000,"content":"hi"}
+// Binary is the magic "MPEXPRT1" followed by entries, either
+//   'G' <varint name length> <name> <varint member count> (<varint length> <member>)...
+// or 'C' and a version 2 WireFormat frame with up to one segment of a conversation's messages.
+// A conversation's entries are in order and a group's comes before its messages, but entries
+// of different conversations may interleave. Message content is exported as stored, so
+// attachments carry their store references.
+enum class TransferFormat : uint8_t
+{
+    Json,
+    Binary
+};
+
+struct TransferStats
+{
+    size_t conversations = 0;
+    size_t messages = 0;
+    uint64_t bytes = 0;
+};
+
+const char TRANSFER_MAGIC[] = "MPEXPRT1";
+const size_t TRANSFER_MAGIC_SIZE = 8;
+const size_t TRANSFER_CHUNK_BYTES = 4 << 20; // Unit of work handed between threads
+
+const char *const TRANSFER_KIND_NAMES[] = {"text", "image", "voice"};
+const char *const TRANSFER_DIRECTION_NAMES[] = {"sent", "received"};
+
+// Runs f(worker) for worker 0..threads-1 on that many threads and rethrows the first failure
+template <typename F>
+void runOnThreads(size_t threads, F f)
+{
+    if (threads <= 1)
+    {
+        f(0);
+        return;
+    }
+    vector<thread> workers;
+    vector<exception_ptr> errors(threads);
+    for (size_t w = 0; w < threads; w++)
+    {
+        workers.emplace_back([&, w]()
+        {
+            try
+            {
+                f(w);
+            }
+            catch (...)
+            {
+                errors[w] = current_exception();
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    for (auto &error : errors)
+    {
+        if (error)
+        {
+            rethrow_exception(error);
+        }
+    }
+}
+
+// Appends text as a JSON string. Bytes from 0x80 up are copied, so UTF-8 text passes through.
+void appendJsonString(string &out, string_view text)
+{
+    static const char HEX[] = "0123456789abcdef";
+    out.push_back('"');
+    size_t run = 0;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+        out.append(text.data() + run, i - run);
+        run = i + 1;
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            out += "\\u00";
+            out.push_back(HEX[c >> 4]);
+            out.push_back(HEX[c & 15]);
+        }
+    }
+    out.append(text.data() + run, text.size() - run);
+    out.push_back('"');
+}
+
+// Writes one conversation in the given format
+void exportConversation(string &out, const Conversation &convo, TransferFormat format, vector<MessageRecord> &copies, string &scratch,
+                        TransferStats &stats)
+{
+    const GroupConversation *group = dynamic_cast<const GroupConversation *>(&convo);
+    const MessageStore &store = convo.getMessages();
+    string_view name = convo.getUsername();
+    if (format == TransferFormat::Binary)
+    {
+        if (group != nullptr)
+        {
+            out.push_back('G');
+            WireFormat::putVarint(out, name.size());
+            out.append(name);
+            WireFormat::putVarint(out, group->getMembers().size());
+            for (const Conversation *member : group->getMembers())
+            {
+                WireFormat::putVarint(out, member->getUsername().size());
+                out.append(member->getUsername());
+            }
+        }
+        if (store.segmentCount() == 0)
+        {
+            out.push_back('C');
+            WireFormat::encodeFrame(out, name, nullptr, 0, nullptr);
+        }
+        for (size_t s = 0; s < store.segmentCount(); s++)
+        {
+            ColumnView<MessageRecord> records = store.peekSegment(s, copies, scratch);
+            out.push_back('C');
+            WireFormat::encodeFrame(out, name, records.data(), records.size(), store.segmentTimestamps(s).data());
+        }
+    }
+    else
+    {
+        if (group != nullptr)
+        {
+            out += "{\"group\":";
+            appendJsonString(out, name);
+            out += ",\"members\":[";
+            for (size_t i = 0; i < group->getMembers().size(); i++)
+            {
+                out += i == 0 ? "" : ",";
+                appendJsonString(out, group->getMembers()[i]->getUsername());
+            }
+            out += "]}\n";
+        }
+        else if (store.empty())
+        {
+            out += "{\"user\":";
+            appendJsonString(out, name);
+            out += "}\n";
+        }
+        for (size_t s = 0; s < store.segmentCount(); s++)
+        {
+            ColumnView<MessageRecord> records = store.peekSegment(s, copies, scratch);
+            ColumnView<int64_t> timestamps = store.segmentTimestamps(s);
+            for (size_t i = 0; i < records.size(); i++)
+            {
+                const MessageRecord &record = records[i];
+                string_view type = messageTypeName(record.direction, record.kind);
+                out += "{\"user\":";
+                appendJsonString(out, name);
+                out += ",\"kind\":\"";
+                out += TRANSFER_KIND_NAMES[static_cast<int>(record.kind)];
+                out += "\",\"direction\":\"";
+                out += TRANSFER_DIRECTION_NAMES[static_cast<int>(record.direction)];
+                out += "\",\"type\":\"";
+                out.append(type.substr(type.find_first_not_of('\t')));
+                out += "\",\"timestamp\":";
+                out += to_string(timestamps[i]);
+                out += ",\"content\":";
+                appendJsonString(out, string_view(record.payload, record.length));
+                out += "}\n";
+            }
+        }
+    }
+    stats.conversations++;
+    stats.messages += store.size();
+}
+
+// Writes every conversation to path. Conversations are encoded on `threads` workers into
+// chunks that go through a bounded queue to this thread, which writes them out, so memory
+// stays at a few chunks per worker however large the histories are. Spilled history is
+// decompressed into scratch space rather than paged back in.
+TransferStats exportConversations(const ConversationRegistry &conversations, TransferFormat format, const string &path, size_t threads)
+{
+    threads = threads == 0 ? 1 : threads;
+    vector<const Conversation *> list(conversations.begin(), conversations.end());
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        throw runtime_error("Cannot create " + path + ": " + strerror(errno));
+    }
+    TransferStats total;
+    mutex lock;
+    condition_variable changed;
+    deque<string> ready;
+    vector<string> spare;
+    size_t running = threads;
+    bool failed = false;
+    atomic<size_t> next{0};
+    const size_t maxReady = threads * 2;
+
+    // Hands a full chunk to the writer; returns false once the export has failed
+    auto handOver = [&](string &chunk)
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]() { return failed || ready.size() < maxReady; });
+        if (failed)
+        {
+            return false;
+        }
+        ready.push_back(move(chunk));
+        chunk.clear();
+        if (!spare.empty())
+        {
+            chunk = move(spare.back());
+            spare.pop_back();
+        }
+        changed.notify_all();
+        return true;
+    };
+
+    vector<thread> workers;
+    vector<TransferStats> counts(threads);
+    exception_ptr error;
+    for (size_t w = 0; w < threads; w++)
+    {
+        workers.emplace_back([&, w]()
+        {
+            string chunk, scratch;
+            vector<MessageRecord> copies;
+            chunk.reserve(TRANSFER_CHUNK_BYTES + TRANSFER_CHUNK_BYTES / 4);
+            try
+            {
+                for (size_t i = next++; i < list.size(); i = next++)
+                {
+                    exportConversation(chunk, *list[i], format, copies, scratch, counts[w]);
+                    if (chunk.size() >= TRANSFER_CHUNK_BYTES && !handOver(chunk))
+                    {
+                        break;
+                    }
+                }
+                if (!chunk.empty())
+                {
+                    handOver(chunk);
+                }
+            }
+            catch (...)
+            {
+                lock_guard<mutex> guard(lock);
+                if (!error)
+                {
+                    error = current_exception();
+                }
+                failed = true;
+            }
+            lock_guard<mutex> guard(lock);
+            running--;
+            changed.notify_all();
+        });
+    }
+
+    bool written = format == TransferFormat::Json || fwrite(TRANSFER_MAGIC, 1, TRANSFER_MAGIC_SIZE, file) == TRANSFER_MAGIC_SIZE;
+    total.bytes = format == TransferFormat::Json ? 0 : TRANSFER_MAGIC_SIZE;
+    for (;;)
+    {
+        string chunk;
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&]() { return !ready.empty() || running == 0; });
+            if (ready.empty())
+            {
+                break;
+            }
+            chunk = move(ready.front());
+            ready.pop_front();
+            changed.notify_all();
+        }
+        if (written && fwrite(chunk.data(), 1, chunk.size(), file) != chunk.size())
+        {
+            written = false;
+            lock_guard<mutex> guard(lock);
+            failed = true;
+            changed.notify_all();
+        }
+        total.bytes += chunk.size();
+        chunk.clear();
+        lock_guard<mutex> guard(lock);
+        spare.push_back(move(chunk));
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    written = fclose(file) == 0 && written;
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+    if (!written)
+    {
+        throw runtime_error("Cannot write " + path);
+    }
+    for (const TransferStats &count : counts)
+    {
+        total.conversations += count.conversations;
+        total.messages += count.messages;
+    }
+    return total;
+}
+
+// Text parsed from an import: a view into the mapped file, or into the chunk's decoded text
+// when it had escapes. Offsets, not pointers, since the decoded text grows while parsing.
+struct ImportText
+{
+    size_t offset = 0;
+    size_t length = 0;
+    bool decoded = false;
+};
+
+struct ImportItem
+{
+    ImportText user;
+    ImportText content;
+    int64_t timestamp = 0;
+    MessageKind kind = MessageKind::Text;
+    MessageDirection direction = MessageDirection::Sent;
+    bool hasMessage = false;
+    Conversation *convo = nullptr;
+};
+
+struct ImportGroup
+{
+    ImportText name;
+    vector<ImportText> members;
+    size_t before = 0; // Items of the chunk that come before it
+};
+
+// A stretch of whole lines or entries of the import file and what it parses into
+struct ImportChunk
+{
+    size_t begin = 0;
+    size_t end = 0;
+    vector<ImportItem> items;
+    vector<ImportGroup> groups;
+    string text;
+
+    string_view view(const char *file, const ImportText &t) const
+    {
+        return string_view((t.decoded ? text.data() : file) + t.offset, t.length);
+    }
+};
+
+// Parses the flat objects of an NDJSON export line by line
+class JsonLineParser
+{
+private:
+    const char *base; // Start of the file, for offsets
+    const char *pos;
+    const char *end;
+    ImportChunk &chunk;
+
+    [[noreturn]] void fail(const char *what) const
+    {
+        throw runtime_error(string("Import: ") + what + " at byte " + to_string(pos - base));
+    }
+
+    void skipSpace()
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r'))
+        {
+            pos++;
+        }
+    }
+
+    void expect(char c)
+    {
+        skipSpace();
+        if (pos >= end || *pos != c)
+        {
+            fail("malformed JSON");
+        }
+        pos++;
+    }
+
+    static void appendUtf8(string &out, uint32_t code)
+    {
+        if (code < 0x80)
+        {
+            out.push_back(static_cast<char>(code));
+        }
+        else if (code < 0x800)
+        {
+            out.push_back(static_cast<char>(0xC0 | code >> 6));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+        else if (code < 0x10000)
+        {
+            out.push_back(static_cast<char>(0xE0 | code >> 12));
+            out.push_back(static_cast<char>(0x80 | (code >> 6 & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+        else
+        {
+            out.push_back(static_cast<char>(0xF0 | code >> 18));
+            out.push_back(static_cast<char>(0x80 | (code >> 12 & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code >> 6 & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+    }
+
+    uint32_t hex4()
+    {
+        if (end - pos < 4)
+        {
+            fail("truncated \\u escape");
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = *pos++;
+            value <<= 4;
+            if (c >= '0' && c <= '9')
+            {
+                value |= static_cast<uint32_t>(c - '0');
+            }
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            {
+                value |= static_cast<uint32_t>((c | 0x20) - 'a' + 10);
+            }
+            else
+            {
+                fail("bad \\u escape");
+            }
+        }
+        return value;
+    }
+
+    ImportText string_()
+    {
+        expect('"');
+        const char *start = pos;
+        while (pos < end && *pos != '"' && *pos != '\\')
+        {
+            pos++;
+        }
+        if (pos < end && *pos == '"')
+        {
+            // No escapes: refer to the file
+            ImportText text{static_cast<size_t>(start - base), static_cast<size_t>(pos - start), false};
+            pos++;
+            return text;
+        }
+        ImportText text{chunk.text.size(), 0, true};
+        chunk.text.append(start, pos);
+        while (pos < end && *pos != '"')
+        {
+            if (*pos != '\\')
+            {
+                const char *run = pos;
+                while (pos < end && *pos != '"' && *pos != '\\')
+                {
+                    pos++;
+                }
+                chunk.text.append(run, pos);
+                continue;
+            }
+            if (++pos >= end)
+            {
+                break;
+            }
+            char c = *pos++;
+            switch (c)
+            {
+            case 'n':
+                chunk.text.push_back('\n');
+                break;
+            case 'r':
+                chunk.text.push_back('\r');
+                break;
+            case 't':
+                chunk.text.push_back('\t');
+                break;
+            case 'b':
+                chunk.text.push_back('\b');
+                break;
+            case 'f':
+                chunk.text.push_back('\f');
+                break;
+            case 'u':
+            {
+                uint32_t code = hex4();
+                if (code >= 0xD800 && code < 0xDC00 && end - pos >= 6 && pos[0] == '\\' && pos[1] == 'u')
+                {
+                    pos += 2;
+                    uint32_t low = hex4();
+                    code = low >= 0xDC00 && low < 0xE000 ? 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00) : 0xFFFD;
+                }
+                else if (code >= 0xD800 && code < 0xE000)
+                {
+                    code = 0xFFFD; // Unpaired surrogate
+                }
+                appendUtf8(chunk.text, code);
+                break;
+            }
+            default:
+                chunk.text.push_back(c); // \" \\ \/
+            }
+        }
+        if (pos >= end)
+        {
+            fail("unterminated string");
+        }
+        pos++;
+        text.length = chunk.text.size() - text.offset;
+        return text;
+    }
+
+    int64_t integer()
+    {
+        skipSpace();
+        bool negative = pos < end && *pos == '-';
+        pos += negative;
+        if (pos >= end || *pos < '0' || *pos > '9')
+        {
+            fail("expected a number");
+        }
+        uint64_t value = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9')
+        {
+            value = value * 10 + static_cast<uint64_t>(*pos++ - '0');
+        }
+        return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+    }
+
+    // Skips true, false, null, numbers and strings of fields that are not imported
+    void skipValue()
+    {
+        skipSpace();
+        if (pos < end && *pos == '"')
+        {
+            string_();
+            return;
+        }
+        if (pos < end && (*pos == '{' || *pos == '['))
+        {
+            fail("unexpected nested value");
+        }
+        while (pos < end && *pos != ',' && *pos != '}' && *pos != ' ')
+        {
+            pos++;
+        }
+    }
+
+    string_view peek(const ImportText &t) const
+    {
+        return chunk.view(base, t);
+    }
+
+public:
+    JsonLineParser(const char *base, ImportChunk &chunk) : base(base), pos(base + chunk.begin), end(base + chunk.end), chunk(chunk) {}
+
+    void parse()
+    {
+        while (pos < end)
+        {
+            const char *lineEnd = static_cast<const char *>(memchr(pos, '\n', static_cast<size_t>(end - pos)));
+            lineEnd = lineEnd == nullptr ? end : lineEnd;
+            const char *chunkEnd = end;
+            end = lineEnd;
+            skipSpace();
+            if (pos < end)
+            {
+                parseObject();
+                skipSpace();
+                if (pos != end)
+                {
+                    fail("trailing characters");
+                }
+            }
+            end = chunkEnd;
+            pos = lineEnd + (lineEnd < end);
+        }
+    }
+
+private:
+    void parseObject()
+    {
+        ImportItem item;
+        ImportGroup group;
+        bool isGroup = false, hasUser = false, hasKind = false, hasDirection = false;
+        expect('{');
+        skipSpace();
+        if (pos < end && *pos == '}')
+        {
+            fail("empty object");
+        }
+        do
+        {
+            ImportText key = string_();
+            expect(':');
+            string_view name = peek(key);
+            if (name == "user")
+            {
+                item.user = string_();
+                hasUser = true;
+            }
+            else if (name == "group")
+            {
+                group.name = string_();
+                isGroup = true;
+            }
+            else if (name == "content")
+            {
+                item.content = string_();
+            }
+            else if (name == "kind" || name == "direction")
+            {
+                string_view value = peek(string_());
+                if (name == "kind")
+                {
+                    hasKind = true;
+                    if (value == "text")
+                    {
+                        item.kind = MessageKind::Text;
+                    }
+                    else if (value == "image")
+                    {
+                        item.kind = MessageKind::Image;
+                    }
+                    else if (value == "voice")
+                    {
+                        item.kind = MessageKind::VoiceNote;
+                    }
+                    else
+                    {
+                        fail("unknown message kind");
+                    }
+                }
+                else
+                {
+                    hasDirection = true;
+                    if (value == "sent" || value == "received")
+                    {
+                        item.direction = value == "sent" ? MessageDirection::Sent : MessageDirection::Received;
+                    }
+                    else
+                    {
+                        fail("unknown message direction");
+                    }
+                }
+            }
+            else if (name == "timestamp")
+            {
+                item.timestamp = integer();
+            }
+            else if (name == "members")
+            {
+                expect('[');
+                skipSpace();
+                if (pos < end && *pos == ']')
+                {
+                    pos++;
+                }
+                else
+                {
+                    do
+                    {
+                        group.members.push_back(string_());
+                        skipSpace();
+                    } while (pos < end && *pos == ',' && ++pos);
+                    expect(']');
+                }
+            }
+            else
+            {
+                skipValue();
+            }
+            skipSpace();
+        } while (pos < end && *pos == ',' && ++pos);
+        expect('}');
+        if (isGroup)
+        {
+            group.before = chunk.items.size();
+            chunk.groups.push_back(move(group));
+        }
+        else if (hasUser)
+        {
+            if (hasKind != hasDirection)
+            {
+                fail("message needs both kind and direction");
+            }
+            item.hasMessage = hasKind;
+            chunk.items.push_back(item);
+        }
+        else
+        {
+            fail("object has neither user nor group");
+        }
+    }
+};
+
+// Parses the binary entries of a chunk
+void parseBinaryChunk(const char *base, ImportChunk &chunk)
+{
+    const char *pos = base + chunk.begin;
+    const char *end = base + chunk.end;
+    while (pos < end)
+    {
+        char type = *pos++;
+        if (type == 'C')
+        {
+            WireFormat::FrameView frame;
+            size_t size = frame.parse(pos, static_cast<size_t>(end - pos));
+            if (size == 0)
+            {
+                throw runtime_error("Import: truncated frame at byte " + to_string(pos - base));
+            }
+            ImportText user{static_cast<size_t>(frame.getPeer().data() - base), frame.getPeer().size(), false};
+            if (frame.size() == 0)
+            {
+                ImportItem item;
+                item.user = user;
+                chunk.items.push_back(item);
+            }
+            frame.forEachTimed([&](const MessageRecord &record, int64_t timestamp)
+            {
+                ImportItem item;
+                item.user = user;
+                item.content = ImportText{static_cast<size_t>(record.payload - base), record.length, false};
+                item.timestamp = timestamp;
+                item.kind = record.kind;
+                item.direction = record.direction;
+                item.hasMessage = true;
+                chunk.items.push_back(item);
+            });
+            pos += size;
+        }
+        else if (type == 'G')
+        {
+            auto text = [&]()
+            {
+                uint64_t length;
+                if (!WireFormat::getVarint(pos, end, length) || length > static_cast<uint64_t>(end - pos))
+                {
+                    throw runtime_error("Import: truncated group at byte " + to_string(pos - base));
+                }
+                ImportText t{static_cast<size_t>(pos - base), static_cast<size_t>(length), false};
+                pos += length;
+                return t;
+            };
+            ImportGroup group;
+            group.name = text();
+            uint64_t members;
+            if (!WireFormat::getVarint(pos, end, members) || members > static_cast<uint64_t>(end - pos))
+            {
+                throw runtime_error("Import: truncated group at byte " + to_string(pos - base));
+            }
+            for (uint64_t m = 0; m < members; m++)
+            {
+                group.members.push_back(text());
+            }
+            group.before = chunk.items.size();
+            chunk.groups.push_back(move(group));
+        }
+        else
+        {
+            throw runtime_error("Import: unknown entry at byte " + to_string(pos - 1 - base));
+        }
+    }
+}
+
+// Where the chunk starting at begin should end: after the first whole line or entry that
+// reaches TRANSFER_CHUNK_BYTES
+size_t nextChunkEnd(const char *data, size_t size, size_t begin, TransferFormat format)
+{
+    if (format == TransferFormat::Json)
+    {
+        size_t target = begin + TRANSFER_CHUNK_BYTES < size ? begin + TRANSFER_CHUNK_BYTES : size;
+        const char *newline = static_cast<const char *>(memchr(data + target, '\n', size - target));
+        return newline == nullptr ? size : static_cast<size_t>(newline - data) + 1;
+    }
+    size_t pos = begin;
+    while (pos < size && pos - begin < TRANSFER_CHUNK_BYTES)
+    {
+        const char *p = data + pos + 1;
+        const char *end = data + size;
+        if (data[pos] == 'C')
+        {
+            WireFormat::FrameView frame;
+            size_t frameSize = frame.parse(p, static_cast<size_t>(end - p));
+            if (frameSize == 0)
+            {
+                throw runtime_error("Import: truncated frame at byte " + to_string(pos + 1));
+            }
+            pos += 1 + frameSize;
+        }
+        else if (data[pos] == 'G')
+        {
+            // Skip the name and members; parseBinaryChunk checks them properly
+            uint64_t length, members;
+            if (!WireFormat::getVarint(p, end, length) || length > static_cast<uint64_t>(end - p))
+            {
+                throw runtime_error("Import: truncated group at byte " + to_string(pos + 1));
+            }
+            p += length;
+            if (!WireFormat::getVarint(p, end, members))
+            {
+                throw runtime_error("Import: truncated group at byte " + to_string(pos + 1));
+            }
+            for (uint64_t m = 0; m < members; m++)
+            {
+                if (!WireFormat::getVarint(p, end, length) || length > static_cast<uint64_t>(end - p))
+                {
+                    throw runtime_error("Import: truncated group at byte " + to_string(pos + 1));
+                }
+                p += length;
+            }
+            pos = static_cast<size_t>(p - data);
+        }
+        else
+        {
+            throw runtime_error("Import: unknown entry at byte " + to_string(pos));
+        }
+    }
+    return pos;
+}
+
+// Imports an export made by exportConversations, appending to existing conversations. The file
+// is mapped and cut into chunks of whole lines or entries. For each window of chunks, workers
+// first parse chunks in parallel; this thread then resolves users to conversations in file order
+// (creating them as needed), and the workers append the messages, each one taking the
+// conversations that hash to it, so a conversation's messages keep their order.
+TransferStats importConversations(const string &path, ConversationRegistry &conversations, ChatServices *services, size_t threads)
+{
+    threads = threads == 0 ? 1 : threads;
+    // MappedFile takes a missing file as empty, which would import nothing without complaint
+    FILE *probe = fopen(path.c_str(), "rb");
+    if (probe == nullptr)
+    {
+        throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+    fclose(probe);
+    MappedFile file(path);
+    const char *data = file.getData();
+    size_t size = file.size();
+    TransferFormat format = size >= TRANSFER_MAGIC_SIZE && memcmp(data, TRANSFER_MAGIC, TRANSFER_MAGIC_SIZE) == 0 ? TransferFormat::Binary
+                                                                                                            : TransferFormat::Json;
+    TransferStats total;
+    total.bytes = size;
+    unordered_set<Conversation *> touched;
+    size_t offset = format == TransferFormat::Binary ? TRANSFER_MAGIC_SIZE : 0;
+    const size_t window = threads * 2;
+    vector<ImportChunk> chunks;
+    while (offset < size)
+    {
+        chunks.clear();
+        while (chunks.size() < window && offset < size)
+        {
+            ImportChunk chunk;
+            chunk.begin = offset;
+            chunk.end = offset = nextChunkEnd(data, size, offset, format);
+            chunks.push_back(move(chunk));
+        }
+
+        atomic<size_t> next{0};
+        runOnThreads(threads, [&](size_t)
+        {
+            for (size_t c = next++; c < chunks.size(); c = next++)
+            {
+                if (format == TransferFormat::Json)
+                {
+                    JsonLineParser(data, chunks[c]).parse();
+                }
+                else
+                {
+                    parseBinaryChunk(data, chunks[c]);
+                }
+            }
+        });
+
+        for (ImportChunk &chunk : chunks)
+        {
+            Conversation *last = nullptr;
+            string_view lastUser;
+            size_t g = 0;
+            auto createGroups = [&](size_t before)
+            {
+                for (; g < chunk.groups.size() && chunk.groups[g].before <= before; g++)
+                {
+                    const ImportGroup &group = chunk.groups[g];
+                    GroupConversation *convo = conversations.openGroup(chunk.view(data, group.name), services);
+                    for (const ImportText &member : group.members)
+                    {
+                        convo->addMember(conversations.open(chunk.view(data, member), services));
+                    }
+                    touched.insert(convo);
+                    last = nullptr;
+                }
+            };
+            for (size_t i = 0; i < chunk.items.size(); i++)
+            {
+                createGroups(i);
+                ImportItem &item = chunk.items[i];
+                string_view user = chunk.view(data, item.user);
+                if (last == nullptr || user != lastUser)
+                {
+                    last = conversations.open(user, services);
+                    lastUser = user;
+                    touched.insert(last);
+                }
+                item.convo = last;
+            }
+            createGroups(chunk.items.size());
+        }
+
+        runOnThreads(threads, [&](size_t worker)
+        {
+            for (const ImportChunk &chunk : chunks)
+            {
+                for (const ImportItem &item : chunk.items)
+                {
+                    // Same mixing as the ingest engine: allocation addresses share their low bits
+                    uint64_t h = reinterpret_cast<uintptr_t>(item.convo);
+                    h ^= h >> 33;
+                    h *= 0xff51afd7ed558ccdULL;
+                    h ^= h >> 33;
+                    if (item.hasMessage && h % threads == worker)
+                    {
+                        item.convo->importMessage(item.kind, item.direction, item.timestamp, chunk.view(data, item.content));
+                    }
+                }
+            }
+        });
+        for (const ImportChunk &chunk : chunks)
+        {
+            for (const ImportItem &item : chunk.items)
+            {
+                total.messages += item.hasMessage;
+            }
+        }
+        // Keep imported history within the memory budget as it grows
+        if (services != nullptr && services->history != nullptr)
+        {
+            services->history->trim();
+        }
+    }
+    // Imported messages count as read; without this, replaying the log would count them as unread
+    for (Conversation *convo : touched)
+    {
+        convo->logUnread();
+    }
+    total.conversations = touched.size();
+    return total;
+}
+
+// Rewrites a version 1 message log, which has no timestamps, as version 2 with unknown (0)
+// timestamps. A torn tail record is dropped. Returns path, so it can run before the log is mapped.
+string upgradeMessageLog(const string &path)
+{
+    {
+        MappedFile legacy(path);
+        const char *data = legacy.getData();
+        size_t size = legacy.size();
+        if (size < MessageLog::MAGIC_SIZE || memcmp(data, MessageLog::LEGACY_MAGIC, MessageLog::MAGIC_SIZE) != 0)
+        {
+            return path;
+        }
+        string temporary = path + ".upgrade";
+        {
+            MessageLog upgraded(temporary, 0);
+            size_t offset = MessageLog::MAGIC_SIZE;
+            while (size - offset >= MessageLog::LEGACY_RECORD_HEADER_SIZE)
+            {
+                const char *header = data + offset;
+                uint32_t usernameLength = readLogU32(header);
+                uint32_t payloadLength = readLogU32(header + 4);
+                uint8_t kind = static_cast<uint8_t>(header[8]);
+                uint8_t direction = static_cast<uint8_t>(header[9]);
+                size_t recordSize = MessageLog::LEGACY_RECORD_HEADER_SIZE + static_cast<size_t>(usernameLength) + payloadLength;
+                if (recordSize > size - offset || kind > static_cast<uint8_t>(MessageKind::VoiceNote) ||
+                    direction > static_cast<uint8_t>(MessageDirection::Received))
+                {
+                    break;
+                }
+                const char *name = header + MessageLog::LEGACY_RECORD_HEADER_SIZE;
+                upgraded.append(string_view(name, usernameLength), static_cast<MessageKind>(kind), static_cast<MessageDirection>(direction),
+                                0, name + usernameLength, payloadLength);
+                offset += recordSize;
+            }
+        }
+        filesystem::rename(temporary, path);
+    }
+    return path;
+}
+
+// Bounded lock-free queue for many producer threads and a single consumer thread
+// Each cell carries a sequence number telling producers and the consumer whose turn it is
+template <typename T>
+class MpscQueue
+{
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    vector<Cell> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos{0};
+    alignas(64) size_t dequeuePos = 0;
+
+public:
+    // capacity must be a power of two
+    explicit MpscQueue(size_t capacity) : cells(capacity), mask(capacity - 1)
+    {
+        if (capacity < 2 || (capacity & mask) != 0)
+        {
+            throw invalid_argument("Queue capacity must be a power of two");
+        }
+        for (size_t i = 0; i < capacity; i++)
+        {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    // Returns false instead of blocking when the queue is full
+    bool push(T &&value)
+    {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Cell *cell;
+        for (;;)
+        {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+        cell->value = move(value);
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side only
+    bool pop(T &value)
+    {
+        Cell &cell = cells[dequeuePos & mask];
+        if (cell.sequence.load(memory_order_acquire) != dequeuePos + 1)
+        {
+            return false;
+        }
+        value = move(cell.value);
+        cell.sequence.store(dequeuePos + mask + 1, memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+};
+
+// One message waiting to be applied by an ingest worker
+struct IngestItem
+{
+    Conversation *convo = nullptr;
+    MessageKind kind = MessageKind::Text;
+    MessageDirection direction = MessageDirection::Sent;
+    string content;
+};
+
+// Concurrent message ingest on top of the Conversation model
+// Conversations are sharded across worker threads by identity, so every message for a
+// conversation is applied by the same worker and per-chat order follows submission order.
+// Each conversation may only have a bounded number of messages queued: a flooded chat makes
+// its own senders wait instead of filling the shard's queue for every other chat on it.
+// Group chats are refused: fanning out writes to member conversations that belong to other workers.
+class IngestEngine
+{
+private:
+    struct Shard
+    {
+        MpscQueue<IngestItem> queue;
+        thread worker;
+        size_t applied = 0;
+
+        explicit Shard(size_t capacity) : queue(capacity) {}
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    uint32_t conversationBacklog;
+    atomic<bool> stopping{false};
+
+    // Claims a queue slot for convo unless it already has its full backlog queued
+    bool reserve(Conversation *convo)
+    {
+        atomic<uint32_t> &queued = convo->getQueued();
+        uint32_t current = queued.load(memory_order_relaxed);
+        do
+        {
+            if (current >= conversationBacklog)
+            {
+                return false;
+            }
+        } while (!queued.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+        return true;
+    }
+
+    static IngestItem makeItem(Conversation *convo, MessageKind kind, MessageDirection direction, string &&content)
+    {
+        if (dynamic_cast<GroupConversation *>(convo) != nullptr)
+        {
+            throw invalid_argument("Group messages cannot be ingested concurrently, send them directly");
+        }
+        IngestItem item;
+        item.convo = convo;
+        item.kind = kind;
+        item.direction = direction;
+        item.content = move(content);
+        return item;
+    }
+
+    size_t shardFor(const Conversation *convo) const
+    {
+        // Mix the pointer bits, allocation addresses share their low bits
+        uint64_t h = reinterpret_cast<uintptr_t>(convo);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h % shards.size());
+    }
+
+    void run(Shard &shard)
+    {
+        IngestItem item;
+        unsigned idle = 0;
+        for (;;)
+        {
+            if (!shard.queue.pop(item))
+            {
+                if (!stopping.load(memory_order_acquire))
+                {
+                    if (++idle > 64)
+                    {
+                        this_thread::yield();
+                    }
+                    continue;
+                }
+                // Producers are done; drain whatever is still queued before exiting
+                if (!shard.queue.pop(item))
+                {
+                    return;
+                }
+            }
+            idle = 0;
+            try
+            {
+                item.convo->addMessage(item.kind, item.direction, item.content);
+                shard.applied++;
+            }
+            catch (const exception &e)
+            {
+                cerr << "An error occurred while ingesting a message: " << e.what() << endl;
+            }
+            item.convo->getQueued().fetch_sub(1, memory_order_release);
+        }
+    }
+
+public:
+    explicit IngestEngine(size_t threads, size_t queueCapacity = 1 << 16, uint32_t conversationBacklog = 1024)
+        : conversationBacklog(conversationBacklog)
+    {
+        if (threads == 0 || conversationBacklog == 0)
+        {
+            throw invalid_argument("Ingest engine needs at least one worker thread and a backlog");
+        }
+        for (size_t i = 0; i < threads; i++)
+        {
+            shards.push_back(unique_ptr<Shard>(new Shard(queueCapacity)));
+        }
+        for (auto &shard : shards)
+        {
+            Shard *s = shard.get();
+            s->worker = thread([this, s]() { run(*s); });
+        }
+    }
+
+    IngestEngine(const IngestEngine &) = delete;
+    IngestEngine &operator=(const IngestEngine &) = delete;
+
+    // Safe to call from any number of threads until stop(). Throws RateLimitExceeded if the
+    // rate limiter turns the message away and invalid_argument for a group; waits while the
+    // conversation's backlog or the shard's queue is full.
+    void submit(Conversation *convo, MessageKind kind, MessageDirection direction, string content)
+    {
+        IngestItem item = makeItem(convo, kind, direction, move(content));
+        convo->admitMessage();
+        while (!reserve(convo))
+        {
+            this_thread::yield();
+        }
+        Shard &shard = *shards[shardFor(convo)];
+        while (!shard.queue.push(move(item)))
+        {
+            this_thread::yield();
+        }
+    }
+
+    // Like submit() but never waits: returns false, leaving content untouched, when the
+    // conversation's backlog or the shard's queue is full. The rate limit is left to the caller.
+    bool trySubmit(Conversation *convo, MessageKind kind, MessageDirection direction, string &content)
+    {
+        IngestItem item = makeItem(convo, kind, direction, move(content));
+        if (!reserve(convo))
+        {
+            content = move(item.content);
+            return false;
+        }
+        if (!shards[shardFor(convo)]->queue.push(move(item)))
+        {
+            content = move(item.content);
+            convo->getQueued().fetch_sub(1, memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Applies everything already submitted and joins the workers
+    void stop()
+    {
+        stopping.store(true, memory_order_release);
+        for (auto &shard : shards)
+        {
+            if (shard->worker.joinable())
+            {
+                shard->worker.join();
+            }
+        }
+    }
+
+    size_t threadCount() const
+    {
+        return shards.size();
+    }
+
+    size_t appliedCount() const
+    {
+        size_t total = 0;
+        for (auto &shard : shards)
+        {
+            total += shard->applied;
+        }
+        return total;
+    }
+
+    ~IngestEngine()
+    {
+        stop();
+    }
+};
+
+// Writes a message's content; attachments show their filename and a short id
+OutputBuffer &renderPayload(OutputBuffer &out, const MessageRecord &record)
+{
+    string_view payload(record.payload, record.length);
+    string_view digest, filename;
+    if (record.kind != MessageKind::Text && parseAttachment(payload, digest, filename))
+    {
+        return out.reference(filename) << " [" << digest.substr(0, 12) << ']';
+    }
+    return out.reference(payload);
+}
+
+// Renders one page of a conversation's history
+// A negative offset counts back from the newest message; limit 0 means no limit.
+// Only the records inside the page are touched, so only their segments are paged in.
+void renderConversation(OutputBuffer &out, const Conversation &convo, long long offset = 0, size_t limit = 0)
+{
+    const MessageStore &messages = convo.getMessages();
+    size_t first;
+    if (offset < 0)
+    {
+        size_t back = static_cast<size_t>(-offset);
+        first = back > messages.size() ? 0 : messages.size() - back;
+    }
+    else
+    {
+        first = min(static_cast<size_t>(offset), messages.size());
+    }
+    size_t last = limit == 0 || limit > messages.size() - first ? messages.size() : first + limit;
+
+    out << "\n\t--------------------\n";
+    out << "\tConversation with " << convo.getUsername() << ":\n";
+    out << "\t----------------------\n";
+    for (size_t i = first; i < last; i++)
+    {
+        const MessageRecord &record = messages.record(i);
+        out << messageTypeName(record.direction, record.kind) << ": ";
+        renderPayload(out, record) << '\n';
+    }
+}
+
+// Renders messages [first, last) of a conversation with their sequence numbers and times,
+// the form clients use to catch up after reconnecting
+void renderMessageRange(OutputBuffer &out, const Conversation &convo, size_t first, size_t last)
+{
+    const MessageStore &messages = convo.getMessages();
+    out << "\n\t--------------------\n";
+    out << "\tMessages with " << convo.getUsername() << ": " << last - first << '\n';
+    out << "\t----------------------\n";
+    for (size_t i = first; i < last; i++)
+    {
+        const MessageRecord &record = messages.record(i);
+        int64_t timestamp = messages.timestamp(i);
+        out << "\t#" << static_cast<size_t>(MessageStore::sequenceOf(i)) << ' ' << (timestamp == 0 ? string("-") : formatTimestamp(timestamp));
+        string_view type = messageTypeName(record.direction, record.kind);
+        out << ' ' << type.substr(type.find_first_not_of('\t')) << ": ";
+        renderPayload(out, record) << '\n';
+    }
+}
+
+// Renders search hits, newest first, with the conversation each one belongs to
+void renderSearchResults(OutputBuffer &out, const vector<SearchIndex::Hit> &hits)
+{
+    out << "\n\t--------------------\n";
+    out << "\tSearch results: " << hits.size() << '\n';
+    out << "\t----------------------\n";
+    for (const auto &hit : hits)
+    {
+        Message message = hit.convo->getMessages()[hit.index];
+        out << hit.convo->getUsername() << " | " << message.getTypeName() << ": ";
+        renderPayload(out, message.getRecord()) << '\n';
+    }
+}
+
+// Writes the metrics snapshot followed by per-conversation memory use
+void renderStats(OutputBuffer &out, const ConversationRegistry &conversations, const HistoryTier *tier)
+{
+    Metrics::instance().snapshot(out);
+    size_t total = 0, largest = 0;
+    for (const auto &convo : conversations)
+    {
+        size_t bytes = convo->memoryUsage();
+        total += bytes;
+        largest = max(largest, bytes);
+    }
+    size_t count = conversations.size();
+    out << "conversations\t" << count << "\tduplicates\t" << conversations.duplicateCount() << "\tavg bytes\t" << (count == 0 ? 0 : total / count) << "\tmax bytes\t" << largest << '\n';
+    const StringPool &pool = StringPool::instance();
+    out << "interned strings\t" << pool.size() << "\tbytes\t" << pool.memoryUsage() << '\n';
+    if (tier != nullptr)
+    {
+        out << "history resident bytes\t" << tier->getResidentBytes() << "\tbudget\t" << tier->getBudget()
+            << "\tevictions\t" << static_cast<size_t>(tier->getEvictions()) << "\tloads\t" << static_cast<size_t>(tier->getLoads())
+            << "\tspilled bytes\t" << static_cast<size_t>(tier->getRawBytesSpilled())
+            << "\tcompressed\t" << static_cast<size_t>(tier->getCompressedBytesSpilled()) << '\n';
+    }
+}
+
+// Writes one CHATS line per conversation: name, unread count, a preview of the last message
+// and when it arrived. Reads only the summaries, never the histories.
+void renderInbox(OutputBuffer &out, const vector<Conversation *> &chats)
+{
+    for (const Conversation *convo : chats)
+    {
+        const ConversationSummary &summary = convo->getSummary();
+        out << "\t\t" << convo->getUsername();
+        if (summary.unread != 0)
+        {
+            out << " (" << static_cast<size_t>(summary.unread) << " unread)";
+        }
+        if (!convo->getMessages().empty())
+        {
+            string_view type = messageTypeName(summary.lastDirection, summary.lastKind);
+            out << " | " << type.substr(type.find_first_not_of('\t')) << ": " << summary.preview;
+            if (summary.lastActivity != 0)
+            {
+                out << " | " << formatTimestamp(summary.lastActivity);
+            }
+        }
+        out << '\n';
+    }
+}
+
+void displayConversations(ConversationRegistry &conversations, const Inbox &inbox)
+{
+    // Clear the screen
+    cout << "\t\t----------------\n";
+    cout << "\t\tCHATS:\n";
+    cout << "\t\t----------------\n";
+    {
+        cout.flush();
+        OutputBuffer out(fileno(stdout));
+        renderInbox(out, inbox.recent());
+        out.flush();
+    }
+
+    string user;
+    cout << "\nEnter the username whose conversation you want to see: ";
+    getline(cin, user);
+
+    // Look the user up in the CHATS
+    Conversation *convo = conversations.find(user);
+    if (convo == nullptr)
+    {
+        cout << "User " << user << " not found in the CHATS!\n";
+        return;
+    }
+
+    cout.flush();
+    OutputBuffer out(fileno(stdout));
+    ScopedTimer timer(Operation::ViewConversation);
+    renderConversation(out, *convo);
+    out.flush();
+    convo->markRead();
+}
+
+void sendMessageToUser(ConversationRegistry &conversations, const string &user)
+{
+    // Check if the user exists in the CHATS
+    Conversation *convo = conversations.find(user);
+    if (convo == nullptr)
+    {
+        cout << "User " << user << " not found in the CHATS!\n";
+        return;
+    }
+
+    int ch;
+    do
+    {
+        // Clear the screen
+        cout << "\n\t\t-----------------------------\n";
+        cout << "\t\tSelect type of message:\n";
+        cout << "\t\t-----------------------------\n";
+        cout << "\t\t1. Send Text Messages\n";
+        cout << "\t\t2. Send Image or GIF\n";
+        cout << "\t\t3. Send Voice Note\n";
+        cout << "\t\t4. Back\n";
+        cout << "\t\t-----------------------------\n";
+        cout << "Enter your choice: ";
+        cin >> ch;
+        cin.ignore(); // Clear newline character from buffer
+
+        try
+        {
+            switch (ch)
+            {
+            case 1:
+            {
+                cout << "Enter your message to " << user << ": ";
+                string message;
+                getline(cin, message);
+                convo->submitMessage(MessageKind::Text, MessageDirection::Sent, message); // Add the message to the user's conversation
+                cout << "Message sent to " << user << "!\n\n";
+                break;
+            }
+            case 2:
+            {
+                cout << "Enter the filename of the image (Add .jpg at end): ";
+                string message;
+                getline(cin, message);
+                convo->submitMessage(MessageKind::Image, MessageDirection::Sent, message); // Add the message to the user's conversation
+                cout << "Image sent to " << user << "!\n\n";
+                break;
+            }
+            case 3:
+            {
+                cout << "Enter the filename of the voice note (Add .acc at end): ";
+                string message;
+                getline(cin, message);
+                convo->submitMessage(MessageKind::VoiceNote, MessageDirection::Sent, message); // Add the message to the user's conversation
+                cout << "Voice Note sent to " << user << "!\n\n";
+                break;
+            }
+            case 4:
+                break;
+            default:
+                cout << "Invalid choice!\n";
+            }
+        }
+        catch (const exception &e)
+        {
+            cout << "An error occurred: " << e.what() << endl;
+        }
+    } while (ch != 4);
+}
+
+const char *const MESSAGE_LOG_PATH = "messages.log";
+const char *const ATTACHMENT_DIRECTORY = "attachments";
+const char *const HISTORY_SPILL_PATH = "history.spill";
+const char *const SNAPSHOT_PATH = "chat.snapshot";
+const char *const SERVER_FILE_DIRECTORY = "files"; // Default for files named by server clients
+const size_t DEFAULT_HISTORY_BUDGET = 64 << 20; // Bytes of sealed message payloads kept in memory
+const uint64_t DEFAULT_CHECKPOINT_BYTES = 64 << 20; // Log growth that triggers a snapshot, bounding the replay at startup
+
+// Everything a running platform needs: the restored conversations and the services they report to
+class ChatPlatform
+{
+public:
+    SearchIndex search;
+    AttachmentStore attachments;
+    HistoryTier tier; // Conversations unregister their segments from it, so it must outlive them
+    Inbox inbox;      // Likewise for their inbox entries
+    unique_ptr<RateLimiter> limiter; // Only with rate limits configured
+    ChatServices services;
+    MappedFile history;  // Backs the replayed messages, so it must outlive the conversations
+    unique_ptr<MappedFile> snapshot; // Likewise for restored messages and search postings
+    ConversationRegistry conversations;
+    unique_ptr<MessageLog> log;
+    Snapshotter snapshots; // Waits for a snapshot being written before anything else is torn down
+    uint64_t checkpointBytes = DEFAULT_CHECKPOINT_BYTES; // 0 turns automatic snapshots off
+    uint64_t checkpointedLength = 0; // Log bytes covered by the latest snapshot
+
+    explicit ChatPlatform(size_t historyBudget = DEFAULT_HISTORY_BUDGET, const RateLimits &limits = RateLimits())
+        : attachments(ATTACHMENT_DIRECTORY), tier(HISTORY_SPILL_PATH, historyBudget), history(upgradeMessageLog(MESSAGE_LOG_PATH)),
+          snapshots(SNAPSHOT_PATH)
+    {
+        if (limits.enabled())
+        {
+            limiter.reset(new RateLimiter(limits));
+        }
+        services.search = &search;
+        services.attachments = &attachments;
+        services.history = &tier;
+        services.inbox = &inbox;
+        services.limiter = limiter.get();
+        services.snapshots = &snapshots;
+        // Start from the latest snapshot if there is one and replay only the log written after it
+        size_t logOffset = 0;
+        try
+        {
+            snapshot.reset(new MappedFile(SNAPSHOT_PATH));
+            restoreSnapshot(*snapshot, history.size(), conversations, &services, logOffset);
+        }
+        catch (const exception &e)
+        {
+            // The log alone is complete, so a damaged or unreadable snapshot only costs a longer startup
+            cerr << "Ignoring " << SNAPSHOT_PATH << ": " << e.what() << endl;
+            logOffset = 0;
+        }
+        size_t validLength = replayMessageLog(history, conversations, &services, logOffset);
+        log.reset(new MessageLog(MESSAGE_LOG_PATH, validLength));
+        services.log = log.get();
+        checkpointedLength = logOffset;
+    }
+
+    // Starts a snapshot once the log has grown checkpointBytes past the latest one, so a restart
+    // loads the snapshot and replays at most that much of the log. Call it between operations.
+    void checkpoint()
+    {
+        if (checkpointBytes == 0 || snapshots.isRunning() || log->getDurableLength() - checkpointedLength < checkpointBytes)
+        {
+            return;
+        }
+        try
+        {
+            snapshots.start(conversations, &inbox, &search, log.get());
+        }
+        catch (const exception &e)
+        {
+            // The log still has everything; the next checkpoint is due after another checkpointBytes
+            cerr << "Cannot checkpoint: " << e.what() << endl;
+        }
+        checkpointedLength = log->getDurableLength();
+    }
+};
+
+#ifdef HAVE_COROUTINES
+// Coroutine that runs a piece of a chat session; it starts when it is first awaited or resumed
+// and resumes its awaiter when it finishes. Destroying a task destroys its frame, together with
+// any task it is suspended in, so a session can be abandoned at any point.
+class SessionTask
+{
+public:
+    struct promise_type
+    {
+        coroutine_handle<> continuation;
+        exception_ptr error;
+
+        SessionTask get_return_object()
+        {
+            return SessionTask(coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        // Hands control straight back to the awaiting coroutine, or to the loop for a top-level task
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> done) noexcept
+            {
+                coroutine_handle<> next = done.promise().continuation;
+                return next ? next : noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception()
+        {
+            error = current_exception();
+        }
+    };
+
+    SessionTask() {}
+    explicit SessionTask(coroutine_handle<promise_type> handle) : handle(handle) {}
+    SessionTask(SessionTask &&other) noexcept : handle(exchange(other.handle, nullptr)) {}
+
+    SessionTask &operator=(SessionTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle)
+            {
+                handle.destroy();
+            }
+            handle = exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~SessionTask()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    coroutine_handle<> getHandle() const
+    {
+        return handle;
+    }
+
+    bool done() const
+    {
+        return !handle || handle.done();
+    }
+
+    // Awaiting a task starts it; the awaiter continues once it completes, rethrowing what escaped it
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    void await_resume()
+    {
+        if (handle.promise().error)
+        {
+            rethrow_exception(handle.promise().error);
+        }
+    }
+
+private:
+    coroutine_handle<promise_type> handle;
+};
+
+// Single-threaded event loop that resumes the sessions whose input has arrived
+// Sessions only run inside run(), so they need no locking between them.
+class SessionLoop
+{
+private:
+    deque<coroutine_handle<>> ready;
+    string rendered;
+
+public:
+    OutputBuffer render; // Shared by all sessions for the renderers; flushed before a session suspends
+
+    SessionLoop() : render(rendered) {}
+
+    SessionLoop(const SessionLoop &) = delete;
+    SessionLoop &operator=(const SessionLoop &) = delete;
+
+    void schedule(coroutine_handle<> session)
+    {
+        ready.push_back(session);
+    }
+
+    // Resumes ready sessions until every one of them is waiting for input; returns how many ran
+    size_t run()
+    {
+        size_t resumed = 0;
+        while (!ready.empty())
+        {
+            coroutine_handle<> session = ready.front();
+            ready.pop_front();
+            session.resume();
+            resumed++;
+        }
+        return resumed;
+    }
+
+    // Moves everything rendered so far to the end of output
+    void takeRendered(string &output)
+    {
+        render.flush();
+        output += rendered;
+        rendered.clear();
+    }
+};
+
+// Chats listed by the session's View CHATS screen
+const size_t SESSION_INBOX_LIMIT = 20;
+
+// One user's menu-driven chat session: the flows of the interactive menu, written as coroutines
+// that suspend while waiting for the next line instead of blocking in cin, so any number of
+// sessions can be interleaved on one SessionLoop. Output collects in a string for the driver.
+// A session must stay at the same address once started.
+class ChatSession
+{
+private:
+    SessionLoop &loop;
+    ConversationRegistry &conversations;
+    ChatServices *services;
+    deque<string> input;
+    coroutine_handle<> waiting; // Suspended in readLine(), resumed through the loop by deliver()
+    string output;
+    SessionTask task;
+
+    // Suspends the session until a line of input is available, then yields it
+    struct LineAwaiter
+    {
+        ChatSession &session;
+
+        bool await_ready() const noexcept
+        {
+            return !session.input.empty();
+        }
+
+        void await_suspend(coroutine_handle<> suspended) noexcept
+        {
+            session.waiting = suspended;
+        }
+
+        string await_resume()
+        {
+            string line = move(session.input.front());
+            session.input.pop_front();
+            return line;
+        }
+    };
+
+    LineAwaiter readLine()
+    {
+        return LineAwaiter{*this};
+    }
+
+    void say(string_view text)
+    {
+        output += text;
+    }
+
+    // Menu choices are whole lines; anything that is not a number is an invalid choice
+    static int parseChoice(const string &line)
+    {
+        char *end = nullptr;
+        long choice = strtol(line.c_str(), &end, 10);
+        return end == line.c_str() ? 0 : static_cast<int>(choice);
+    }
+
+    // Reads one message body and adds it to the conversation
+    SessionTask addFromInput(Conversation &convo, MessageKind kind, MessageDirection direction, string_view prompt)
+    {
+        say(prompt);
+        string content = co_await readLine();
+        ScopedTimer timer(direction == MessageDirection::Sent ? Operation::SendMessage : Operation::ReceiveMessage);
+        convo.submitMessage(kind, direction, content);
+    }
+
+    SessionTask sendMessages(Conversation &convo)
+    {
+        int ch;
+        do
+        {
+            say("\n\t\t-----------------------------\n"
+                "\t\tSelect type of message:\n"
+                "\t\t-----------------------------\n"
+                "\t\t1. Send Text Messages\n"
+                "\t\t2. Send Image or GIF\n"
+                "\t\t3. Send Voice Note\n"
+                "\t\t4. Back\n"
+                "\t\t-----------------------------\n"
+                "Enter your choice: ");
+            ch = parseChoice(co_await readLine());
+
+            try
+            {
+                switch (ch)
+                {
+                case 1:
+                    co_await addFromInput(convo, MessageKind::Text, MessageDirection::Sent, "Enter your message to " + string(convo.getUsername()) + ": ");
+                    say("Message sent to " + string(convo.getUsername()) + "!\n\n");
+                    break;
+                case 2:
+                    co_await addFromInput(convo, MessageKind::Image, MessageDirection::Sent, "Enter the filename of the image (Add .jpg at end): ");
+                    say("Image sent to " + string(convo.getUsername()) + "!\n\n");
+                    break;
                 case 3:
-                    receiveVoiceNoteMessage();
+                    co_await addFromInput(convo, MessageKind::VoiceNote, MessageDirection::Sent, "Enter the filename of the voice note (Add .acc at end): ");
+                    say("Voice Note sent to " + string(convo.getUsername()) + "!\n\n");
+                    break;
+                case 4:
+                    break;
+                default:
+                    say("Invalid choice!\n");
+                }
+            }
+            catch (const exception &e)
+            {
+                say(string("An error occurred: ") + e.what() + "\n");
+            }
+        } while (ch != 4);
+    }
+
+    SessionTask receiveMessages(Conversation &convo)
+    {
+        int ch;
+        do
+        {
+            say("\n\t\t-----------------------------\n"
+                "\t\tSelect type of message to receive:\n"
+                "\t\t-----------------------------\n"
+                "\t\t1. Receive Text Message\n"
+                "\t\t2. Receive Image Message\n"
+                "\t\t3. Receive Voice Note Message\n"
+                "\t\t4. Back\n"
+                "\t\t-----------------------------\n"
+                "Enter your choice: ");
+            ch = parseChoice(co_await readLine());
+
+            try
+            {
+                switch (ch)
+                {
+                case 1:
+                    co_await addFromInput(convo, MessageKind::Text, MessageDirection::Received, "Enter the received text message: ");
+                    break;
+                case 2:
+                    co_await addFromInput(convo, MessageKind::Image, MessageDirection::Received, "Enter the filename of the received image (Add .jpg at end): ");
+                    break;
+                case 3:
+                    co_await addFromInput(convo, MessageKind::VoiceNote, MessageDirection::Received, "Enter the filename of the received voice note (Add .acc at end): ");
+                    break;
+                case 4:
+                    break;
+                default:
+                    say("Invalid choice!\n");
+                }
+            }
+            catch (const exception &e)
+            {
+                say(string("An error occurred while receiving the message: ") + e.what() + "\n");
+            }
+        } while (ch != 4);
+    }
+
+    // The user's conversation, started if this is the first one with them
+    Conversation *openConversation(const string &user)
+    {
+        ScopedTimer timer(Operation::StartConversation);
+        return conversations.open(user, services);
+    }
+
+    SessionTask viewConversation()
+    {
+        say("\t\t----------------\n"
+            "\t\tCHATS:\n"
+            "\t\t----------------\n");
+        if (services != nullptr && services->inbox != nullptr)
+        {
+            renderInbox(loop.render, services->inbox->recent(SESSION_INBOX_LIMIT));
+            loop.takeRendered(output);
+        }
+
+        say("\nEnter the username whose conversation you want to see: ");
+        string user = co_await readLine();
+        Conversation *convo = conversations.find(user);
+        if (convo == nullptr)
+        {
+            say("User " + user + " not found in the CHATS!\n");
+            co_return;
+        }
+
+        ScopedTimer timer(Operation::ViewConversation);
+        renderConversation(loop.render, *convo);
+        loop.takeRendered(output);
+        convo->markRead();
+    }
+
+    SessionTask menu()
+    {
+        if (conversations.empty())
+        {
+            say("Empty CHATS\n");
+        }
+
+        int choice;
+        do
+        {
+            say("\n\t\t-----------------------------\n"
+                "\t\tCHAT Operations:\n"
+                "\t\t-----------------------------\n"
+                "\t\t1. Start a new multimedia conversation\n"
+                "\t\t2. View CHATS\n"
+                "\t\t3. Send message to specific user\n"
+                "\t\t4. Receive message\n"
+                "\t\t5. Search messages\n"
+                "\t\t6. Exit\n"
+                "\t\t-----------------------------\n"
+                "Enter your choice: ");
+            choice = parseChoice(co_await readLine());
+
+            try
+            {
+                switch (choice)
+                {
+                case 1:
+                {
+                    say("Enter the username you want to send a message to: ");
+                    string user = co_await readLine();
+                    co_await sendMessages(*openConversation(user));
+                    break;
+                }
+                case 2:
+                    if (conversations.empty())
+                    {
+                        say("Empty CHATS\n");
+                    }
+                    else
+                    {
+                        co_await viewConversation();
+                    }
+                    break;
+                case 3:
+                {
+                    if (conversations.empty())
+                    {
+                        say("No conversations to send a message to.\n");
+                        break;
+                    }
+                    say("Enter the username you want to send a message to: ");
+                    string user = co_await readLine();
+                    Conversation *convo = conversations.find(user);
+                    if (convo == nullptr)
+                    {
+                        say("User " + user + " not found in the CHATS!\n");
+                        break;
+                    }
+                    co_await sendMessages(*convo);
                     break;
+                }
                 case 4:
+                {
+                    say("Enter the username from whom messages received: ");
+                    string user = co_await readLine();
+                    co_await receiveMessages(*openConversation(user));
+                    break;
+                }
+                case 5:
+                {
+                    if (services == nullptr || services->search == nullptr)
+                    {
+                        say("Search is not available\n");
+                        break;
+                    }
+                    say("Enter a word to search for (end it with * to match prefixes): ");
+                    string query = co_await readLine();
+                    ScopedTimer timer(Operation::Search);
+                    renderSearchResults(loop.render, services->search->search(query, 20));
+                    loop.takeRendered(output);
+                    break;
+                }
+                case 6:
+                    break;
+                default:
+                    say("Invalid choice! Try again...\n");
+                }
+            }
+            catch (const exception &e)
+            {
+                say(string("An error occurred: ") + e.what() + "\n");
+            }
+        } while (choice != 6);
+    }
+
+public:
+    ChatSession(SessionLoop &loop, ConversationRegistry &conversations, ChatServices *services)
+        : loop(loop), conversations(conversations), services(services) {}
+
+    ChatSession(const ChatSession &) = delete;
+    ChatSession &operator=(const ChatSession &) = delete;
+
+    // Shows the main menu once the loop runs
+    void start()
+    {
+        task = menu();
+        loop.schedule(task.getHandle());
+    }
+
+    // Queues a line of input, waking the session if it was waiting for one
+    void deliver(string line)
+    {
+        if (task.done())
+        {
+            return;
+        }
+        input.push_back(move(line));
+        if (waiting)
+        {
+            loop.schedule(exchange(waiting, nullptr));
+        }
+    }
+
+    // True once the user chose Exit
+    bool finished() const
+    {
+        return task.done();
+    }
+
+    // Text written since the driver last cleared it
+    string &getOutput()
+    {
+        return output;
+    }
+};
+
+// Runs the interactive menu as a single session fed from standard input
+void runInteractiveSession(ChatPlatform &platform)
+{
+    SessionLoop loop;
+    ChatSession session(loop, platform.conversations, &platform.services);
+    session.start();
+    string line;
+    while (true)
+    {
+        loop.run();
+        cout << session.getOutput();
+        cout.flush();
+        session.getOutput().clear();
+
+        // Group commit everything this step sent, then spill history over the budget
+        platform.log->flush();
+        platform.tier.trim();
+        platform.checkpoint();
+        if (session.finished() || !getline(cin, line))
+        {
+            break;
+        }
+        session.deliver(line);
+    }
+}
+#endif
+
+// Parses the message kind names used in batch commands
+bool parseMessageKind(const string &name, MessageKind &kind)
+{
+    if (name == "text")
+    {
+        kind = MessageKind::Text;
+    }
+    else if (name == "image")
+    {
+        kind = MessageKind::Image;
+    }
+    else if (name == "voice")
+    {
+        kind = MessageKind::VoiceNote;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// The file a command names, under the services' file directory if there is one
+string commandPath(const ChatServices *services, const string &name)
+{
+    filesystem::path path = resolveClientPath(services != nullptr ? services->fileDirectory : "", name);
+    if (path.empty())
+    {
+        throw invalid_argument("File names must be relative and stay inside the file directory: " + name);
+    }
+    return path.string();
+}
+
+// Executes one non-interactive chat operation against the conversations
+// Commands (fields separated by spaces, content is the rest of the line):
+//   start <user>
+//   group <name> <member>[,<member>...]   (creates the group or adds members; members are created if needed)
+//   send <user> <text|image|voice> <content>
+//   receive <user> <text|image|voice> <content>
+//   view <user> [offset] [limit]   (negative offset counts back from the newest message; marks it read)
+//   search <word or prefix*> [limit]
+//   fetch <user> <position> <output file>   (copies a message's stored attachment)
+//   attachments                             (attachment store statistics)
+//   stats                                   (operation metrics, memory per conversation, interned strings, rate limiter counts)
+//   compact                                 (merges duplicate conversations of the same user)
+//   snapshot                                (writes chat.snapshot in the background)
+//   export <json|binary> <file>             (writes every conversation to file)
+//   import <file>                           (adds the conversations of an export, in either format)
+//   inbox [limit]                           (conversations by recent activity with unread counts)
+//   since <user> <sequence> [limit]         (messages after a sequence number, for catching up)
+//   range <user> <from ms> <to ms>          (messages stored in [from, to), milliseconds since the epoch)
+//   list
+// Throws invalid_argument for malformed commands and unknown users.
+void executeCommand(const string &line, ConversationRegistry &conversations, ChatServices *services, OutputBuffer &out)
+{
+    // Split off the leading fields; whatever follows the last one is content
+    string fields[3];
+    size_t pos = 0;
+    size_t count = 0;
+    while (count < 3 && pos < line.size())
+    {
+        size_t start = line.find_first_not_of(' ', pos);
+        if (start == string::npos)
+        {
+            pos = line.size();
+            break;
+        }
+        size_t end = line.find(' ', start);
+        if (end == string::npos)
+        {
+            end = line.size();
+        }
+        fields[count++] = line.substr(start, end - start);
+        pos = end;
+    }
+    string content = pos < line.size() ? line.substr(pos + 1) : "";
+    const string &command = fields[0];
+    const string &user = fields[1];
+
+    if (command == "list")
+    {
+        for (const auto &convo : conversations)
+        {
+            out << convo->getUsername() << '\n';
+        }
+        return;
+    }
+    if (command == "inbox")
+    {
+        if (services == nullptr || services->inbox == nullptr)
+        {
+            throw invalid_argument("The inbox is not available");
+        }
+        renderInbox(out, services->inbox->recent(user.empty() ? 0 : stoull(user)));
+        return;
+    }
+    if (command == "stats")
+    {
+        renderStats(out, conversations, services != nullptr ? services->history : nullptr);
+        if (services != nullptr && services->limiter != nullptr)
+        {
+            const RateLimiter &limiter = *services->limiter;
+            out << "rate limiter admitted\t" << static_cast<size_t>(limiter.getAdmitted()) << "\tuser limited\t"
+                << static_cast<size_t>(limiter.getUserLimited()) << "\tglobal limited\t" << static_cast<size_t>(limiter.getGlobalLimited()) << '\n';
+        }
+        return;
+    }
+    if (command == "compact")
+    {
+        // Output still referencing payloads must go out before merged histories are freed
+        out.flush();
+        size_t merged = conversations.compact(services != nullptr ? services->search : nullptr);
+        out << "merged " << merged << " duplicate conversations\n";
+        return;
+    }
+    if (command == "snapshot")
+    {
+        if (services == nullptr || services->snapshots == nullptr)
+        {
+            throw invalid_argument("Snapshots are not available");
+        }
+        int64_t pause = services->snapshots->start(conversations, services->inbox, services->search, services->log);
+        out << "snapshot started, paused " << static_cast<size_t>(pause) << " us\n";
+        return;
+    }
+    if (command == "export" || command == "import")
+    {
+        const string &name = command == "export" ? fields[2] : user;
+        if (name.empty() || (command == "export" && user != "json" && user != "binary"))
+        {
+            throw invalid_argument("Usage: export <json|binary> <file> or import <file>");
+        }
+        string path = commandPath(services, name);
+        size_t threads = thread::hardware_concurrency() == 0 ? 1 : thread::hardware_concurrency();
+        TransferStats stats;
+        if (command == "export")
+        {
+            stats = exportConversations(conversations, user == "json" ? TransferFormat::Json : TransferFormat::Binary, path, threads);
+        }
+        else
+        {
+            // Importing may spill history that output still references
+            out.flush();
+            stats = importConversations(path, conversations, services, threads);
+        }
+        out << command << "ed " << stats.conversations << " conversations, " << stats.messages << " messages, " << static_cast<size_t>(stats.bytes)
+            << " bytes\n";
+        return;
+    }
+    if (command == "attachments")
+    {
+        if (services == nullptr || services->attachments == nullptr)
+        {
+            throw invalid_argument("Attachments are not available");
+        }
+        const AttachmentStore &store = *services->attachments;
+        out << "stored files: " << static_cast<size_t>(store.getStoredFiles())
+            << ", stored bytes: " << static_cast<size_t>(store.getStoredBytes())
+            << ", referenced files: " << static_cast<size_t>(store.getReferencedFiles())
+            << ", referenced bytes: " << static_cast<size_t>(store.getReferencedBytes()) << '\n';
+        return;
+    }
+    if (command == "search")
+    {
+        if (services == nullptr || services->search == nullptr)
+        {
+            throw invalid_argument("Search is not available");
+        }
+        size_t limit = fields[2].empty() ? 20 : stoull(fields[2]);
+        ScopedTimer timer(Operation::Search);
+        renderSearchResults(out, services->search->search(fields[1], limit));
+        return;
+    }
+    if (user.empty())
+    {
+        throw invalid_argument("Missing username");
+    }
+
+    if (command == "start")
+    {
+        ScopedTimer timer(Operation::StartConversation);
+        conversations.open(user, services);
+    }
+    else if (command == "group")
+    {
+        GroupConversation *group = conversations.openGroup(user, services);
+        string memberList = fields[2] + content;
+        size_t start = 0;
+        while (start <= memberList.size())
+        {
+            size_t end = memberList.find(',', start);
+            if (end == string::npos)
+            {
+                end = memberList.size();
+            }
+            string name = memberList.substr(start, end - start);
+            start = end + 1;
+            if (name.empty())
+            {
+                continue;
+            }
+            group->addMember(conversations.open(name, services));
+        }
+    }
+    else if (command == "send" || command == "receive")
+    {
+        MessageKind kind;
+        if (!parseMessageKind(fields[2], kind))
+        {
+            throw invalid_argument("Unknown message kind '" + fields[2] + "'");
+        }
+        ScopedTimer timer(command == "send" ? Operation::SendMessage : Operation::ReceiveMessage);
+        Conversation *convo = conversations.find(user);
+        if (convo == nullptr)
+        {
+            // Like the menu: receiving opens a conversation, sending needs one already
+            if (command == "send")
+            {
+                throw invalid_argument("User " + user + " not found in the CHATS");
+            }
+            convo = conversations.open(user, services);
+        }
+        convo->submitMessage(kind, command == "send" ? MessageDirection::Sent : MessageDirection::Received, content);
+    }
+    else if (command == "fetch")
+    {
+        const Conversation *convo = conversations.find(user);
+        if (convo == nullptr)
+        {
+            throw invalid_argument("User " + user + " not found in the CHATS");
+        }
+        size_t position = stoull(fields[2]);
+        if (position >= convo->getMessages().size() || services == nullptr || services->attachments == nullptr)
+        {
+            throw invalid_argument("No message at position " + fields[2]);
+        }
+        string_view digest, filename;
+        if (!parseAttachment(convo->getMessages()[position].getContentView(), digest, filename))
+        {
+            throw invalid_argument("Message " + fields[2] + " has no stored attachment");
+        }
+        out.flush();
+        FILE *target = fopen(commandPath(services, content).c_str(), "wb");
+        if (target == nullptr)
+        {
+            throw runtime_error("Cannot create " + content);
+        }
+        try
+        {
+            services->attachments->streamTo(digest, fileno(target));
+        }
+        catch (...)
+        {
+            fclose(target);
+            throw;
+        }
+        fclose(target);
+    }
+    else if (command == "since" || command == "range")
+    {
+        const Conversation *convo = conversations.find(user);
+        if (convo == nullptr)
+        {
+            throw invalid_argument("User " + user + " not found in the CHATS");
+        }
+        if (fields[2].empty())
+        {
+            throw invalid_argument("Missing " + string(command == "since" ? "sequence number" : "start time"));
+        }
+        const MessageStore &messages = convo->getMessages();
+        size_t first, last;
+        if (command == "since")
+        {
+            first = messages.afterSequence(stoull(fields[2]));
+            size_t limit = content.empty() ? 0 : stoull(content);
+            last = limit == 0 || limit > messages.size() - first ? messages.size() : first + limit;
+        }
+        else
+        {
+            first = messages.lowerBound(stoll(fields[2]));
+            last = content.empty() ? messages.size() : max(first, messages.lowerBound(stoll(content)));
+        }
+        renderMessageRange(out, *convo, first, last);
+    }
+    else if (command == "view")
+    {
+        Conversation *convo = conversations.find(user);
+        if (convo == nullptr)
+        {
+            throw invalid_argument("User " + user + " not found in the CHATS");
+        }
+        long long offset = fields[2].empty() ? 0 : stoll(fields[2]);
+        size_t limit = content.empty() ? 0 : stoull(content);
+        ScopedTimer timer(Operation::ViewConversation);
+        renderConversation(out, *convo, offset, limit);
+        convo->markRead();
+    }
+    else
+    {
+        throw invalid_argument("Unknown command '" + command + "'");
+    }
+}
+
+// Replays a command stream without prompts or screen clears and reports ops/sec on stderr
+int runBatch(istream &in, size_t historyBudget, const RateLimits &limits, const string &fileDirectory, uint64_t checkpointBytes)
+{
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    ChatPlatform platform(historyBudget, limits);
+    platform.services.fileDirectory = fileDirectory;
+    platform.checkpointBytes = checkpointBytes;
+
+    size_t operations = 0;
+    size_t failures = 0;
+    size_t lineNumber = 0;
+    string line;
+    OutputBuffer out(fileno(stdout));
+    auto start = chrono::steady_clock::now();
+    while (getline(in, line))
+    {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        try
+        {
+            executeCommand(line, platform.conversations, &platform.services, out);
+            operations++;
+        }
+        catch (const exception &e)
+        {
+            failures++;
+            cerr << "Error  :  line " << lineNumber << ": " << e.what() << '\n';
+        }
+        // Buffered output may still point into history, so it goes out before anything is spilled
+        if (platform.tier.overBudget())
+        {
+            out.flush();
+            platform.tier.trim();
+        }
+        platform.checkpoint();
+    }
+    platform.log->flush();
+    out.flush();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << operations << " operations (" << failures << " failed) in " << seconds << " s, "
+         << static_cast<uint64_t>(seconds > 0 ? operations / seconds : 0) << " ops/sec\n";
+    return failures == 0 ? 0 : 1;
+}
+
+#ifdef __linux__
+// Set by SIGINT/SIGTERM so the server reactors shut down cleanly and flush the log
+atomic<bool> serverStopRequested{false};
+
+extern "C" void requestServerStop(int)
+{
+    serverStopRequested.store(true);
+}
+
+// Fills a socket address for a loopback TCP port (all digits) or a Unix socket path
+socklen_t resolveAddress(const string &address, sockaddr_storage &storage)
+{
+    memset(&storage, 0, sizeof(storage));
+    if (!address.empty() && address.find_first_not_of("0123456789") == string::npos)
+    {
+        unsigned long port = address.size() > 5 ? 65536 : stoul(address);
+        if (port > 65535)
+        {
+            throw invalid_argument("Invalid port " + address);
+        }
+        sockaddr_in *in = reinterpret_cast<sockaddr_in *>(&storage);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(static_cast<uint16_t>(port));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return sizeof(sockaddr_in);
+    }
+    sockaddr_un *un = reinterpret_cast<sockaddr_un *>(&storage);
+    if (address.empty() || address.size() >= sizeof(un->sun_path))
+    {
+        throw invalid_argument("Invalid socket address '" + address + "'");
+    }
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, address.c_str(), address.size() + 1);
+    return sizeof(sockaddr_un);
+}
+
+// Removes a stale Unix socket left at path; anything else there, such as a mistyped file name, is left alone
+void removeStaleSocket(const string &path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path.c_str());
+    }
+}
+
+// Lets one process hold as many sockets as the hard limit allows
+void raiseDescriptorLimit()
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Chat server exposing the batch command protocol over loopback TCP or a Unix socket
+// Clients send one command per line; the server answers with the command's output
+// followed by "OK" or "ERR <reason>". Each reactor thread runs its own epoll loop;
+// commands are executed under one lock and the log is group-committed once per loop
+// iteration, before any of that iteration's replies are sent. A client that stops reading
+// its replies is stopped from sending: once MAX_PENDING_OUTPUT bytes are unsent, the server
+// runs no more of its commands and stops reading its socket until the replies drain.
+class ChatServer
+{
+private:
+    static const size_t MAX_INPUT_BYTES = 1 << 20;
+    static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+    static const int MAX_EVENTS = 1024;
+
+    struct Connection
+    {
+        int fd;
+        string input;
+        string output;
+        size_t outputOffset = 0;
+        bool wantWrite = false;
+        bool wantRead = true;
+        bool peerClosed = false;
+        bool broken = false;
+        bool queued = false;
+    };
+
+    ChatPlatform &platform;
+    string address;
+    int listener = -1;
+    size_t reactorCount;
+    mutex commandLock;
+
+    static bool outputFull(const Connection &conn)
+    {
+        return conn.output.size() - conn.outputOffset >= MAX_PENDING_OUTPUT;
+    }
+
+    // Runs the complete lines buffered on the connection until its unsent output is full;
+    // returns whether any command ran
+    bool handleInput(Connection &conn)
+    {
+        bool ran = false;
+        size_t start = 0;
+        size_t end;
+        while (!outputFull(conn) && (end = conn.input.find('\n', start)) != string::npos)
+        {
+            string line = conn.input.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#')
+            {
+                continue;
+            }
+            OutputBuffer out(conn.output);
+            lock_guard<mutex> guard(commandLock);
+            try
+            {
+                executeCommand(line, platform.conversations, &platform.services, out);
+                out.flush();
+                conn.output += "OK\n";
+            }
+            catch (const exception &e)
+            {
+                out.flush();
+                conn.output += "ERR ";
+                conn.output += e.what();
+                conn.output += '\n';
+            }
+            platform.tier.trim();
+            platform.checkpoint();
+            ran = true;
+        }
+        conn.input.erase(0, start);
+        if (conn.input.size() > MAX_INPUT_BYTES)
+        {
+            conn.broken = true;
+        }
+        return ran;
+    }
+
+    void readInput(Connection &conn)
+    {
+        char chunk[16 * 1024];
+        for (;;)
+        {
+            ssize_t n = recv(conn.fd, chunk, sizeof(chunk), 0);
+            if (n > 0)
+            {
+                conn.input.append(chunk, static_cast<size_t>(n));
+                continue;
+            }
+            if (n == 0)
+            {
+                conn.peerClosed = true;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn.broken = true;
+            }
+            return;
+        }
+    }
+
+    void writeOutput(Connection &conn)
+    {
+        while (conn.outputOffset < conn.output.size())
+        {
+            ssize_t n = send(conn.fd, conn.output.data() + conn.outputOffset, conn.output.size() - conn.outputOffset, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                conn.outputOffset += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                // Drop what was sent, so a slow reader's buffer stays within its limit
+                if (conn.outputOffset >= MAX_PENDING_OUTPUT)
+                {
+                    conn.output.erase(0, conn.outputOffset);
+                    conn.outputOffset = 0;
+                }
+                return;
+            }
+            conn.broken = true;
+            return;
+        }
+        conn.output.clear();
+        conn.outputOffset = 0;
+    }
+
+    void runReactor()
+    {
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0)
+        {
+            throw runtime_error(string("Cannot create epoll instance: ") + strerror(errno));
+        }
+        epoll_event listenEvent{};
+        // With several reactors only one of them is woken per incoming connection
+        listenEvent.events = EPOLLIN | (reactorCount > 1 ? static_cast<uint32_t>(EPOLLEXCLUSIVE) : 0u);
+        listenEvent.data.ptr = nullptr;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &listenEvent);
+
+        unordered_map<int, unique_ptr<Connection>> connections;
+        vector<epoll_event> events(MAX_EVENTS);
+        vector<Connection *> touched;
+        while (!serverStopRequested.load())
+        {
+            int n = epoll_wait(epfd, events.data(), MAX_EVENTS, 100);
+            if (n < 0 && errno != EINTR)
+            {
+                close(epfd);
+                throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+            }
+            bool ranCommands = false;
+            for (int i = 0; i < n; i++)
+            {
+                Connection *conn = static_cast<Connection *>(events[i].data.ptr);
+                if (conn == nullptr)
+                {
+                    int fd;
+                    while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                    {
+                        unique_ptr<Connection> accepted(new Connection());
+                        accepted->fd = fd;
+                        epoll_event event{};
+                        event.events = EPOLLIN | EPOLLRDHUP;
+                        event.data.ptr = accepted.get();
+                        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+                        connections.emplace(fd, move(accepted));
+                    }
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                {
+                    readInput(*conn);
+                    ranCommands |= handleInput(*conn);
+                }
+                else if (events[i].events & EPOLLOUT)
+                {
+                    // Make room, then run any commands left waiting by backpressure
+                    writeOutput(*conn);
+                    ranCommands |= handleInput(*conn);
+                }
+                if (!conn->queued)
+                {
+                    conn->queued = true;
+                    touched.push_back(conn);
+                }
+            }
+
+            // Group commit: one fsync covers every message of this iteration before it is acknowledged
+            if (ranCommands)
+            {
+                lock_guard<mutex> guard(commandLock);
+                platform.log->flush();
+            }
+
+            for (Connection *conn : touched)
+            {
+                conn->queued = false;
+                if (!conn->broken)
+                {
+                    writeOutput(*conn);
+                }
+                bool pending = !conn->output.empty();
+                bool backlog = conn->input.find('\n') != string::npos; // Held back while the output was full
+                if (conn->broken || (conn->peerClosed && !pending && !backlog))
+                {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+                    close(conn->fd);
+                    connections.erase(conn->fd);
+                    continue;
+                }
+                bool readable = !outputFull(*conn);
+                pending |= backlog; // Writable wakes us up to run them
+                if (pending != conn->wantWrite || readable != conn->wantRead)
+                {
+                    conn->wantWrite = pending;
+                    conn->wantRead = readable;
+                    epoll_event event{};
+                    event.events = EPOLLRDHUP | (readable ? static_cast<uint32_t>(EPOLLIN) : 0u) |
+                                   (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+                    event.data.ptr = conn;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event);
+                }
+            }
+            touched.clear();
+        }
+
+        for (auto &entry : connections)
+        {
+            close(entry.first);
+        }
+        close(epfd);
+    }
+
+public:
+    ChatServer(ChatPlatform &platform, const string &address, size_t reactors)
+        : platform(platform), address(address), reactorCount(max<size_t>(reactors, 1))
+    {
+        sockaddr_storage storage;
+        socklen_t length = resolveAddress(address, storage);
+        listener = socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (storage.ss_family == AF_UNIX)
+        {
+            removeStaleSocket(address);
+        }
+        else
+        {
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr *>(&storage), length) != 0 || listen(listener, SOMAXCONN) != 0)
+        {
+            int error = errno;
+            if (listener >= 0)
+            {
+                close(listener);
+            }
+            throw runtime_error("Cannot listen on " + address + ": " + strerror(error));
+        }
+    }
+
+    ChatServer(const ChatServer &) = delete;
+    ChatServer &operator=(const ChatServer &) = delete;
+
+    // Serves until SIGINT or SIGTERM
+    void run()
+    {
+        signal(SIGINT, requestServerStop);
+        signal(SIGTERM, requestServerStop);
+        raiseDescriptorLimit();
+
+        vector<thread> reactors;
+        for (size_t i = 1; i < reactorCount; i++)
+        {
+            reactors.emplace_back([this]()
+            {
+                try
+                {
+                    runReactor();
+                }
+                catch (const exception &e)
+                {
+                    cerr << "An error occurred in a reactor: " << e.what() << endl;
+                    serverStopRequested.store(true);
+                }
+            });
+        }
+        try
+        {
+            runReactor();
+        }
+        catch (...)
+        {
+            serverStopRequested.store(true);
+            for (auto &reactor : reactors)
+            {
+                reactor.join();
+            }
+            throw;
+        }
+        for (auto &reactor : reactors)
+        {
+            reactor.join();
+        }
+    }
+
+    ~ChatServer()
+    {
+        close(listener);
+        if (address.find_first_not_of("0123456789") != string::npos)
+        {
+            removeStaleSocket(address);
+        }
+    }
+};
+
+// Local load-test client for the chat server
+// Opens `connections` connections, sends `requests` receive commands on each (one in flight
+// per connection) and reports throughput and p50/p99 delivery latency
+int runLoadClient(const string &address, size_t connections, size_t requests)
+{
+    struct Client
+    {
+        int fd = -1;
+        size_t id = 0;
+        size_t sent = 0;
+        bool connected = false;
+        string input;
+        chrono::steady_clock::time_point sentAt;
+    };
+
+    raiseDescriptorLimit();
+    sockaddr_storage storage;
+    socklen_t length = resolveAddress(address, storage);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    vector<Client> clients(connections);
+    vector<uint32_t> latencies; // Microseconds
+    latencies.reserve(connections * requests);
+    size_t failedConnections = 0;
+    size_t errors = 0;
+    size_t finished = 0;
+
+    auto sendRequest = [&](Client &client)
+    {
+        string request = "receive load" + to_string(client.id % 1000) + " text ping " + to_string(client.sent) + "\n";
+        client.sentAt = chrono::steady_clock::now();
+        client.sent++;
+        // Requests are tiny, so a fresh connection's socket buffer always has room
+        if (send(client.fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+        {
+            return false;
+        }
+        return true;
+    };
+    auto finish = [&](Client &client)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client.fd, nullptr);
+        close(client.fd);
+        client.fd = -1;
+        finished++;
+    };
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < connections; i++)
+    {
+        Client &client = clients[i];
+        client.id = i;
+        client.fd = socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int result = client.fd < 0 ? -1 : connect(client.fd, reinterpret_cast<sockaddr *>(&storage), length);
+        // A full Unix socket backlog reports EAGAIN; give the server a moment and retry
+        for (int attempt = 0; result != 0 && errno == EAGAIN && attempt < 1000; attempt++)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+            result = connect(client.fd, reinterpret_cast<sockaddr *>(&storage), length);
+        }
+        if (result != 0 && errno != EINPROGRESS)
+        {
+            if (client.fd >= 0)
+            {
+                close(client.fd);
+                client.fd = -1;
+            }
+            failedConnections++;
+            finished++;
+            continue;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.ptr = &client;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, client.fd, &event);
+    }
+
+    vector<epoll_event> events(1024);
+    auto lastProgress = chrono::steady_clock::now();
+    while (finished < connections && chrono::steady_clock::now() - lastProgress < chrono::seconds(30))
+    {
+        int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), 100);
+        for (int i = 0; i < n; i++)
+        {
+            Client &client = *static_cast<Client *>(events[i].data.ptr);
+            if (client.fd < 0)
+            {
+                continue;
+            }
+            if (!client.connected && (events[i].events & EPOLLOUT))
+            {
+                client.connected = true;
+                epoll_event event{};
+                event.events = EPOLLIN;
+                event.data.ptr = &client;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, client.fd, &event);
+                if (requests == 0 || !sendRequest(client))
+                {
+                    errors += requests == 0 ? 0 : 1;
+                    finish(client);
+                }
+                continue;
+            }
+            char chunk[4096];
+            ssize_t received = recv(client.fd, chunk, sizeof(chunk), 0);
+            if (received <= 0)
+            {
+                if (received < 0 && (errno == EAGAIN || errno == EINTR))
+                {
+                    continue;
+                }
+                errors++;
+                finish(client);
+                continue;
+            }
+            client.input.append(chunk, static_cast<size_t>(received));
+            size_t end;
+            while (client.fd >= 0 && (end = client.input.find('\n')) != string::npos)
+            {
+                bool ok = client.input.compare(0, 2, "OK") == 0;
+                bool failed = client.input.compare(0, 3, "ERR") == 0;
+                client.input.erase(0, end + 1);
+                if (!ok && !failed)
+                {
+                    continue;
+                }
+                errors += failed ? 1 : 0;
+                latencies.push_back(static_cast<uint32_t>(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - client.sentAt).count()));
+                lastProgress = chrono::steady_clock::now();
+                if (client.sent == requests || !sendRequest(client))
+                {
+                    finish(client);
+                }
+            }
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (auto &client : clients)
+    {
+        if (client.fd >= 0)
+        {
+            close(client.fd);
+        }
+    }
+    close(epfd);
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p)
+    {
+        return latencies.empty() ? 0u : latencies[min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    cout << "connections: " << connections - failedConnections << " open, " << failedConnections << " failed\n";
+    cout << "requests: " << latencies.size() << " completed, " << errors << " errors in " << seconds << " s ("
+         << static_cast<uint64_t>(latencies.size() / seconds) << " req/sec)\n";
+    cout << "latency us: p50 " << percentile(0.50) << ", p99 " << percentile(0.99)
+         << ", max " << (latencies.empty() ? 0u : latencies.back()) << "\n";
+    return failedConnections == 0 && errors == 0 ? 0 : 1;
+}
+#endif
+
+// Load generator for the ingest engine
+// Drives `messages` messages from one producer per worker into `contacts` conversations
+// for 1, 2, 4, ... worker threads up to the core count and prints the throughput of each run
+int runIngestLoad(size_t messages, size_t contacts)
+{
+    size_t maxThreads = thread::hardware_concurrency() == 0 ? 1 : thread::hardware_concurrency();
+    const MessageKind kinds[] = {MessageKind::Text, MessageKind::Text, MessageKind::Image, MessageKind::VoiceNote};
+
+    cout << "Ingest load: " << messages << " messages across " << contacts << " conversations\n";
+    cout << "threads\tmessages/sec\tspeedup\n";
+    double baseline = 0;
+    for (size_t threads = 1;; threads = min(threads * 2, maxThreads))
+    {
+        ConversationRegistry conversations;
+        vector<Conversation *> targets;
+        for (size_t i = 0; i < contacts; i++)
+        {
+            Conversation *convo = new MultimediaConversation(nullptr, "user" + to_string(i));
+            conversations.add(convo);
+            targets.push_back(convo);
+        }
+
+        auto start = chrono::steady_clock::now();
+        {
+            IngestEngine engine(threads);
+            vector<thread> producers;
+            for (size_t p = 0; p < threads; p++)
+            {
+                producers.emplace_back([&, p]()
+                {
+                    uint64_t state = 0x9E3779B97F4A7C15ULL * (p + 1);
+                    size_t share = messages / threads + (p < messages % threads ? 1 : 0);
+                    for (size_t i = 0; i < share; i++)
+                    {
+                        // xorshift picks the conversation, kind and direction
+                        state ^= state << 13;
+                        state ^= state >> 7;
+                        state ^= state << 17;
+                        MessageDirection direction = (state >> 40) & 1 ? MessageDirection::Received : MessageDirection::Sent;
+                        engine.submit(targets[state % targets.size()], kinds[(state >> 32) & 3], direction, "hello there");
+                    }
+                });
+            }
+            for (auto &producer : producers)
+            {
+                producer.join();
+            }
+            engine.stop();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double rate = messages / seconds;
+        if (baseline == 0)
+        {
+            baseline = rate;
+        }
+        cout << threads << "\t" << static_cast<uint64_t>(rate) << "\t" << rate / baseline << "x\n";
+
+        if (threads >= maxThreads)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Samples ranks 0..n-1 with probability proportional to 1 / (rank + 1)^skew
+class ZipfDistribution
+{
+private:
+    vector<double> cdf;
+
+public:
+    ZipfDistribution(size_t n, double skew)
+    {
+        cdf.reserve(n);
+        double sum = 0;
+        for (size_t rank = 1; rank <= n; rank++)
+        {
+            sum += 1.0 / pow(static_cast<double>(rank), skew);
+            cdf.push_back(sum);
+        }
+        for (double &value : cdf)
+        {
+            value /= sum;
+        }
+    }
+
+    template <typename Random>
+    size_t operator()(Random &random) const
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(random);
+        size_t rank = static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return min(rank, cdf.size() - 1);
+    }
+};
+
+// One synthetic message of benchmark traffic
+struct TrafficItem
+{
+    uint32_t contact;
+    MessageKind kind;
+    MessageDirection direction;
+    string content;
+};
+
+// Deterministic chat traffic: Zipf-distributed contacts (which gives a long tail of
+// history sizes), 70% text / 20% image / 10% voice, and text drawn from a Zipf vocabulary
+class WorkloadGenerator
+{
+private:
+    static const size_t VOCABULARY_SIZE = 5000;
+
+    mt19937_64 random;
+    ZipfDistribution contactRanks;
+    ZipfDistribution wordRanks;
+    vector<string> contacts;
+    vector<string> vocabulary;
+
+public:
+    WorkloadGenerator(size_t contactCount, uint64_t seed)
+        : random(seed), contactRanks(contactCount, 1.0), wordRanks(VOCABULARY_SIZE, 1.1)
+    {
+        for (size_t i = 0; i < contactCount; i++)
+        {
+            contacts.push_back("user" + to_string(i));
+        }
+        const char *syllables[] = {"ka", "lo", "mi", "ne", "ru", "sa", "ti", "vo", "ya", "ze", "ba", "do", "fe", "gu", "hi", "jo"};
+        for (size_t i = 0; i < VOCABULARY_SIZE; i++)
+        {
+            string word;
+            for (size_t n = i + 16; n >= 16; n /= 16)
+            {
+                word += syllables[n % 16];
+            }
+            vocabulary.push_back(word);
+        }
+    }
+
+    const vector<string> &getContacts() const
+    {
+        return contacts;
+    }
+
+    const string &nextWord()
+    {
+        return vocabulary[wordRanks(random)];
+    }
+
+    size_t nextContact()
+    {
+        return contactRanks(random);
+    }
+
+    TrafficItem next()
+    {
+        TrafficItem item;
+        item.contact = static_cast<uint32_t>(nextContact());
+        uint64_t roll = random() % 10;
+        item.kind = roll < 7 ? MessageKind::Text : roll < 9 ? MessageKind::Image : MessageKind::VoiceNote;
+        item.direction = random() & 1 ? MessageDirection::Received : MessageDirection::Sent;
+        if (item.kind == MessageKind::Text)
+        {
+            // Geometric word count, mean of about six words
+            do
+            {
+                if (!item.content.empty())
+                {
+                    item.content += ' ';
+                }
+                item.content += nextWord();
+            } while (random() % 6 != 0);
+        }
+        else
+        {
+            item.content = (item.kind == MessageKind::Image ? "IMG_" : "voice_") + to_string(random() % 100000) +
+                           (item.kind == MessageKind::Image ? ".jpg" : ".ogg");
+        }
+        return item;
+    }
+};
+
+// Resident set size of this process in bytes, or 0 where it cannot be read
+size_t residentBytes()
+{
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr)
+    {
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    int fields = fscanf(statm, "%lu %lu", &pages, &resident);
+    fclose(statm);
+    return fields == 2 ? resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+// Times one benchmark scenario and prints its row of the report
+class BenchmarkScenario
+{
+private:
+    string_view name;
+    chrono::steady_clock::time_point start;
+    uint64_t allocationsAtStart;
+
+public:
+    explicit BenchmarkScenario(string_view name)
+        : name(name), start(chrono::steady_clock::now()), allocationsAtStart(heapAllocations.load()) {}
+
+    void finish(size_t operations)
+    {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        uint64_t allocations = heapAllocations.load() - allocationsAtStart;
+        cout << name << '\t' << operations << '\t' << static_cast<uint64_t>(seconds > 0 ? operations / seconds : 0) << '\t';
+#ifdef COUNT_ALLOCATIONS
+        cout << (operations == 0 ? 0.0 : static_cast<double>(allocations) / operations);
+#else
+        (void)allocations;
+        cout << '-';
+#endif
+        cout << '\t' << residentBytes() / (1024 * 1024) << endl;
+    }
+};
+
+// A message as the menu first stored it, for --bench to compare against: a heap object of
+// its own holding its own string, labelled through a virtual call
+class BaselineMessage
+{
+protected:
+    string content;
+
+public:
+    explicit BaselineMessage(const string &content) : content(content) {}
+    virtual string getType() const = 0;
+    virtual string getContent() const
+    {
+        return content;
+    }
+    virtual ~BaselineMessage() {}
+};
+
+// Stands in for the six original subclasses, which differed only in their label
+template <MessageDirection Direction, MessageKind Kind>
+class BaselineTypedMessage : public BaselineMessage
+{
+public:
+    explicit BaselineTypedMessage(const string &content) : BaselineMessage(content) {}
+    string getType() const override
+    {
+        return string(messageTypeName(Direction, Kind));
+    }
+};
+
+BaselineMessage *makeBaselineMessage(MessageKind kind, MessageDirection direction, const string &content)
+{
+    const MessageDirection SENT = MessageDirection::Sent, RECEIVED = MessageDirection::Received;
+    bool sent = direction == SENT;
+    switch (kind)
+    {
+    case MessageKind::Text:
+        return sent ? static_cast<BaselineMessage *>(new BaselineTypedMessage<SENT, MessageKind::Text>(content))
+                    : new BaselineTypedMessage<RECEIVED, MessageKind::Text>(content);
+    case MessageKind::Image:
+        return sent ? static_cast<BaselineMessage *>(new BaselineTypedMessage<SENT, MessageKind::Image>(content))
+                    : new BaselineTypedMessage<RECEIVED, MessageKind::Image>(content);
+    default:
+        return sent ? static_cast<BaselineMessage *>(new BaselineTypedMessage<SENT, MessageKind::VoiceNote>(content))
+                    : new BaselineTypedMessage<RECEIVED, MessageKind::VoiceNote>(content);
+    }
+}
+
+// A conversation as the menu first kept it: found by scanning every conversation and copying
+// each username out to compare it, with its messages freed one by one
+class BaselineConversation
+{
+private:
+    string username;
+    vector<BaselineMessage *> messages;
+
+public:
+    explicit BaselineConversation(const string &username) : username(username) {}
+
+    BaselineConversation(const BaselineConversation &) = delete;
+    BaselineConversation &operator=(const BaselineConversation &) = delete;
+
+    string getUsername() const
+    {
+        return username;
+    }
+
+    void addMessage(MessageKind kind, MessageDirection direction, const string &content)
+    {
+        messages.push_back(makeBaselineMessage(kind, direction, content));
+    }
+
+    const vector<BaselineMessage *> &getMessages() const
+    {
+        return messages;
+    }
+
+    ~BaselineConversation()
+    {
+        for (auto message : messages)
+        {
+            delete message;
+        }
+    }
+};
+
+// Times lookups by name as the number of conversations grows to 1M, in the registry and with
+// the old scan; the scan stops at 100k conversations, since each lookup walks all of them
+void benchLookupScaling(uint64_t seed, size_t &checksum)
+{
+    const size_t MAX_SCANNED = 100000;
+    mt19937_64 random(seed);
+    ConversationRegistry conversations;
+    vector<unique_ptr<BaselineConversation>> scanned;
+    vector<string> names;
+    for (size_t count = 1000; count <= 1000000; count *= 10)
+    {
+        while (names.size() < count)
+        {
+            names.push_back("contact" + to_string(names.size()));
+            conversations.open(names.back(), nullptr);
+            if (scanned.size() < MAX_SCANNED)
+            {
+                scanned.emplace_back(new BaselineConversation(names.back()));
+            }
+        }
+        string label = "find by name, " + to_string(count) + " conversations";
+        BenchmarkScenario scenario(label);
+        size_t lookups = 1000000;
+        for (size_t i = 0; i < lookups; i++)
+        {
+            checksum += conversations.find(names[random() % count]) != nullptr;
+        }
+        scenario.finish(lookups);
+        if (count > MAX_SCANNED)
+        {
+            continue;
+        }
+        string scanLabel = "scan by name, " + to_string(count) + " conversations";
+        BenchmarkScenario scan(scanLabel);
+        size_t scans = 20000000 / count;
+        for (size_t i = 0; i < scans; i++)
+        {
+            const string &name = names[random() % count];
+            for (const auto &convo : scanned)
+            {
+                if (convo->getUsername() == name)
+                {
+                    checksum++;
                     break;
-                default:
-                    cout << "Invalid choice!\n";
                 }
-            } while (ch != 4);
+            }
+        }
+        scan.finish(scans);
+    }
+}
+
+// Indexes generated traffic straight into one index, without storing the messages, up to ten
+// times the benchmark's message count. Each time the index has grown tenfold it reports query
+// latency percentiles and the memory held by posting lists and by the whole index.
+void benchSearchScaling(size_t messages, size_t contacts, uint64_t seed, size_t &checksum)
+{
+    const size_t QUERIES = 10000;
+    WorkloadGenerator generator(contacts, seed + 1);
+    ConversationRegistry owners;
+    vector<Conversation *> byContact(contacts, nullptr);
+    vector<uint32_t> positions(contacts, 0);
+    for (size_t i = 0; i < contacts; i++)
+    {
+        byContact[i] = owners.open(generator.getContacts()[i], nullptr);
+    }
+    SearchIndex search;
+    size_t indexed = 0;
+    for (size_t target = max<size_t>(messages / 10, 1); target <= messages * 10; target *= 10)
+    {
+        for (; indexed < target; indexed++)
+        {
+            TrafficItem item = generator.next();
+            search.add(byContact[item.contact], positions[item.contact]++, item.content);
+        }
+        LatencyHistogram latency;
+        for (size_t i = 0; i < QUERIES; i++)
+        {
+            string query = generator.nextWord();
+            if (i % 4 == 0)
+            {
+                query = query.substr(0, 3) + "*";
+            }
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            checksum += search.search(query, 20).size();
+            latency.record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count()));
+        }
+        vector<uint64_t> totals;
+        latency.addTo(totals);
+        size_t postings = search.postingBytes(), total = search.memoryUsage();
+        cout << "search, " << indexed << " messages\tp50 us\t" << LatencyHistogram::valueAt(totals, 0.5) / 1000.0 << "\tp99 us\t"
+             << LatencyHistogram::valueAt(totals, 0.99) / 1000.0 << "\tposting MiB\t" << postings / (1024 * 1024) << "\tindex MiB\t"
+             << total / (1024 * 1024) << "\tbytes/message\t" << total / indexed << "\n";
+    }
+}
+
+// Runs the messaging core through synthetic workloads and reports ops/sec, heap
+// allocations per operation (with -DCOUNT_ALLOCATIONS) and resident memory in MiB
+int runBenchmarks(size_t messages, size_t contacts, uint64_t seed)
+{
+    ios::sync_with_stdio(false);
+    cout << "Benchmark: " << messages << " messages across " << contacts << " contacts, seed " << seed << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    WorkloadGenerator generator(contacts, seed);
+    size_t checksum = 0; // Folds in every result so no scenario can be optimised away
+    vector<TrafficItem> traffic;
+    traffic.reserve(messages);
+    {
+        BenchmarkScenario scenario("generate traffic");
+        for (size_t i = 0; i < messages; i++)
+        {
+            traffic.push_back(generator.next());
+        }
+        scenario.finish(messages);
+    }
+
+    ConversationRegistry conversations;
+    vector<Conversation *> byContact(contacts, nullptr);
+    {
+        BenchmarkScenario scenario("start conversations");
+        for (size_t i = 0; i < contacts; i++)
+        {
+            byContact[i] = new MultimediaConversation(nullptr, generator.getContacts()[i]);
+            conversations.add(byContact[i]);
+        }
+        scenario.finish(contacts);
+    }
+    {
+        BenchmarkScenario scenario("add message");
+        for (const TrafficItem &item : traffic)
+        {
+            byContact[item.contact]->addMessage(item.kind, item.direction, item.content);
+        }
+        scenario.finish(messages);
+    }
+    {
+        // The same traffic stored the original way, then both ways freed again
+        vector<unique_ptr<BaselineConversation>> baseline;
+        for (size_t i = 0; i < contacts; i++)
+        {
+            baseline.emplace_back(new BaselineConversation(generator.getContacts()[i]));
+        }
+        {
+            BenchmarkScenario scenario("add message, heap per message");
+            for (const TrafficItem &item : traffic)
+            {
+                baseline[item.contact]->addMessage(item.kind, item.direction, item.content);
+            }
+            scenario.finish(messages);
+        }
+
+        // Whole histories rendered as the CHATS listing does, over and over until 10M messages
+        // have been, into a screen buffer that is emptied every MiB
+        const size_t RENDERED = 10000000;
+        string screen;
+        if (messages > 0)
+        {
+            BenchmarkScenario scenario("render 10M, virtual getType");
+            size_t rendered = 0;
+            while (rendered < RENDERED)
+            {
+                for (const auto &convo : baseline)
+                {
+                    for (const BaselineMessage *message : convo->getMessages())
+                    {
+                        screen += message->getType();
+                        screen += ": ";
+                        screen += message->getContent();
+                        screen += '\n';
+                        if (screen.size() >= (1 << 20))
+                        {
+                            checksum += screen.size();
+                            screen.clear();
+                        }
+                    }
+                    rendered += convo->getMessages().size();
+                }
+            }
+            scenario.finish(rendered);
+        }
+        if (messages > 0)
+        {
+            BenchmarkScenario scenario("render 10M, message records");
+            size_t rendered = 0;
+            while (rendered < RENDERED)
+            {
+                for (const auto &convo : conversations)
+                {
+                    for (const Message &message : convo->getMessages())
+                    {
+                        screen += message.getTypeName();
+                        screen += ": ";
+                        screen += message.getContentView();
+                        screen += '\n';
+                        if (screen.size() >= (1 << 20))
+                        {
+                            checksum += screen.size();
+                            screen.clear();
+                        }
+                    }
+                    rendered += convo->getMessages().size();
+                }
+            }
+            scenario.finish(rendered);
+        }
+        {
+            BenchmarkScenario scenario("free history, heap per message");
+            baseline.clear();
+            scenario.finish(messages);
+        }
+        unique_ptr<ConversationRegistry> copy(new ConversationRegistry);
+        vector<Conversation *> copyByContact(contacts, nullptr);
+        for (size_t i = 0; i < contacts; i++)
+        {
+            copyByContact[i] = new MultimediaConversation(nullptr, generator.getContacts()[i]);
+            copy->add(copyByContact[i]);
+        }
+        for (const TrafficItem &item : traffic)
+        {
+            copyByContact[item.contact]->addMessage(item.kind, item.direction, item.content);
+        }
+        BenchmarkScenario scenario("free history");
+        copy.reset();
+        scenario.finish(messages);
+    }
+    {
+        BenchmarkScenario scenario("find conversation");
+        for (size_t i = 0; i < messages; i++)
+        {
+            checksum += conversations.find(generator.getContacts()[generator.nextContact()]) != nullptr;
+        }
+        scenario.finish(messages);
+    }
+    {
+        BenchmarkScenario scenario("time range lookup");
+        mt19937_64 random(seed);
+        for (size_t i = 0; i < messages; i++)
+        {
+            const MessageStore &store = byContact[generator.nextContact()]->getMessages();
+            if (store.empty())
+            {
+                continue;
+            }
+            int64_t first = store.timestamp(0);
+            int64_t span = store.timestamp(store.size() - 1) - first + 1;
+            checksum += store.lowerBound(first + static_cast<int64_t>(random() % static_cast<uint64_t>(span)));
+        }
+        scenario.finish(messages);
+    }
+    {
+        BenchmarkScenario scenario("iterate messages");
+        size_t visited = 0;
+        for (const auto &convo : conversations)
+        {
+            for (const Message &message : convo->getMessages())
+            {
+                checksum += message.getTypeName().size() + message.getContentView().size();
+                visited++;
+            }
+        }
+        scenario.finish(visited);
+    }
+    {
+        BenchmarkScenario scenario("render last 20");
+        string screen;
+        OutputBuffer out(screen);
+        size_t renders = max<size_t>(messages / 100, 1);
+        for (size_t i = 0; i < renders; i++)
+        {
+            renderConversation(out, *byContact[generator.nextContact()], -20);
+            out.flush();
+            checksum += screen.size();
+            screen.clear();
+        }
+        scenario.finish(renders);
+    }
+    SearchIndex search;
+    {
+        BenchmarkScenario scenario("index messages");
+        for (const auto &convo : conversations)
+        {
+            const MessageStore &store = convo->getMessages();
+            for (size_t i = 0; i < store.size(); i++)
+            {
+                search.add(convo, i, store[i].getContentView());
+            }
+        }
+        scenario.finish(search.messageCount());
+    }
+    {
+        BenchmarkScenario scenario("search top 20");
+        size_t queries = max<size_t>(messages / 100, 1);
+        for (size_t i = 0; i < queries; i++)
+        {
+            string query = generator.nextWord();
+            if (i % 4 == 0)
+            {
+                query = query.substr(0, 3) + "*";
+            }
+            checksum += search.search(query, 20).size();
+        }
+        scenario.finish(queries);
+    }
+    benchSearchScaling(messages, contacts, seed, checksum);
+    string frames;
+    chrono::steady_clock::time_point encodeStart = chrono::steady_clock::now();
+    {
+        BenchmarkScenario scenario("wire encode");
+        for (const auto &convo : conversations)
+        {
+            const MessageStore &store = convo->getMessages();
+            for (size_t s = 0; s < store.segmentCount(); s++)
+            {
+                ColumnView<MessageRecord> records = store.segment(s);
+                WireFormat::encodeFrame(frames, convo->getUsername(), records.data(), records.size());
+            }
+        }
+        scenario.finish(messages);
+    }
+    double encodeSeconds = chrono::duration<double>(chrono::steady_clock::now() - encodeStart).count();
+    chrono::steady_clock::time_point decodeStart = chrono::steady_clock::now();
+    {
+        BenchmarkScenario scenario("wire decode");
+        size_t decoded = 0, offset = 0;
+        while (offset < frames.size())
+        {
+            WireFormat::FrameView frame;
+            offset += frame.parse(frames.data() + offset, frames.size() - offset);
+            frame.forEach([&](const MessageRecord &record)
+            {
+                checksum += record.length;
+                decoded++;
+            });
+        }
+        scenario.finish(decoded);
+    }
+    double decodeSeconds = chrono::duration<double>(chrono::steady_clock::now() - decodeStart).count();
+    cout << "\tframe MiB " << frames.size() / (1024 * 1024) << ", encode GB/s " << (encodeSeconds > 0 ? frames.size() / encodeSeconds / 1e9 : 0)
+         << ", decode GB/s " << (decodeSeconds > 0 ? frames.size() / decodeSeconds / 1e9 : 0) << "\n";
+    {
+        ConversationRegistry groups;
+        vector<GroupConversation *> teams;
+        for (size_t g = 0; g < 100; g++)
+        {
+            GroupConversation *team = new GroupConversation(nullptr, "team" + to_string(g));
+            for (size_t m = 0; m < 8; m++)
+            {
+                team->addMember(byContact[generator.nextContact()]);
+            }
+            groups.add(team);
+            teams.push_back(team);
+        }
+        BenchmarkScenario scenario("group fan-out x8");
+        size_t sends = max<size_t>(messages / 10, 1);
+        for (size_t i = 0; i < sends; i++)
+        {
+            const TrafficItem &item = traffic[i];
+            teams[i % teams.size()]->addMessage(item.kind, MessageDirection::Sent, item.content);
+        }
+        scenario.finish(sends);
+    }
+    {
+        // One 10k-member group: every send is stored once and each member's chat refers to it
+        const size_t MEMBERS = 10000;
+        ConversationRegistry everyone;
+        GroupConversation *group = everyone.openGroup("everyone", nullptr);
+        for (size_t m = 0; m < MEMBERS; m++)
+        {
+            group->addMember(everyone.open("member" + to_string(m), nullptr));
+        }
+        auto memberBytes = [&]()
+        {
+            size_t bytes = 0;
+            for (auto member : group->getMembers())
+            {
+                bytes += member->memoryUsage();
+            }
+            return bytes;
+        };
+        size_t membersBefore = memberBytes(), residentBefore = residentBytes(), bodyBytes = 0;
+        size_t sends = min<size_t>(max<size_t>(messages / 10000, 1), 200);
+        {
+            BenchmarkScenario scenario("group fan-out x10000");
+            for (size_t i = 0; i < sends; i++)
+            {
+                const TrafficItem &item = traffic[i % traffic.size()];
+                group->addMessage(item.kind, MessageDirection::Sent, item.content);
+                bodyBytes += sizeof(SharedBody) + item.content.size();
+            }
+            scenario.finish(sends);
+        }
+        size_t deliveries = sends * MEMBERS;
+        size_t resident = residentBytes() - min(residentBytes(), residentBefore);
+        cout << "\tdeliveries " << deliveries << ", bytes/member delivery " << (memberBytes() - membersBefore) / deliveries
+             << ", RSS bytes/member delivery " << resident / deliveries << ", body bytes/send " << bodyBytes / sends << "\n";
+    }
+    {
+        // A login storm: accounts created and logins verified from several threads at once. The
+        // salted password hash is meant to be slow, so the counts stay small.
+        const size_t ACCOUNTS = 512, LOGINS = 256;
+        CredentialStore accounts;
+        size_t residentBefore = residentBytes();
+        {
+            BenchmarkScenario scenario("create accounts, 4 threads");
+            vector<thread> workers;
+            for (size_t t = 0; t < 4; t++)
+            {
+                workers.emplace_back([&accounts, t]()
+                {
+                    for (size_t i = t; i < ACCOUNTS; i += 4)
+                    {
+                        accounts.createAccount("account" + to_string(i), "secret" + to_string(i));
+                    }
+                });
+            }
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+            scenario.finish(accounts.size());
+        }
+        size_t resident = residentBytes() - min(residentBytes(), residentBefore);
+        cout << "bytes/account\t" << accounts.memoryUsage() / ACCOUNTS << "\tRSS bytes/account\t" << resident / ACCOUNTS << "\n";
+        for (size_t threads = 1; threads <= 8; threads *= 2)
+        {
+            string label = "verify login, " + to_string(threads) + (threads == 1 ? " thread" : " threads");
+            atomic<size_t> accepted{0};
+            BenchmarkScenario scenario(label);
+            vector<thread> workers;
+            for (size_t t = 0; t < threads; t++)
+            {
+                workers.emplace_back([&accounts, &accepted, t, threads]()
+                {
+                    for (size_t i = t; i < LOGINS; i += threads)
+                    {
+                        size_t user = i * 7 % ACCOUNTS;
+                        accepted += accounts.verifyLogin("account" + to_string(user), "secret" + to_string(user));
+                    }
+                });
+            }
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+            scenario.finish(LOGINS);
+            checksum += accepted;
+        }
+    }
+
+    // Block compression of history: every segment is one block, compressed on its own so any
+    // block can be decoded without its neighbours
+    vector<string> blocks;
+    size_t corpusBytes = 0;
+    for (const auto &convo : conversations)
+    {
+        const MessageStore &store = convo->getMessages();
+        for (size_t s = 0; s < store.segmentCount(); s++)
+        {
+            string block;
+            for (const MessageRecord &record : store.segment(s))
+            {
+                block.append(record.payload, record.length);
+            }
+            corpusBytes += block.size();
+            blocks.push_back(move(block));
+        }
+    }
+    string dictionary;
+    {
+        BenchmarkScenario scenario("train dictionary");
+        vector<string_view> samples;
+        for (size_t i = 0, sampled = 0; i < traffic.size() && sampled < (1 << 20); i++)
+        {
+            samples.push_back(traffic[i].content);
+            sampled += traffic[i].content.size();
+        }
+        dictionary = DictionaryTrainer::train(samples, 16 * 1024);
+        scenario.finish(samples.size());
+    }
+    for (bool useDictionary : {false, true})
+    {
+        string_view shared = useDictionary ? string_view(dictionary) : string_view();
+        vector<string> compressed(blocks.size());
+        size_t compressedBytes = 0;
+        auto start = chrono::steady_clock::now();
+        {
+            BenchmarkScenario scenario(useDictionary ? "compress block, dictionary" : "compress block, plain");
+            for (size_t i = 0; i < blocks.size(); i++)
+            {
+                BlockCodec::compress(blocks[i].data(), blocks[i].size(), compressed[i], shared);
+                compressedBytes += compressed[i].size();
+            }
+            scenario.finish(blocks.size());
+        }
+        double compressSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        size_t decodedBytes = 0;
+        {
+            BenchmarkScenario scenario(useDictionary ? "decode random block, dictionary" : "decode random block, plain");
+            mt19937_64 random(seed);
+            string decoded;
+            for (size_t n = 0; n < blocks.size(); n++)
+            {
+                size_t i = random() % blocks.size();
+                decodedBytes += blocks[i].size();
+                decoded.resize(blocks[i].size());
+                BlockCodec::decompress(compressed[i].data(), compressed[i].size(), &decoded[0], decoded.size(), shared);
+                checksum += decoded == blocks[i];
+            }
+            scenario.finish(blocks.size());
+        }
+        double decompressSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double mib = corpusBytes / (1024.0 * 1024.0);
+        cout << "\tcorpus MiB " << mib << " in " << blocks.size() << " blocks, ratio "
+             << (compressedBytes == 0 ? 0.0 : static_cast<double>(corpusBytes) / compressedBytes) << ", saved MiB "
+             << (corpusBytes - compressedBytes) / (1024.0 * 1024.0) << ", compress MiB/s " << mib / compressSeconds
+             << ", decompress MiB/s " << decodedBytes / (1024.0 * 1024.0) / decompressSeconds << "\n";
+    }
+
+    // Resident history vs. access latency: the same traffic under shrinking budgets, read back
+    // at random positions so old segments have to be paged in
+    size_t payloadBytes = 0;
+    for (const TrafficItem &item : traffic)
+    {
+        payloadBytes += item.content.size();
+    }
+    const char *spillPath = "bench.spill";
+    for (size_t divisor : {0, 4, 16})
+    {
+        size_t budget = divisor == 0 ? SIZE_MAX : payloadBytes / divisor;
+        string label = divisor == 0 ? "history view, no budget" : "history view, budget 1/" + to_string(divisor);
+        HistoryTier tier(spillPath, budget);
+        Inbox inbox;
+        ChatServices services;
+        services.history = &tier;
+        services.inbox = &inbox;
+        ConversationRegistry tiered;
+        vector<Conversation *> tieredByContact(contacts, nullptr);
+        for (size_t i = 0; i < contacts; i++)
+        {
+            tieredByContact[i] = new MultimediaConversation(&services, generator.getContacts()[i]);
+            tiered.add(tieredByContact[i]);
+        }
+        for (const TrafficItem &item : traffic)
+        {
+            tieredByContact[item.contact]->addMessage(item.kind, item.direction, item.content);
+        }
+        tier.trim();
+
+        BenchmarkScenario scenario(label);
+        string screen;
+        OutputBuffer out(screen);
+        mt19937_64 random(seed);
+        size_t views = max<size_t>(messages / 100, 1);
+        for (size_t i = 0; i < views; i++)
+        {
+            const Conversation &convo = *tieredByContact[generator.nextContact()];
+            size_t offset = convo.getMessages().empty() ? 0 : random() % convo.getMessages().size();
+            renderConversation(out, convo, static_cast<long long>(offset), 20);
+            out.flush();
+            checksum += screen.size();
+            screen.clear();
+            tier.trim();
+        }
+        scenario.finish(views);
+        cout << "\tresident history MiB " << tier.getResidentBytes() / (1024 * 1024) << ", evictions " << tier.getEvictions()
+             << ", loads " << tier.getLoads() << ", spill ratio "
+             << (tier.getRawBytesSpilled() == 0 ? 0.0 : static_cast<double>(tier.getCompressedBytesSpilled()) / tier.getRawBytesSpilled())
+             << ", spill file KiB " << tier.getSpillFileBytes() / 1024 << "\n";
+        if (divisor == 0)
+        {
+            BenchmarkScenario inboxScenario("render inbox top 20");
+            for (size_t i = 0; i < views; i++)
+            {
+                renderInbox(out, inbox.recent(20));
+                out.flush();
+                checksum += screen.size();
+                screen.clear();
+            }
+            inboxScenario.finish(views);
+        }
+    }
+    remove(spillPath);
+
+    {
+        // The trace the menu used to leave behind: starting a chat with a known contact opened
+        // another conversation for it, which took that contact's messages from then on
+        SearchIndex traceSearch;
+        Inbox traceInbox;
+        ChatServices traceServices;
+        traceServices.search = &traceSearch;
+        traceServices.inbox = &traceInbox;
+        ConversationRegistry duplicated;
+        vector<Conversation *> current(contacts, nullptr);
+        mt19937_64 random(seed);
+        {
+            BenchmarkScenario scenario("duplicate-heavy trace");
+            for (const TrafficItem &item : traffic)
+            {
+                Conversation *&convo = current[item.contact];
+                if (convo == nullptr || random() % 8 == 0)
+                {
+                    convo = new MultimediaConversation(&traceServices, generator.getContacts()[item.contact]);
+                    duplicated.add(convo);
+                }
+                convo->addMessage(item.kind, item.direction, item.content);
+            }
+            scenario.finish(messages);
+        }
+        auto reportRegistry = [&](const char *label)
+        {
+            size_t bytes = 0;
+            for (const auto &convo : duplicated)
+            {
+                bytes += convo->memoryUsage();
+            }
+            cout << label << "\tconversations\t" << duplicated.size() << "\tduplicates\t" << duplicated.duplicateCount()
+                 << "\tMiB\t" << bytes / (1024 * 1024) << "\n";
+        };
+        reportRegistry("before compaction");
+
+        // Reading a contact's whole history means visiting every conversation it is split over
+        size_t lookups = min(messages, static_cast<size_t>(2000));
+        {
+            BenchmarkScenario scenario("history scan, duplicates");
+            for (size_t i = 0; i < lookups; i++)
+            {
+                UserId id = StringPool::instance().intern(generator.getContacts()[generator.nextContact()]);
+                for (const auto &convo : duplicated)
+                {
+                    if (convo->getUserId() == id)
+                    {
+                        checksum += convo->getMessages().size();
+                    }
+                }
+            }
+            scenario.finish(lookups);
+        }
+        {
+            BenchmarkScenario scenario("compact duplicates");
+            size_t merged = duplicated.compact(&traceSearch);
+            scenario.finish(merged);
+        }
+        reportRegistry("after compaction");
+        {
+            BenchmarkScenario scenario("history scan, compacted");
+            for (size_t i = 0; i < lookups; i++)
+            {
+                const Conversation *convo = duplicated.find(generator.getContacts()[generator.nextContact()]);
+                checksum += convo != nullptr ? convo->getMessages().size() : 0;
+            }
+            scenario.finish(lookups);
+        }
+        {
+            BenchmarkScenario scenario("search after compaction");
+            size_t queries = max<size_t>(messages / 100, 1);
+            for (size_t i = 0; i < queries; i++)
+            {
+                for (const auto &hit : traceSearch.search(generator.nextWord(), 20))
+                {
+                    checksum += hit.convo->getMessages()[hit.index].getContentView().size();
+                }
+            }
+            scenario.finish(queries);
+        }
+    }
+
+    // Last, since a million conversations leave the resident size high for any scenario after them
+    benchLookupScaling(seed, checksum);
+
+    cout << "checksum " << checksum << "\n";
+    return 0;
+}
+
+// Snapshots a platform of synthetic traffic while ingestion carries on, then restores it:
+// reports the ingestion pause, the background write, restore time and first use of the restored data
+int runSnapshotBenchmark(size_t messages, size_t contacts, uint64_t seed)
+{
+    ios::sync_with_stdio(false);
+    const char *path = "bench.snapshot";
+    cout << "Snapshot benchmark: " << messages << " messages across " << contacts << " contacts, seed " << seed << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    WorkloadGenerator generator(contacts, seed);
+    SearchIndex search;
+    Inbox inbox;
+    ChatServices services;
+    services.search = &search;
+    services.inbox = &inbox;
+    ConversationRegistry conversations;
+    vector<Conversation *> byContact(contacts, nullptr);
+    for (size_t i = 0; i < contacts; i++)
+    {
+        byContact[i] = conversations.open(generator.getContacts()[i], &services);
+    }
+    {
+        BenchmarkScenario scenario("ingest");
+        for (size_t i = 0; i < messages; i++)
+        {
+            TrafficItem item = generator.next();
+            byContact[item.contact]->addMessage(item.kind, item.direction, item.content);
+        }
+        scenario.finish(messages);
+    }
+
+    // Ingestion only stops for start(); the rest of the write overlaps with the loop below
+    Snapshotter snapshots(path);
+    int64_t pause = snapshots.start(conversations, &inbox, &search, nullptr);
+    size_t during = 0;
+    chrono::steady_clock::time_point writeStart = chrono::steady_clock::now();
+    while (snapshots.isRunning())
+    {
+        TrafficItem item = generator.next();
+        byContact[item.contact]->addMessage(item.kind, item.direction, item.content);
+        during++;
+    }
+    bool written = snapshots.wait();
+    double writeSeconds = chrono::duration<double>(chrono::steady_clock::now() - writeStart).count();
+    MappedFile file(path);
+    cout << "snapshot pause us\t" << pause << "\twrite ms\t" << snapshots.getLastWriteMicros() / 1000
+         << "\tfile MiB\t" << file.size() / (1024 * 1024) << "\n";
+    cout << "ingested while writing\t" << during << "\tops/sec\t" << static_cast<uint64_t>(writeSeconds > 0 ? during / writeSeconds : 0) << "\n";
+    if (!written)
+    {
+        cout << "snapshot failed\n";
+        return 1;
+    }
+
+    SearchIndex restoredSearch;
+    Inbox restoredInbox;
+    ChatServices restoredServices;
+    restoredServices.search = &restoredSearch;
+    restoredServices.inbox = &restoredInbox;
+    ConversationRegistry restored;
+    size_t logOffset = 0;
+    chrono::steady_clock::time_point restoreStart = chrono::steady_clock::now();
+    restoreSnapshot(file, 0, restored, &restoredServices, logOffset);
+    double restoreMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - restoreStart).count();
+
+    // First requests against the restored state: the newest chat and a search over everything
+    chrono::steady_clock::time_point firstStart = chrono::steady_clock::now();
+    size_t checksum = 0;
+    vector<Conversation *> newest = restoredInbox.recent(1);
+    if (!newest.empty())
+    {
+        const MessageStore &store = newest.front()->getMessages();
+        for (size_t i = store.size() > 20 ? store.size() - 20 : 0; i < store.size(); i++)
+        {
+            checksum += store[i].getContentView().size();
+        }
+    }
+    double viewMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - firstStart).count();
+    chrono::steady_clock::time_point searchStart = chrono::steady_clock::now();
+    checksum += restoredSearch.search(generator.nextWord(), 20).size();
+    double searchMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - searchStart).count();
+    cout << "restore ms\t" << restoreMillis << "\tfirst view us\t" << viewMicros << "\tfirst search us\t" << searchMicros << "\n";
+
+    // Every restored message must match what the conversation held when the snapshot started
+    size_t restoredMessages = 0, mismatches = 0;
+    {
+        BenchmarkScenario scenario("verify restored messages");
+        for (const auto &convo : restored)
+        {
+            const Conversation *original = conversations.find(convo->getUsername());
+            const MessageStore &store = convo->getMessages();
+            if (original == nullptr || original->getMessages().size() < store.size())
+            {
+                mismatches++;
+                continue;
+            }
+            for (size_t i = 0; i < store.size(); i++)
+            {
+                mismatches += store[i].getContentView() != original->getMessages()[i].getContentView();
+            }
+            restoredMessages += store.size();
+        }
+        scenario.finish(restoredMessages);
+    }
+    cout << "restored messages\t" << restoredMessages << " of " << messages << "\tmismatches\t" << mismatches
+         << "\tsearch documents\t" << restoredSearch.messageCount() << "\tchecksum\t" << checksum << "\n";
+    remove(path);
+    return restoredMessages == messages && mismatches == 0 && restoredSearch.messageCount() == messages ? 0 : 1;
+}
+
+// Measures the message log: write throughput with every group commit fsync'd, then a cold start
+// (a fresh registry over a freshly mapped file) replaying the whole log, and one that loads a
+// checkpoint snapshot and replays only the tail written after it
+int runLogBenchmark(size_t messages, size_t contacts, uint64_t seed)
+{
+    ios::sync_with_stdio(false);
+    const char *logPath = "bench.log";
+    const char *snapshotPath = "bench.snapshot";
+    cout << "Log benchmark: " << messages << " messages across " << contacts << " contacts, seed " << seed << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    WorkloadGenerator generator(contacts, seed);
+    vector<TrafficItem> traffic;
+    traffic.reserve(messages);
+    for (size_t i = 0; i < messages; i++)
+    {
+        traffic.push_back(generator.next());
+    }
+    size_t tail = messages / 16; // Sent after the checkpoint
+
+    uint64_t logBytes = 0, checkpointOffset = 0;
+    {
+        SearchIndex search;
+        Inbox inbox;
+        MessageLog log(logPath, 0);
+        ChatServices services;
+        services.search = &search;
+        services.inbox = &inbox;
+        services.log = &log;
+        ConversationRegistry conversations;
+        vector<Conversation *> byContact(contacts, nullptr);
+        for (size_t i = 0; i < contacts; i++)
+        {
+            byContact[i] = conversations.open(generator.getContacts()[i], &services);
+        }
+        chrono::steady_clock::time_point writeStart = chrono::steady_clock::now();
+        {
+            BenchmarkScenario scenario("log write");
+            for (size_t i = 0; i < messages - tail; i++)
+            {
+                byContact[traffic[i].contact]->addMessage(traffic[i].kind, traffic[i].direction, traffic[i].content);
+            }
+            log.flush();
+            scenario.finish(messages - tail);
+        }
+        double writeSeconds = chrono::duration<double>(chrono::steady_clock::now() - writeStart).count();
+        logBytes = log.getDurableLength();
+        cout << "log MiB\t" << logBytes / (1024 * 1024) << "\tfsync'd MB/s\t" << (writeSeconds > 0 ? logBytes / writeSeconds / 1e6 : 0) << "\n";
+
+        Snapshotter snapshots(snapshotPath);
+        snapshots.start(conversations, &inbox, &search, &log);
+        if (!snapshots.wait())
+        {
+            cout << "checkpoint failed\n";
+            return 1;
+        }
+        checkpointOffset = log.getDurableLength();
+        for (size_t i = messages - tail; i < messages; i++)
+        {
+            byContact[traffic[i].contact]->addMessage(traffic[i].kind, traffic[i].direction, traffic[i].content);
+        }
+        log.flush();
+        logBytes = log.getDurableLength();
+    }
+
+    // Each start maps the files afresh and rebuilds everything a platform would
+    size_t counts[2] = {0, 0};
+    for (int fromCheckpoint = 0; fromCheckpoint < 2; fromCheckpoint++)
+    {
+        SearchIndex search;
+        Inbox inbox;
+        ChatServices services;
+        services.search = &search;
+        services.inbox = &inbox;
+        ConversationRegistry conversations;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        MappedFile history(logPath);
+        MappedFile snapshot(snapshotPath);
+        size_t logOffset = 0;
+        if (fromCheckpoint)
+        {
+            restoreSnapshot(snapshot, history.size(), conversations, &services, logOffset);
+        }
+        size_t replayed = history.size() - logOffset;
+        replayMessageLog(history, conversations, &services, logOffset);
+        double startMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        for (const auto &convo : conversations)
+        {
+            counts[fromCheckpoint] += convo->getMessages().size();
+        }
+        cout << (fromCheckpoint ? "cold start, checkpoint + tail ms\t" : "cold start, full replay ms\t") << startMillis << "\tlog MiB replayed\t"
+             << replayed / (1024 * 1024) << "\tRSS MiB\t" << residentBytes() / (1024 * 1024) << "\n";
+    }
+    cout << "messages restored\t" << counts[0] << "\t" << counts[1] << " of " << messages << "\tcheckpoint at MiB\t" << checkpointOffset / (1024 * 1024)
+         << "\tlog MiB\t" << logBytes / (1024 * 1024) << "\n";
+    remove(logPath);
+    remove(snapshotPath);
+    return counts[0] == messages && counts[1] == messages ? 0 : 1;
+}
+
+// Times the instrumented operations, as start, send, receive, view and search commands over
+// synthetic traffic, and reports the best of five rounds in ns per command. Running a
+// -DNO_METRICS build with the same arguments gives the uninstrumented time; passed in as the
+// last argument, it turns the two into the overhead of the metrics. A build with metrics also
+// times the timer and counters on their own, for an estimate from a single build.
+int runMetricsBenchmark(size_t messages, size_t contacts, uint64_t seed, double uninstrumentedNanos)
+{
+    ios::sync_with_stdio(false);
+#ifdef NO_METRICS
+    const char *build = "out";
+#else
+    const char *build = "in";
+#endif
+    cout << "Metrics benchmark: " << messages << " messages across " << contacts << " contacts, seed " << seed << ", metrics compiled " << build << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    const char *KIND_NAMES[] = {"text", "image", "voice"};
+    WorkloadGenerator generator(contacts, seed);
+    vector<string> lines;
+    lines.reserve(contacts + messages);
+    for (size_t i = 0; i < contacts; i++)
+    {
+        lines.push_back("start " + generator.getContacts()[i]);
+    }
+    for (size_t i = 0; i < messages; i++)
+    {
+        TrafficItem item = generator.next();
+        const string &user = generator.getContacts()[item.contact];
+        if (i % 100 == 49)
+        {
+            lines.push_back("view " + user + " -20");
+        }
+        else if (i % 100 == 99)
+        {
+            lines.push_back("search " + generator.nextWord());
+        }
+        else
+        {
+            lines.push_back((item.direction == MessageDirection::Sent ? "send " : "receive ") + user + " " +
+                            KIND_NAMES[static_cast<int>(item.kind)] + " " + item.content);
+        }
+    }
+
+    double bestNanos = 0;
+    for (int round = 0; round < 5; round++)
+    {
+        SearchIndex search;
+        Inbox inbox;
+        ChatServices services;
+        services.search = &search;
+        services.inbox = &inbox;
+        ConversationRegistry conversations;
+        string screen;
+        OutputBuffer out(screen);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        BenchmarkScenario scenario("commands");
+        for (const string &line : lines)
+        {
+            executeCommand(line, conversations, &services, out);
+            out.flush();
+            screen.clear();
+        }
+        scenario.finish(lines.size());
+        double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / max<size_t>(lines.size(), 1);
+        bestNanos = round == 0 ? nanos : min(bestNanos, nanos);
+    }
+    cout << "ns/op\t" << bestNanos << "\n";
+
+#ifndef NO_METRICS
+    {
+        // What one command records: its latency and, for a message, the count and bytes
+        size_t probes = 1000000;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < probes; i++)
+        {
+            ScopedTimer timer(Operation::SendMessage);
+            Metrics::instance().recordMessage(MessageKind::Text, MessageDirection::Sent, i & 63);
+        }
+        double probeNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / probes;
+        cout << "timer + counters ns\t" << probeNanos << "\testimated overhead %\t" << (bestNanos > 0 ? 100 * probeNanos / bestNanos : 0) << "\n";
+    }
+#endif
+    if (uninstrumentedNanos > 0)
+    {
+        cout << "uninstrumented ns/op\t" << uninstrumentedNanos << "\tmeasured overhead %\t"
+             << 100 * (bestNanos - uninstrumentedNanos) / uninstrumentedNanos << "\n";
+    }
+    return 0;
+}
+
+// Sends media from a local corpus through the attachment store, popular files more often
+// (Zipf), as when the same image is forwarded between chats. Reports the dedup ratio, then the
+// read throughput of every sent attachment through a mapping and streamed with sendfile. With
+// no corpus directory, one of random (incompressible, like encoded media) files is generated.
+int runAttachmentBenchmark(const string &corpus, size_t sends, uint64_t seed)
+{
+    ios::sync_with_stdio(false);
+    const char *storePath = "bench.attachments";
+    const char *generatedPath = "bench.corpus";
+    mt19937_64 random(seed);
+    vector<string> files;
+    if (corpus.empty())
+    {
+        // 64 files from 16 KiB to 4 MiB, evenly spread in log size
+        filesystem::create_directories(generatedPath);
+        for (size_t i = 0; i < 64; i++)
+        {
+            size_t size = static_cast<size_t>(16384 * pow(256.0, static_cast<double>(i) / 63));
+            string bytes(size, '\0');
+            for (size_t b = 0; b + 8 <= size; b += 8)
+            {
+                uint64_t r = random();
+                memcpy(&bytes[b], &r, 8);
+            }
+            files.push_back((filesystem::path(generatedPath) / ("media" + to_string(i) + ".bin")).string());
+            ofstream(files.back(), ios::binary).write(bytes.data(), static_cast<streamsize>(bytes.size()));
+        }
+    }
+    else
+    {
+        for (const auto &entry : filesystem::recursive_directory_iterator(corpus))
+        {
+            if (entry.is_regular_file())
+            {
+                files.push_back(entry.path().string());
+            }
+        }
+        if (files.empty())
+        {
+            throw runtime_error("No files in " + corpus);
+        }
+    }
+    shuffle(files.begin(), files.end(), random);
+    cout << "Attachment benchmark: " << sends << " sends of " << files.size() << " files" << (corpus.empty() ? " (generated)" : " from " + corpus)
+         << ", seed " << seed << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    ZipfDistribution popularity(files.size(), 1.0);
+    vector<string> digests;
+    digests.reserve(sends);
+    uint64_t readBytes = 0;
+    {
+        AttachmentStore store(storePath);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        {
+            BenchmarkScenario scenario("store attachment");
+            for (size_t i = 0; i < sends; i++)
+            {
+                string digest = store.put(files[popularity(random)]);
+                if (!digest.empty())
+                {
+                    digests.push_back(digest);
+                }
+            }
+            scenario.finish(sends);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "\treferenced MiB " << store.getReferencedBytes() / (1024 * 1024) << ", stored MiB " << store.getStoredBytes() / (1024 * 1024)
+             << ", stored files " << store.getStoredFiles() << ", dedup ratio "
+             << (store.getStoredBytes() == 0 ? 0.0 : static_cast<double>(store.getReferencedBytes()) / store.getStoredBytes()) << ", store MB/s "
+             << (seconds > 0 ? store.getReferencedBytes() / seconds / 1e6 : 0) << "\n";
+        readBytes = store.getReferencedBytes();
+
+        // Every sent attachment read once, as when each recipient opens it
+        size_t checksum = 0;
+        start = chrono::steady_clock::now();
+        {
+            BenchmarkScenario scenario("read mapped");
+            for (const string &digest : digests)
+            {
+                unique_ptr<MappedFile> file = store.open(digest);
+                const char *data = file->getData();
+                for (size_t offset = 0; offset < file->size(); offset += 64)
+                {
+                    checksum += static_cast<unsigned char>(data[offset]);
+                }
+            }
+            scenario.finish(digests.size());
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "\tmapped read MB/s " << (seconds > 0 ? readBytes / seconds / 1e6 : 0) << ", checksum " << checksum << "\n";
+#ifdef __linux__
+        // To a socket drained by another thread, as the server sends to a client
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+        {
+            throw runtime_error(string("Cannot create socket pair: ") + strerror(errno));
+        }
+        thread drain([&pair]()
+        {
+            vector<char> sink(1 << 20);
+            while (read(pair[1], sink.data(), sink.size()) > 0)
+            {
+            }
+        });
+        start = chrono::steady_clock::now();
+        {
+            BenchmarkScenario scenario("stream with sendfile");
+            for (const string &digest : digests)
+            {
+                store.streamTo(digest, pair[0]);
+            }
+            scenario.finish(digests.size());
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        close(pair[0]);
+        drain.join();
+        close(pair[1]);
+        cout << "\tstreamed MB/s " << (seconds > 0 ? readBytes / seconds / 1e6 : 0) << "\n";
+#endif
+    }
+    filesystem::remove_all(storePath);
+    if (corpus.empty())
+    {
+        filesystem::remove_all(generatedPath);
+    }
+    return 0;
+}
+
+// Measures what admission control costs per message and how it shares capacity: a few threads
+// flood one chat each while many normal users send at a steady pace, for `seconds` seconds.
+// Then floods one chat through the ingest engine with and without a per-chat backlog bound and
+// reports how long the other chats' submissions wait.
+int runRateBenchmark(double seconds, size_t normalUsers, size_t flooders)
+{
+    ios::sync_with_stdio(false);
+    const size_t calls = 10000000;
+    cout << "Rate limit benchmark: " << normalUsers << " normal users, " << flooders << " flooders, " << seconds << " s\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    size_t checksum = 0;
+    auto perCall = [](chrono::steady_clock::time_point start, size_t operations)
+    {
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / operations;
+    };
+    double clockNanos, admitNanos, limitedNanos;
+    {
+        BenchmarkScenario scenario("read clock");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; i++)
+        {
+            checksum += static_cast<size_t>(steadyNanos()) & 1;
+        }
+        clockNanos = perCall(start, calls);
+        scenario.finish(calls);
+    }
+    {
+        // Limits far above the offered load: every call takes both tokens
+        RateLimits open;
+        open.userRate = open.userBurst = open.globalRate = open.globalBurst = 1e12;
+        RateLimiter limiter(open);
+        vector<TokenBucket> buckets(10000);
+        BenchmarkScenario scenario("admit");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; i++)
+        {
+            checksum += limiter.admit(buckets[i % buckets.size()]) == Admission::Admitted;
+        }
+        admitNanos = perCall(start, calls);
+        scenario.finish(calls);
+    }
+    {
+        RateLimits tight;
+        tight.userRate = tight.userBurst = 10;
+        RateLimiter limiter(tight);
+        TokenBucket flooded;
+        BenchmarkScenario scenario("admit, user limited");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; i++)
+        {
+            checksum += limiter.admit(flooded) == Admission::Admitted;
+        }
+        limitedNanos = perCall(start, calls);
+        scenario.finish(calls);
+    }
+    cout << "ns per message\tclock\t" << clockNanos << "\tadmit\t" << admitNanos << "\tlimited\t" << limitedNanos << "\n";
+
+    // Fairness: every user may send 100 messages/s; normal users offer 10/s each and the global
+    // limit leaves room for twice their total, so only the flooders should be turned away
+    double normalRate = 10;
+    RateLimits limits;
+    limits.userRate = limits.userBurst = 100;
+    limits.globalRate = limits.globalBurst = normalUsers * normalRate * 2;
+    RateLimiter limiter(limits);
+    ChatServices services;
+    services.limiter = &limiter;
+    ConversationRegistry conversations;
+    vector<Conversation *> normal, flooded;
+    for (size_t i = 0; i < normalUsers; i++)
+    {
+        normal.push_back(conversations.open("user" + to_string(i), &services));
+    }
+    for (size_t i = 0; i < flooders; i++)
+    {
+        flooded.push_back(conversations.open("flooder" + to_string(i), &services));
+    }
+    vector<size_t> floodOffered(flooders, 0), floodAdmitted(flooders, 0);
+    size_t normalOffered = 0, normalAdmitted = 0;
+    {
+        IngestEngine engine(1);
+        atomic<bool> done{false};
+        vector<thread> threads;
+        for (size_t f = 0; f < flooders; f++)
+        {
+            threads.emplace_back([&, f]()
+            {
+                while (!done.load(memory_order_relaxed))
+                {
+                    floodOffered[f]++;
+                    if (flooded[f]->tryAdmit() == Admission::Admitted)
+                    {
+                        string content = "flood";
+                        while (!engine.trySubmit(flooded[f], MessageKind::Text, MessageDirection::Received, content))
+                        {
+                            this_thread::yield();
+                        }
+                        floodAdmitted[f]++;
+                    }
+                }
+            });
         }
-        catch (const exception &e)
+        // Paced sender: each user's next message is due 1 / normalRate seconds after the last
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        double interval = 1.0 / (normalRate * normalUsers);
+        for (;;)
         {
-            cout << "An error occurred while receiving the message: " << e.what() << endl;
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (elapsed >= seconds)
+            {
+                break;
+            }
+            size_t due = static_cast<size_t>(elapsed / interval);
+            if (normalOffered >= due)
+            {
+                this_thread::yield();
+                continue;
+            }
+            Conversation *convo = normal[normalOffered++ % normal.size()];
+            if (convo->tryAdmit() == Admission::Admitted)
+            {
+                string content = "hello";
+                while (!engine.trySubmit(convo, MessageKind::Text, MessageDirection::Sent, content))
+                {
+                    this_thread::yield();
+                }
+                normalAdmitted++;
+            }
         }
+        done = true;
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        engine.stop();
+    }
+    size_t floodTotalOffered = 0, floodTotalAdmitted = 0;
+    for (size_t f = 0; f < flooders; f++)
+    {
+        floodTotalOffered += floodOffered[f];
+        floodTotalAdmitted += floodAdmitted[f];
     }
+    cout << "class\toffered\tadmitted\tadmitted %\tadmitted/s per user\n";
+    cout << "normal\t" << normalOffered << "\t" << normalAdmitted << "\t" << (normalOffered == 0 ? 0.0 : 100.0 * normalAdmitted / normalOffered)
+         << "\t" << (normalUsers == 0 ? 0.0 : normalAdmitted / seconds / normalUsers) << "\n";
+    cout << "flooder\t" << floodTotalOffered << "\t" << floodTotalAdmitted << "\t"
+         << (floodTotalOffered == 0 ? 0.0 : 100.0 * floodTotalAdmitted / floodTotalOffered) << "\t"
+         << (flooders == 0 ? 0.0 : floodTotalAdmitted / seconds / flooders) << "\n";
+    cout << "limiter\tadmitted\t" << limiter.getAdmitted() << "\tuser limited\t" << limiter.getUserLimited()
+         << "\tglobal limited\t" << limiter.getGlobalLimited() << "\n";
 
-    void sendTextMessage()
+    // Backpressure: one chat is flooded through a single ingest worker while another producer
+    // spreads messages over the other chats; compare their wait when the flooded chat may fill
+    // the whole shard queue and when its backlog is bounded
+    cout << "chat backlog bound\tother chats p50 us\tp99 us\tmax us\tflooded chat max queued\n";
+    const size_t spread = 20000, flood = 400000, shardQueue = 4096;
+    for (uint32_t bound : {static_cast<uint32_t>(shardQueue), 256u})
     {
-        try
+        // Indexed, so applying a message costs about what it does in the platform
+        SearchIndex index;
+        ChatServices indexed;
+        indexed.search = &index;
+        ConversationRegistry chats;
+        vector<Conversation *> others;
+        for (size_t i = 0; i < 100; i++)
         {
-            cout << "Enter your message:\n";
-            string input;
-            getline(cin, input);
-            messages.push_back(new TextMessage(input)); // Store each message
+            others.push_back(chats.open("other" + to_string(i), &indexed));
         }
-        catch (const exception &e)
+        Conversation *target = chats.open("flooded", &indexed);
+        vector<uint32_t> waits;
+        waits.reserve(spread);
+        uint32_t maxQueued = 0;
         {
-            cout << "An error occurred while sending the text message: " << e.what() << endl;
+            IngestEngine engine(1, shardQueue, bound);
+            thread flooder([&]()
+            {
+                for (size_t i = 0; i < flood; i++)
+                {
+                    engine.submit(target, MessageKind::Text, MessageDirection::Received, "flood warning");
+                }
+            });
+            // Measure once the flood has built up its backlog
+            while (target->getQueued().load(memory_order_relaxed) < bound - 1)
+            {
+                this_thread::yield();
+            }
+            for (size_t i = 0; i < spread; i++)
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                engine.submit(others[i % others.size()], MessageKind::Text, MessageDirection::Sent, "hello there");
+                waits.push_back(static_cast<uint32_t>(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count()));
+                uint32_t queued = target->getQueued().load(memory_order_relaxed);
+                maxQueued = queued > maxQueued ? queued : maxQueued;
+            }
+            flooder.join();
+            engine.stop();
         }
+        sort(waits.begin(), waits.end());
+        cout << bound << "\t" << waits[waits.size() / 2] << "\t" << waits[waits.size() * 99 / 100] << "\t" << waits.back() << "\t" << maxQueued << "\n";
+        checksum += target->getMessages().size();
     }
+    cout << "checksum " << checksum << "\n";
+    return 0;
+}
+
+// Exports synthetic history in both formats and imports it back into empty registries,
+// reporting MB/s each way, resident memory, and whether every message survived the trip
+int runTransferBenchmark(size_t messages, size_t contacts, uint64_t seed, size_t threads)
+{
+    ios::sync_with_stdio(false);
+    cout << "Transfer benchmark: " << messages << " messages across " << contacts << " contacts, seed " << seed << ", " << threads
+         << " threads\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
 
-    void sendImageMessage()
+    WorkloadGenerator generator(contacts, seed);
+    Inbox inbox;
+    ChatServices services;
+    services.inbox = &inbox;
+    ConversationRegistry conversations;
+    vector<Conversation *> byContact(contacts, nullptr);
+    for (size_t i = 0; i < contacts; i++)
     {
-        try
+        byContact[i] = conversations.open(generator.getContacts()[i], &services);
+    }
+    // A few groups, so their membership goes through the export too
+    for (size_t g = 0; g < 8 && contacts > 0; g++)
+    {
+        GroupConversation *group = conversations.openGroup("group" + to_string(g), &services);
+        for (size_t m = 0; m < 4; m++)
         {
-            cout << "Enter the filename of the image (Add .jpg at end):\n";
-            string input;
-            getline(cin, input);
-            messages.push_back(new ImageMessage(input)); // Store each message
+            group->addMember(byContact[(g * 4 + m) % contacts]);
         }
-        catch (const exception &e)
+    }
+    {
+        BenchmarkScenario scenario("ingest");
+        for (size_t i = 0; i < messages; i++)
         {
-            cout << "An error occurred while sending the image message: " << e.what() << endl;
+            TrafficItem item = generator.next();
+            byContact[item.contact]->addMessage(item.kind, item.direction, item.content);
         }
+        scenario.finish(messages);
     }
 
-    void sendVoiceNoteMessage()
+    const TransferFormat formats[] = {TransferFormat::Json, TransferFormat::Binary};
+    const char *const paths[] = {"bench.export.json", "bench.export.bin"};
+    bool ok = true;
+    for (int f = 0; f < 2; f++)
     {
-        try
+        TransferStats exported;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
         {
-            cout << "Enter the filename of the voice note (Add .acc at end):\n";
-            string input;
-            getline(cin, input);
-            messages.push_back(new VoiceNoteMessage(input)); // Store each message
+            BenchmarkScenario scenario(f == 0 ? "export json" : "export binary");
+            exported = exportConversations(conversations, formats[f], paths[f], threads);
+            scenario.finish(exported.messages);
         }
-        catch (const exception &e)
+        double exportSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        Inbox importedInbox;
+        ChatServices importedServices;
+        importedServices.inbox = &importedInbox;
+        ConversationRegistry imported;
+        TransferStats read;
+        start = chrono::steady_clock::now();
         {
-            cout << "An error occurred while sending the voice note message: " << e.what() << endl;
+            BenchmarkScenario scenario(f == 0 ? "import json" : "import binary");
+            read = importConversations(paths[f], imported, &importedServices, threads);
+            scenario.finish(read.messages);
         }
-    }
+        double importSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double mib = static_cast<double>(exported.bytes) / (1024 * 1024);
+        cout << (f == 0 ? "json" : "binary") << "\tfile MiB\t" << static_cast<uint64_t>(mib) << "\texport MB/s\t"
+             << static_cast<uint64_t>(exportSeconds > 0 ? mib / exportSeconds : 0) << "\timport MB/s\t"
+             << static_cast<uint64_t>(importSeconds > 0 ? mib / importSeconds : 0) << "\n";
 
-    void receiveMessage()
-    {
-        try
+        // Every conversation must come back with the same messages, timestamps and members
+        size_t mismatches = 0;
+        for (const auto &convo : conversations)
         {
-            int ch;
-            do
+            const Conversation *copy = imported.find(convo->getUsername());
+            if (copy == nullptr || copy->getMessages().size() != convo->getMessages().size())
             {
-                // Clear the screen
-                cout << "\n\t\t-----------------------------\n";
-                cout << "\t\tSelect type of message to receive:\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "\t\t1. Receive Text Message\n";
-                cout << "\t\t2. Receive Image Message\n";
-                cout << "\t\t3. Receive Voice Note Message\n";
-                cout << "\t\t4. Back\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "Enter your choice: ";
-                cin >> ch;
-                cin.ignore(); // Clear newline character from buffer
-
-                switch (ch)
-                {
-                case 1:
-                    receiveTextMessage();
-                    break;
-                case 2:
-                    receiveImageMessage();
-                    break;
-                case 3:
-                    receiveVoiceNoteMessage();
-                    break;
-                case 4:
-                    break;
-                default:
-                    cout << "Invalid choice!\n";
-                }
-            } while (ch != 4);
-        }
-        catch (const exception &e)
-        {
-            cout << "An error occurred while receiving the message: " << e.what() << endl;
+                mismatches++;
+                continue;
+            }
+            const MessageStore &a = convo->getMessages();
+            const MessageStore &b = copy->getMessages();
+            for (size_t i = 0; i < a.size(); i++)
+            {
+                const MessageRecord &x = a.record(i);
+                const MessageRecord &y = b.record(i);
+                mismatches += x.kind != y.kind || x.direction != y.direction || a.timestamp(i) != b.timestamp(i) ||
+                              string_view(x.payload, x.length) != string_view(y.payload, y.length);
+            }
+            const GroupConversation *group = dynamic_cast<const GroupConversation *>(convo);
+            if (group != nullptr)
+            {
+                const GroupConversation *groupCopy = dynamic_cast<const GroupConversation *>(copy);
+                mismatches += groupCopy == nullptr || groupCopy->getMembers().size() != group->getMembers().size();
+            }
         }
+        cout << "conversations\t" << read.conversations << " of " << exported.conversations << "\tmessages\t" << read.messages << " of "
+             << messages << "\tmismatches\t" << mismatches << "\n";
+        ok = ok && mismatches == 0 && read.messages == messages && read.conversations == conversations.size();
+        remove(paths[f]);
     }
+    return ok ? 0 : 1;
+}
 
-    void receiveTextMessage()
+// Registers many conversations and reports what each one costs: its object size, resident memory
+// per conversation (including the interned names and the registry), the shared StringPool, and the
+// speed of scanning for a user by handle, lookups by name and message type labels
+int runInternBenchmark(size_t count, uint64_t seed)
+{
+    ios::sync_with_stdio(false);
+    cout << "Interning benchmark: " << count << " conversations, seed " << seed << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
+
+    // Half short names that fit a std::string inline, half longer ones that would not
+    vector<string> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; i++)
     {
-        try
-        {
-            cout << "Enter the received text message: ";
-            string input;
-            getline(cin, input);
-            messages.push_back(new ReceivedTextMessage(input)); // Store the received text message
-        }
-        catch (const exception &e)
+        names.push_back(i % 2 == 0 ? "user" + to_string(i) : "member." + to_string(i) + "@chat.example.org");
+    }
+    size_t poolBefore = StringPool::instance().memoryUsage();
+    size_t residentBefore = residentBytes();
+    ConversationRegistry conversations;
+    {
+        BenchmarkScenario scenario("open conversations");
+        for (size_t i = 0; i < count; i++)
         {
-            cout << "An error occurred while receiving the text message: " << e.what() << endl;
+            conversations.open(names[i], nullptr);
         }
+        scenario.finish(count);
+    }
+    size_t resident = residentBytes() - residentBefore;
+    size_t logical = 0;
+    for (const auto &convo : conversations)
+    {
+        logical += convo->memoryUsage();
     }
+    size_t pool = StringPool::instance().memoryUsage() - poolBefore;
+    cout << "sizeof conversation\t" << sizeof(MultimediaConversation) << "\tbytes/conversation\t" << (count == 0 ? 0 : logical / count)
+         << "\tRSS bytes/conversation\t" << (count == 0 ? 0 : resident / count) << "\tstring pool bytes/name\t" << (count == 0 ? 0 : pool / count)
+         << "\n";
 
-    void receiveImageMessage()
+    mt19937_64 random(seed);
+    size_t checksum = 0;
+    size_t scans = count == 0 ? 0 : 20;
     {
-        try
+        BenchmarkScenario scenario("scan for user, conversations");
+        for (size_t k = 0; k < scans; k++)
         {
-            cout << "Enter the filename of the received image (Add .jpg at end): ";
-            string input;
-            getline(cin, input);
-            messages.push_back(new ReceivedImageMessage(input)); // Store the received image message
+            UserId id = StringPool::instance().intern(names[random() % count]);
+            for (const auto &convo : conversations)
+            {
+                checksum += convo->getUserId() == id;
+            }
         }
-        catch (const exception &e)
+        scenario.finish(scans * count);
+    }
+    size_t lookups = count == 0 ? 0 : 1000000;
+    {
+        BenchmarkScenario scenario("find by name");
+        for (size_t k = 0; k < lookups; k++)
         {
-            cout << "An error occurred while receiving the image message: " << e.what() << endl;
+            checksum += conversations.find(names[random() % count]) != nullptr;
         }
+        scenario.finish(lookups);
     }
-
-    void receiveVoiceNoteMessage()
     {
-        try
+        vector<MessageRecord> records(1000000);
+        for (size_t i = 0; i < records.size(); i++)
         {
-            cout << "Enter the filename of the received voice note (Add .acc at end): ";
-            string input;
-            getline(cin, input);
-            messages.push_back(new ReceivedVoiceNoteMessage(input)); // Store the received voice note message
+            records[i] = MessageRecord{"x", 1, static_cast<MessageKind>(i % 3), static_cast<MessageDirection>(i % 2)};
         }
-        catch (const exception &e)
+        BenchmarkScenario scenario("message type label");
+        for (const MessageRecord &record : records)
         {
-            cout << "An error occurred while receiving the voice note message: " << e.what() << endl;
+            checksum += Message(&record).getType().size();
         }
+        scenario.finish(records.size());
     }
-};
+    cout << "checksum " << checksum << "\n";
+    return 0;
+}
 
-void displayConversations(const vector<Conversation *> &conversations)
+#ifdef HAVE_COROUTINES
+// Line step of the scripted session for one contact: start a chat and send to it, receive
+// from it, send again through the user lookup, view it, search, then exit
+string sessionScriptLine(size_t step, const string &contact, WorkloadGenerator &generator)
 {
-    // Clear the screen
-    cout << "\t\t----------------\n";
-    cout << "\t\tCHATS:\n";
-    cout << "\t\t----------------\n";
-    for (const auto &convo : conversations)
+    switch (step)
     {
-        cout << "\t\t" << convo->getUsername() << endl;
+    case 0:
+        return "1";
+    case 1:
+        return contact;
+    case 2:
+        return "1";
+    case 3:
+        return generator.nextWord() + " " + generator.nextWord();
+    case 4:
+        return "2";
+    case 5:
+        return "IMG_" + contact + ".jpg";
+    case 6:
+        return "4";
+    case 7:
+        return "4";
+    case 8:
+        return contact;
+    case 9:
+        return "1";
+    case 10:
+        return generator.nextWord();
+    case 11:
+        return "4";
+    case 12:
+        return "3";
+    case 13:
+        return contact;
+    case 14:
+        return "3";
+    case 15:
+        return "voice_" + contact + ".ogg";
+    case 16:
+        return "4";
+    case 17:
+        return "2";
+    case 18:
+        return contact;
+    case 19:
+        return "5";
+    case 20:
+        return generator.nextWord();
+    default:
+        return "6";
     }
+}
 
-    string user;
-    cout << "\nEnter the username whose conversation you want to see: ";
-    getline(cin, user);
+const size_t SESSION_SCRIPT_LENGTH = 22;
 
-    bool userFound = false;
+// Drives many scripted menu sessions concurrently on one thread: each round delivers the next
+// line to every session and runs the loop once, so all of them are suspended mid-flow at once
+int runSessionBenchmark(size_t sessionCount, uint64_t seed)
+{
+    ios::sync_with_stdio(false);
+    cout << "Session benchmark: " << sessionCount << " scripted sessions on one thread, seed " << seed << "\n";
+    cout << "scenario\tops\tops/sec\tallocs/op\tRSS MiB\n";
 
-    // Check if the user exists in the CHATS
-    for (const auto &convo : conversations)
+    WorkloadGenerator generator(sessionCount, seed);
+    SearchIndex search;
+    Inbox inbox;
+    ChatServices services;
+    services.search = &search;
+    services.inbox = &inbox;
+    ConversationRegistry conversations;
+    SessionLoop loop;
+    vector<unique_ptr<ChatSession>> sessions;
+    sessions.reserve(sessionCount);
+
+    size_t residentBefore = residentBytes();
+    {
+        BenchmarkScenario scenario("start sessions");
+        for (size_t i = 0; i < sessionCount; i++)
+        {
+            sessions.emplace_back(new ChatSession(loop, conversations, &services));
+            sessions.back()->start();
+        }
+        loop.run();
+        scenario.finish(sessionCount);
+    }
+    size_t residentIdle = residentBytes();
+
+    size_t lines = 0, resumes = 0, outputBytes = 0;
     {
-        if (convo->getUsername() == user)
+        BenchmarkScenario scenario("scripted session lines");
+        for (size_t step = 0; step < SESSION_SCRIPT_LENGTH; step++)
         {
-            userFound = true;
-            cout << "\n\t--------------------\n";
-            cout << "\tConversation with " << user << ":\n";
-            cout << "\t----------------------\n";
-            for (const auto &message : convo->getMessages())
+            for (size_t i = 0; i < sessionCount; i++)
             {
-                cout << message->getType() << ": " << message->getContent() << endl;
+                sessions[i]->deliver(sessionScriptLine(step, generator.getContacts()[i], generator));
+            }
+            lines += sessionCount;
+            resumes += loop.run();
+            for (auto &session : sessions)
+            {
+                outputBytes += session->getOutput().size();
+                session->getOutput().clear();
             }
-            break;
         }
+        scenario.finish(lines);
     }
 
-    if (!userFound)
+    size_t finished = 0;
+    for (const auto &session : sessions)
     {
-        cout << "User " << user << " not found in the CHATS!\n";
+        finished += session->finished();
     }
+    cout << "sessions finished\t" << finished << " of " << sessionCount << "\tresumes\t" << resumes
+         << "\tconversations\t" << conversations.size() << "\toutput bytes\t" << outputBytes << "\n";
+    cout << "idle session bytes\t" << (sessionCount == 0 || residentIdle < residentBefore ? 0 : (residentIdle - residentBefore) / sessionCount) << "\n";
+    return finished == sessionCount ? 0 : 1;
 }
+#endif
 
-void sendMessageToUser(vector<Conversation *> &conversations, const string &user)
+// Logout message and farewell banner shown when the user exits the menu
+void printFarewell()
 {
-    // Check if the user exists in the CHATS
-    bool userFound = false;
-    for (auto &convo : conversations)
+    cout << "\n\t\t===============================================\n";
+    cout << "\t\tLogging Out...";
+    cout << endl;
+
+    cout << "\t\tLogged Out Successfully.";
+    cout << "\n\t\t===============================================\n";
+    cout << endl<<endl<<endl<<endl;
+    cout << "\t\t--------------------------------------------------------------" << endl;
+    cout << "\t\t\t   Thank you for choosing our messaging platform! " << endl;
+    cout << "\t\t--------------------------------------------------------------" << endl;
+    cout <<  "\tTTTTTTTTTT  HH    HH   AAAA    NN     NN  KK    KK  YYY YYY   OOOOO  UU    UU" << endl;
+    cout <<  "\t    TT      HH    HH  AA  AA   NNN    NN  KK  KK     YY YY   OO   OO UU    UU" << endl;
+    cout <<  "\t    TT      HHHHHHHH  AAAAAA   NN NN  NN  KKKK        YYY    OO   OO UU    UU" << endl;
+    cout <<  "\t    TT      HH    HH  AA  AA   NN  NN NN  KK  KK      YYY    OO   OO UU    UU" << endl;
+    cout <<  "\t    TT      HH    HH  AA  AA   NN    NNN  KK    KK    YYY     OOOOO   UUUUUU" << endl;
+    cout << "\t\t--------------------------------------------------------------" << endl;
+    cout << "\t\t\t     Your support means the world to us. " << endl;
+    cout << "\t\t--------------------------------------------------------------" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    try
     {
-        if (convo->getUsername() == user)
+        // Leading --history-budget <MiB>, --rate-limit <user/s> <global/s>, --files <dir> and
+        // --checkpoint <MiB> apply to every mode
+        size_t historyBudget = DEFAULT_HISTORY_BUDGET;
+        RateLimits limits;
+        string fileDirectory;
+        uint64_t checkpointBytes = DEFAULT_CHECKPOINT_BYTES;
+        for (;;)
         {
-            userFound = true;
-            int ch;
-            do
+            if (argc > 2 && string(argv[1]) == "--history-budget")
             {
-                // Clear the screen
-                cout << "\n\t\t-----------------------------\n";
-                cout << "\t\tSelect type of message:\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "\t\t1. Send Text Messages\n";
-                cout << "\t\t2. Send Image or GIF\n";
-                cout << "\t\t3. Send Voice Note\n";
-                cout << "\t\t4. Back\n";
-                cout << "\t\t-----------------------------\n";
-                cout << "Enter your choice: ";
-                cin >> ch;
-                cin.ignore(); // Clear newline character from buffer
-
-                try
-                {
-                    switch (ch)
-                    {
-                    case 1:
-                    {
-                        cout << "Enter your message to " << user << ": ";
-                        string message;
-                        getline(cin, message);
-                        convo->getMutableMessages().push_back(new TextMessage(message)); // Add the message to the user's conversation
-                        cout << "Message sent to " << user << "!\n\n";
-                        break;
-                    }
-                    case 2:
-                    {
-                        cout << "Enter the filename of the image (Add .jpg at end): ";
-                        string message;
-                        getline(cin, message);
-                        convo->getMutableMessages().push_back(new ImageMessage(message)); // Add the message to the user's conversation
-                        cout << "Image sent to " << user << "!\n\n";
-                        break;
-                    }
-                    case 3:
-                    {
-                        cout << "Enter the filename of the voice note (Add .acc at end): ";
-                        string message;
-                        getline(cin, message);
-                        convo->getMutableMessages().push_back(new VoiceNoteMessage(message)); // Add the message to the user's conversation
-                        cout << "Voice Note sent to " << user << "!\n\n";
-                        break;
-                    }
-                    case 4:
-                        break;
-                    default:
-                        cout << "Invalid choice!\n";
-                    }
-                }
-                catch (const exception &e)
+                historyBudget = static_cast<size_t>(stoull(argv[2])) << 20;
+                argc -= 2;
+                argv += 2;
+            }
+            else if (argc > 3 && string(argv[1]) == "--rate-limit")
+            {
+                // Bursts of up to one second's worth of messages are let through
+                limits.userRate = limits.userBurst = stod(argv[2]);
+                limits.globalRate = limits.globalBurst = stod(argv[3]);
+                argc -= 3;
+                argv += 3;
+            }
+            else if (argc > 2 && string(argv[1]) == "--files")
+            {
+                fileDirectory = argv[2];
+                argc -= 2;
+                argv += 2;
+            }
+            else if (argc > 2 && string(argv[1]) == "--checkpoint")
+            {
+                checkpointBytes = static_cast<uint64_t>(stoull(argv[2])) << 20;
+                argc -= 2;
+                argv += 2;
+            }
+            else
+            {
+                break;
+            }
+        }
+        if (argc > 1 && string(argv[1]) == "--ingest-load")
+        {
+            size_t messages = argc > 2 ? stoull(argv[2]) : 10000000;
+            size_t contacts = argc > 3 ? stoull(argv[3]) : 10000;
+            return runIngestLoad(messages, contacts);
+        }
+        if (argc > 1 && string(argv[1]) == "--rate-bench")
+        {
+            double seconds = argc > 2 ? stod(argv[2]) : 2;
+            size_t normalUsers = argc > 3 ? stoull(argv[3]) : 1000;
+            size_t flooders = argc > 4 ? stoull(argv[4]) : 4;
+            return runRateBenchmark(seconds, normalUsers, flooders);
+        }
+        if (argc > 1 && string(argv[1]) == "--bench")
+        {
+            size_t messages = argc > 2 ? stoull(argv[2]) : 1000000;
+            size_t contacts = argc > 3 ? stoull(argv[3]) : 10000;
+            uint64_t seed = argc > 4 ? stoull(argv[4]) : 42;
+            return runBenchmarks(messages, contacts, seed);
+        }
+        if (argc > 1 && string(argv[1]) == "--snapshot-bench")
+        {
+            size_t messages = argc > 2 ? stoull(argv[2]) : 10000000;
+            size_t contacts = argc > 3 ? stoull(argv[3]) : 10000;
+            uint64_t seed = argc > 4 ? stoull(argv[4]) : 42;
+            return runSnapshotBenchmark(messages, contacts, seed);
+        }
+        if (argc > 1 && string(argv[1]) == "--log-bench")
+        {
+            size_t messages = argc > 2 ? stoull(argv[2]) : 2000000;
+            size_t contacts = argc > 3 ? stoull(argv[3]) : 10000;
+            uint64_t seed = argc > 4 ? stoull(argv[4]) : 42;
+            return runLogBenchmark(messages, contacts, seed);
+        }
+        if (argc > 1 && string(argv[1]) == "--metrics-bench")
+        {
+            size_t messages = argc > 2 ? stoull(argv[2]) : 500000;
+            size_t contacts = argc > 3 ? stoull(argv[3]) : 10000;
+            uint64_t seed = argc > 4 ? stoull(argv[4]) : 42;
+            double uninstrumentedNanos = argc > 5 ? stod(argv[5]) : 0;
+            return runMetricsBenchmark(messages, contacts, seed, uninstrumentedNanos);
+        }
+        if (argc > 1 && string(argv[1]) == "--attachment-bench")
+        {
+            string corpus = argc > 2 && string(argv[2]) != "-" ? argv[2] : "";
+            size_t sends = argc > 3 ? stoull(argv[3]) : 1000;
+            uint64_t seed = argc > 4 ? stoull(argv[4]) : 42;
+            return runAttachmentBenchmark(corpus, sends, seed);
+        }
+        if (argc > 1 && string(argv[1]) == "--intern-bench")
+        {
+            size_t conversations = argc > 2 ? stoull(argv[2]) : 1000000;
+            uint64_t seed = argc > 3 ? stoull(argv[3]) : 42;
+            return runInternBenchmark(conversations, seed);
+        }
+        if (argc > 1 && string(argv[1]) == "--export-bench")
+        {
+            size_t messages = argc > 2 ? stoull(argv[2]) : 20000000;
+            size_t contacts = argc > 3 ? stoull(argv[3]) : 10000;
+            uint64_t seed = argc > 4 ? stoull(argv[4]) : 42;
+            size_t threads = argc > 5 ? stoull(argv[5]) : thread::hardware_concurrency();
+            return runTransferBenchmark(messages, contacts, seed, threads == 0 ? 1 : threads);
+        }
+        if (argc > 1 && string(argv[1]) == "--sessions")
+        {
+#ifdef HAVE_COROUTINES
+            size_t sessions = argc > 2 ? stoull(argv[2]) : 50000;
+            uint64_t seed = argc > 3 ? stoull(argv[3]) : 42;
+            return runSessionBenchmark(sessions, seed);
+#else
+            throw runtime_error("Chat sessions need a C++20 build (coroutines)");
+#endif
+        }
+        if (argc > 1 && (string(argv[1]) == "--serve" || string(argv[1]) == "--load-client"))
+        {
+#ifdef __linux__
+            string address = argc > 2 ? argv[2] : "chat.sock";
+            if (string(argv[1]) == "--load-client")
+            {
+                size_t connections = argc > 3 ? stoull(argv[3]) : 1000;
+                size_t requests = argc > 4 ? stoull(argv[4]) : 100;
+                return runLoadClient(address, connections, requests);
+            }
+            ChatPlatform platform(historyBudget, limits);
+            // Clients only ever name files inside this directory
+            platform.services.fileDirectory = fileDirectory.empty() ? SERVER_FILE_DIRECTORY : fileDirectory;
+            platform.checkpointBytes = checkpointBytes;
+            filesystem::create_directories(platform.services.fileDirectory);
+            ChatServer server(platform, address, argc > 3 ? stoull(argv[3]) : 1);
+            cerr << "Serving on " << address << "\n";
+            server.run();
+            return 0;
+#else
+            throw runtime_error("The chat server needs Linux (epoll)");
+#endif
+        }
+        if (argc > 1 && string(argv[1]) == "--batch")
+        {
+            if (argc > 2 && string(argv[2]) != "-")
+            {
+                ifstream in(argv[2]);
+                if (!in)
                 {
-                    cout << "An error occurred: " << e.what() << endl;
+                    throw runtime_error(string("Cannot open ") + argv[2]);
                 }
-            } while (ch != 4);
-            return;
+                return runBatch(in, historyBudget, limits, fileDirectory, checkpointBytes);
+            }
+            return runBatch(cin, historyBudget, limits, fileDirectory, checkpointBytes);
         }
-    }
-
-    if (!userFound)
-    {
-        cout << "User " << user << " not found in the CHATS!\n";
-    }
-}
 
-int main()
-{
-    try
-    {
         cout << "\t\t--------------------------------------------------------------" << endl;
         cout << "\t\t\t   Blast off into the world of messaging! " << endl;
         cout << "\t\t--------------------------------------------------------------" << endl;
@@ -511,7 +10399,9 @@ int main()
         cout << "\t\t\t   Step into our colorful chat universe! " << endl;
         cout << "\t\t--------------------------------------------------------------" << endl;
         char ch;
-        string cuname = "shantanu", cpass = "shantanu", uname, pass;
+        string cuname, cpass, uname, pass;
+        CredentialStore accounts;
+        accounts.createAccount("shantanu", "shantanu");
         cout << "\n\t\t===============================================\n";
         cout << "\t\tEnter Login (L) or Create Account (C): ";
         cin >> ch;
@@ -526,7 +10416,12 @@ int main()
             getline(cin, cuname);
             cout << "\t\tEnter Password: ";
             getline(cin, cpass);
+            if (!accounts.createAccount(cuname, cpass))
+            {
+                throw invalid_argument("Username " + cuname + " is already taken.");
+            }
             cout << "\t\tAccount Created successfully\n\n";
+            [[fallthrough]];
         case 'l':
         case 'L':
             cout << "\t\tEnter Login Details: " << endl;
@@ -534,7 +10429,7 @@ int main()
             getline(cin, uname);
             cout << "\t\tEnter Password: ";
             getline(cin, pass);
-            if (cuname == uname && cpass == pass)
+            if (accounts.verifyLogin(uname, pass))
             {
                 cout << "\t\tLogin Successful\n"
                      << endl;
@@ -552,7 +10447,14 @@ int main()
             throw invalid_argument("Invalid choice! Please enter 'L' for login or 'C' for create account.");
         }
 
-        vector<Conversation *> conversations;
+        // Restore earlier history
+        ChatPlatform platform(historyBudget, limits);
+        platform.checkpointBytes = checkpointBytes;
+#ifdef HAVE_COROUTINES
+        runInteractiveSession(platform);
+        printFarewell();
+#else
+        ConversationRegistry &conversations = platform.conversations;
         int choice;
 
         if (conversations.empty())
@@ -572,7 +10474,8 @@ int main()
             cout << "\t\t2. View CHATS\n";
             cout << "\t\t3. Send message to specific user\n";
             cout << "\t\t4. Receive message\n";
-            cout << "\t\t5. Exit\n";
+            cout << "\t\t5. Search messages\n";
+            cout << "\t\t6. Exit\n";
             cout << "\t\t-----------------------------\n";
             cout << "Enter your choice: ";
             cin >> choice;
@@ -584,9 +10487,15 @@ int main()
             {
                 try
                 {
-                    Conversation *newConversation = new MultimediaConversation();
-                    newConversation->startConversation();
-                    conversations.push_back(newConversation);
+                    // Starting a chat with a known user continues the existing conversation
+                    string user;
+                    cout << "Enter the username you want to send a message to: ";
+                    getline(cin, user);
+                    {
+                        ScopedTimer timer(Operation::StartConversation);
+                        conversations.open(user, &platform.services);
+                    }
+                    sendMessageToUser(conversations, user);
                 }
                 catch (const exception &e)
                 {
@@ -602,7 +10511,7 @@ int main()
                 }
                 else
                 {
-                    displayConversations(conversations);
+                    displayConversations(conversations, platform.inbox);
                 }
                 break;
             }
@@ -627,60 +10536,38 @@ int main()
                 cout << "Enter the username from whom messages received: ";
                 getline(cin, user);
 
-                bool existingConversation = false;
-                // Check if the user exists in the CHATS
-                for (auto &convo : conversations)
-                {
-                    if (convo->getUsername() == user)
-                    {
-                        existingConversation = true;
-                        static_cast<MultimediaConversation *>(convo)->receiveMessage();
-                        break;
-                    }
-                }
-
-                if (!existingConversation)
-                {
-                    Conversation *newConversation = new MultimediaConversation();
-                    newConversation->startreceivedConversation();
-                    conversations.push_back(newConversation);
-                }
+                // Messages from a new user start a conversation with them
+                static_cast<MultimediaConversation *>(conversations.open(user, &platform.services))->receiveMessage();
 
                 break;
             }
             case 5:
+            {
+                string query;
+                cout << "Enter a word to search for (end it with * to match prefixes): ";
+                getline(cin, query);
+                cout.flush();
+                OutputBuffer out(fileno(stdout));
+                ScopedTimer timer(Operation::Search);
+                renderSearchResults(out, platform.search.search(query, 20));
+                break;
+            }
+            case 6:
             {
                 system("cls");
-                cout << "\n\t\t===============================================\n";
-                cout << "\t\tLogging Out...";
-                cout << endl;
-
-                cout << "\t\tLogged Out Successfully.";
-                cout << "\n\t\t===============================================\n";
-                cout << endl<<endl<<endl<<endl;
-                cout << "\t\t--------------------------------------------------------------" << endl;
-                cout << "\t\t\t   Thank you for choosing our messaging platform! " << endl;
-                cout << "\t\t--------------------------------------------------------------" << endl;
-                cout <<  "\tTTTTTTTTTT  HH    HH   AAAA    NN     NN  KK    KK  YYY YYY   OOOOO  UU    UU" << endl;
-                cout <<  "\t    TT      HH    HH  AA  AA   NNN    NN  KK  KK     YY YY   OO   OO UU    UU" << endl;
-                cout <<  "\t    TT      HHHHHHHH  AAAAAA   NN NN  NN  KKKK        YYY    OO   OO UU    UU" << endl;
-                cout <<  "\t    TT      HH    HH  AA  AA   NN  NN NN  KK  KK      YYY    OO   OO UU    UU" << endl;
-                cout <<  "\t    TT      HH    HH  AA  AA   NN    NNN  KK    KK    YYY     OOOOO   UUUUUU" << endl;
-                cout << "\t\t--------------------------------------------------------------" << endl;
-                cout << "\t\t\t     Your support means the world to us. " << endl;
-                cout << "\t\t--------------------------------------------------------------" << endl;
+                printFarewell();
                 break;
             }
             default:
                 cout << "Invalid choice! Try again...\n";
             }
-        } while (choice != 5);
 
-        // Clean up dynamic memory
-        for (auto convo : conversations)
-        {
-            delete convo;
-        }
+            // Group commit everything this operation sent, then spill history over the budget
+            platform.log->flush();
+            platform.tier.trim();
+            platform.checkpoint();
+        } while (choice != 6);
+#endif
     }
     catch (const exception &e)
     {